@@ -1,3 +1,12 @@
 mkdir -p build
-gcc -Wall -std=c99 ./demos/request.c -o ./build/request
-gcc -Wall -std=c99 ./demos/server.c -o ./build/server
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./demos/request.c -o ./build/request
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./demos/server.c -o ./build/server
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/replay.c -o ./build/replay
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/resolve_test.c -o ./build/resolve_test
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/hpack_test.c -o ./build/hpack_test
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/ws_test.c -o ./build/ws_test
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/multipart_test.c -o ./build/multipart_test
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/path_test.c -o ./build/path_test
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/proxy_test.c -o ./build/proxy_test
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/cache_test.c -o ./build/cache_test
+gcc -Wall -std=c99 -D_GNU_SOURCE -pthread ./tools/ratelimit_test.c -o ./build/ratelimit_test
@@ -17,6 +17,15 @@ void randnum_handler(void *ctx, HTTP_Request *req, HTTP_Response *resp) {
 	http_resp_set_body(resp, (uint8_t *) strdup(buf), strlen(buf));
 }
 
+// Pushes a fresh number to every /randnum/ws subscriber.
+void randnum_tick(void *ctx) {
+	HTTP_Server *serv = (HTTP_Server *) ctx;
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%f", (float) rand() / RAND_MAX);
+	http_ws_broadcast(serv, "/randnum/ws", HTTP_WS_OP_TEXT, buf, (size_t) len);
+}
+
 int main(void) {
 	signal(SIGPIPE, SIG_IGN);
 	srand(time(0));
@@ -24,6 +33,8 @@ int main(void) {
 	HTTP_Server serv = http_server_create(3000);
 
 	http_server_handle(&serv, "/randnum", randnum_handler, NULL);
+	http_server_websocket(&serv, "/randnum/ws", NULL, NULL, NULL, NULL);
+	http_server_tick(&serv, 1000, randnum_tick, &serv);
 
 	if (http_server_serve_file(&serv, "/", CONTENT_TYPE_TEXT_HTML, "./files/index.html") != 0) {
 		fprintf(stderr, "failed to register /index.html\n");
@@ -9,12 +9,14 @@
  *   - HTTP Client:
  *       • Build and send HTTP requests (GET, POST, etc.)
  *       • Parse HTTP responses
+ *       • Pipelined request batches on a keep-alive connection
  *       • Header and body management
  *
  *   - HTTP Server:
  *       • Create lightweight HTTP servers
  *       • Register request handlers by route
  *       • Built-in error handling
+ *       • Connection limits, timeouts and overload shedding
  *
  *   - Utilities:
  *       • String builder for efficient text operations
@@ -29,6 +31,9 @@
  *       #define HTTP_IMPLEMENTATION
  *       #include "http.h"
  *
+ *   - Build with -DHTTP_USDT to compile in USDT probes (provider "http")
+ *     for bpftrace/perf; this needs <sys/sdt.h> from systemtap-sdt-dev.
+ *
  * License:
  *   MIT License
  *
@@ -37,6 +42,13 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // splice(2)
+#endif
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
@@ -61,9 +73,32 @@
 #include <netinet/in.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define UNUSED(x) (void)(x)
 
+// Static tracepoints. Without HTTP_USDT they compile to nothing, and
+// their arguments are not evaluated.
+#ifdef HTTP_USDT
+#include <sys/sdt.h>
+#define HTTP_PROBE1(name, a) DTRACE_PROBE1(http, name, a)
+#define HTTP_PROBE2(name, a, b) DTRACE_PROBE2(http, name, a, b)
+#define HTTP_PROBE3(name, a, b, c) DTRACE_PROBE3(http, name, a, b, c)
+#else
+#define HTTP_PROBE1(name, a) ((void)0)
+#define HTTP_PROBE2(name, a, b) ((void)0)
+#define HTTP_PROBE3(name, a, b, c) ((void)0)
+#endif
+
 #define PROTOCOL "HTTP/1.1"
 
 // 1xx - Informational
@@ -218,8 +253,12 @@ typedef struct {
 HTTP_StringBuilder http_sb_create(size_t cap);
 void http_sb_ensure_capacity(HTTP_StringBuilder *sb, size_t extra);
 void http_sb_append_str(HTTP_StringBuilder *sb, const char *s);
+void http_sb_append_strn(HTTP_StringBuilder *sb, const char *s, size_t len);
 void http_sb_append_strf(HTTP_StringBuilder *sb, const char *fmt, ...);
 void http_sb_append_char(HTTP_StringBuilder *sb, char ch);
+void http_sb_append_uint(HTTP_StringBuilder *sb, uint64_t v);
+void http_sb_append_status(HTTP_StringBuilder *sb, uint16_t code);
+void http_sb_append_header(HTTP_StringBuilder *sb, const char *key, const char *value);
 void http_sb_reset(HTTP_StringBuilder *sb);
 void http_sb_destroy(HTTP_StringBuilder *sb);
 char *http_sb_to_str(HTTP_StringBuilder sb);
@@ -242,6 +281,18 @@ void http_headers_add(HTTP_Headers *hh, HTTP_Header header);
 char *http_headers_get(HTTP_Headers *hh, const char *key);
 void http_headers_destroy(HTTP_Headers *hh);
 
+typedef struct {
+	const char *ptr;
+	size_t len;
+} HTTP_Slice;
+
+// A request-target split once into slices of the target string.
+typedef struct {
+	HTTP_Slice path;
+	HTTP_Slice query;    // after '?', empty if there is none
+	HTTP_Slice fragment; // after '#', empty if there is none
+} HTTP_Url;
+
 typedef struct {
 	char *method;
 	char *target;
@@ -249,6 +300,10 @@ typedef struct {
 	HTTP_Headers headers;
 	uint8_t *body;
 	size_t body_len;
+	HTTP_Url url;
+	char *path;          // url.path percent-decoded and normalized; used for routing
+	HTTP_Headers params; // decoded query parameters, filled by the first http_req_query
+	bool params_parsed;
 } HTTP_Request;
 
 #define http_req_ensure_method(req, resp, mt) \
@@ -258,12 +313,27 @@ typedef struct {
 	}
 
 HTTP_Request http_req_create();
-HTTP_Request http_req_parse(uint8_t *bytes, HTTP_Error *err);
+// Parses a request from the len bytes at bytes, which must be
+// NUL-terminated after the head. The body is the Content-Length bytes
+// after the head; all of them must be within len.
+HTTP_Request http_req_parse(uint8_t *bytes, size_t len, HTTP_Error *err);
 void http_req_add_header(HTTP_Request *hr, const char *key, const char *value);
 void http_req_set_status_line(HTTP_Request *hr, const char *method, const char *target);
 void http_req_set_body(HTTP_Request *hr, uint8_t *body, size_t len);
 void http_req_destroy(HTTP_Request *hr);
 char *http_req_header_to_str(HTTP_Request *hr);
+void http_req_header_to_sb(HTTP_Request *hr, HTTP_StringBuilder *sb);
+// Value of a query parameter ("+" and %XX decoded), or NULL.
+const char *http_req_query(HTTP_Request *hr, const char *key);
+
+HTTP_Url http_url_split(const char *target);
+// Decodes %XX escapes (and '+' as space in form mode) from src into dst,
+// which may be src itself. Malformed escapes are copied as they are.
+// Returns the decoded length; dst is not terminated.
+size_t http_percent_decode(char *dst, const char *src, size_t len, bool form);
+// Collapses repeated slashes and resolves "." and ".." segments in place
+// without climbing above the root. Returns the new length.
+size_t http_path_normalize(char *path, size_t len);
 
 typedef struct {
 	char *protocol;
@@ -281,24 +351,570 @@ void http_resp_set_status_line(HTTP_Response *hr, uint16_t status_code, const ch
 void http_resp_set_body(HTTP_Response *hr, uint8_t *body, size_t len);
 void http_resp_destroy(HTTP_Response *hr);
 char *http_resp_header_to_str(HTTP_Response *hr);
+void http_resp_header_to_sb(HTTP_Response *hr, HTTP_StringBuilder *sb);
 HTTP_Response http_make_request(HTTP_Request *req, const char *host, uint16_t port, HTTP_Error *err);
 
+// Pipelined client
+
+// A keep-alive connection to one host for batches of requests. The
+// connection is opened on first use and reopened after the server
+// closes it.
+
+#define HTTP_CLIENT_TIMEOUT_MS 30000 // inactivity before a batch fails
+#define HTTP_CLIENT_MAX_HEAD_BYTES 65536
+#define HTTP_CLIENT_MAX_BODY_BYTES (64u << 20)
+
+typedef struct {
+	int fd;
+	char *host;
+	uint16_t port;
+	uint8_t *in; // responses read but not parsed yet
+	size_t in_len;
+	size_t in_cap;
+	size_t chunk_scan; // offset in in of the next chunk size line, or 0
+	HTTP_StringBuilder chunked; // body decoded so far
+} HTTP_Client;
+
+HTTP_Client http_client_create(const char *host, uint16_t port);
+// Writes the requests back-to-back on the connection, then parses the
+// responses in order into resps. Returns how many responses were read;
+// on a shortfall *err is set and the remaining resps are left zeroed.
+// When the server announces Connection: close partway through, the
+// requests it did not answer are sent again on a new connection.
+size_t http_client_batch(HTTP_Client *c, HTTP_Request *reqs, size_t count, HTTP_Response *resps, HTTP_Error *err);
+void http_client_destroy(HTTP_Client *c);
+
+// Multipart
+
+// Incremental multipart/form-data parser. Feed it body bytes in chunks of
+// any size: part data is passed to on_data as slices of the fed buffer
+// (only a delimiter-sized tail is ever held back between calls), and each
+// header line as name/value slices. A non-zero callback return stops the
+// parser with an error.
+
+#define HTTP_MULTIPART_MAX_BOUNDARY 70
+#define HTTP_MULTIPART_MAX_HEADER_BYTES 8192
+
+typedef struct {
+	int (*on_part_begin)(void *ctx);
+	int (*on_header)(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len);
+	int (*on_data)(void *ctx, const uint8_t *data, size_t len);
+	int (*on_part_end)(void *ctx);
+} HTTP_MultipartCallbacks;
+
+typedef enum {
+	HTTP_MULTIPART_PREAMBLE = 0,
+	HTTP_MULTIPART_HEADERS,
+	HTTP_MULTIPART_DATA,
+	HTTP_MULTIPART_DELIMITER, // right after a delimiter: "--" or CRLF
+	HTTP_MULTIPART_DONE,
+	HTTP_MULTIPART_ERROR,
+} HTTP_MultipartState;
+
+typedef struct {
+	HTTP_MultipartCallbacks cb;
+	void *ctx;
+	HTTP_MultipartState state;
+	uint8_t delim[4 + HTTP_MULTIPART_MAX_BOUNDARY]; // "\r\n--" boundary
+	size_t delim_len;
+	uint8_t skip[256]; // Boyer-Moore-Horspool shifts for delim
+	uint8_t hold[4 + HTTP_MULTIPART_MAX_BOUNDARY]; // tail that may start a delimiter
+	size_t hold_len;
+	char *head; // header block of the current part
+	size_t head_len;
+	size_t head_cap;
+	uint8_t tail[2];
+	size_t tail_len;
+} HTTP_Multipart;
+
+int http_multipart_init(HTTP_Multipart *mp, const char *content_type, const HTTP_MultipartCallbacks *cb, void *ctx);
+int http_multipart_feed(HTTP_Multipart *mp, const uint8_t *data, size_t len);
+int http_multipart_finish(HTTP_Multipart *mp);
+void http_multipart_destroy(HTTP_Multipart *mp);
+// Finds key=value (optionally quoted) in a header value such as
+// Content-Disposition. Returns false if the parameter is absent.
+bool http_header_param(const char *value, size_t value_len, const char *key, const char **out, size_t *out_len);
+
+// Resolver
+
+#define HTTP_RESOLVE_MAX_ADDRS 8
+#define HTTP_RESOLVE_CACHE_SIZE 64
+#define HTTP_RESOLVE_TTL_MS 30000
+#define HTTP_RESOLVE_NEGATIVE_TTL_MS 5000
+#define HTTP_CONNECT_ATTEMPT_DELAY_MS 250
+#define HTTP_CONNECT_TIMEOUT_MS 10000
+
+typedef union {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+	struct sockaddr_un un;
+} HTTP_Addr;
+
+// Thread-safe. getaddrinfo carries no TTL, so answers are cached for
+// HTTP_RESOLVE_TTL_MS and unknown names for HTTP_RESOLVE_NEGATIVE_TTL_MS.
+int http_resolve(const char *host, uint16_t port, HTTP_Addr *out, size_t max, size_t *count);
+void http_resolve_cache_clear(void);
+int http_connect(const char *host, uint16_t port);
+
 typedef void (*HTTP_HandleFunc)(void *ctx, HTTP_Request *req, HTTP_Response *resp);
+typedef void (*HTTP_TickFunc)(void *ctx);
+
+// Handlers that take the body as it arrives instead of a buffered
+// req->body, e.g. to stream an upload through HTTP_Multipart to disk.
+// begin sets up per-request state (non-zero rejects the request with
+// 400), data sees each chunk (non-zero aborts with 400) and end fills in
+// the response. end also runs, with resp == NULL, when the request is
+// abandoned, so it always owns freeing the state. Streamed bodies are not
+// capped by max_body_bytes; data decides what is too much.
+typedef struct {
+	int (*begin)(void *ctx, HTTP_Request *req, void **state);
+	int (*data)(void *state, const uint8_t *data, size_t len);
+	void (*end)(void *state, HTTP_Request *req, HTTP_Response *resp);
+} HTTP_StreamHandler;
+
+// Timer wheel
+
+#define HTTP_TIMER_WHEEL_BITS 6
+#define HTTP_TIMER_WHEEL_SLOTS (1 << HTTP_TIMER_WHEEL_BITS)
+#define HTTP_TIMER_WHEEL_LEVELS 4
+
+// Intrusive timer, meant to be embedded in the object it times out.
+// Ticks are milliseconds; the four levels cover about 4.6 hours and
+// longer timeouts are clamped to that range.
+typedef struct HTTP_Timer {
+	struct HTTP_Timer *next;
+	struct HTTP_Timer **pprev;
+	uint64_t expires;
+	uint8_t level;
+} HTTP_Timer;
+
+typedef void (*HTTP_TimerFunc)(void *ctx, HTTP_Timer *timer);
+
+// Not thread-safe by design: each wheel belongs to one event loop.
+typedef struct {
+	HTTP_Timer *slots[HTTP_TIMER_WHEEL_LEVELS][HTTP_TIMER_WHEEL_SLOTS];
+	size_t counts[HTTP_TIMER_WHEEL_LEVELS];
+	uint64_t now;
+} HTTP_TimerWheel;
+
+void http_timer_wheel_init(HTTP_TimerWheel *tw, uint64_t now);
+void http_timer_arm(HTTP_TimerWheel *tw, HTTP_Timer *timer, uint64_t expires);
+void http_timer_cancel(HTTP_TimerWheel *tw, HTTP_Timer *timer);
+void http_timer_wheel_advance(HTTP_TimerWheel *tw, uint64_t now, HTTP_TimerFunc cb, void *ctx);
+int64_t http_timer_wheel_next(HTTP_TimerWheel *tw);
+
+// Server limits
+
+#define HTTP_SERVER_DEFAULT_BACKLOG SOMAXCONN
+#define HTTP_SERVER_DEFAULT_MAX_CONNECTIONS 1000
+#define HTTP_SERVER_DEFAULT_MAX_HEADER_BYTES (16 * 1024)
+#define HTTP_SERVER_DEFAULT_MAX_BODY_BYTES (1024 * 1024)
+#define HTTP_SERVER_DEFAULT_READ_TIMEOUT_MS 10000
+#define HTTP_SERVER_DEFAULT_WRITE_TIMEOUT_MS 10000
+#define HTTP_SERVER_DEFAULT_IDLE_TIMEOUT_MS 60000
+#define HTTP_SERVER_STREAM_CHUNK 65536 // receive buffer for streamed bodies
+
+// A zero timeout disables the corresponding deadline.
+typedef struct {
+	int backlog;
+	size_t max_connections;
+	size_t max_header_bytes;  // larger heads get 431
+	size_t max_body_bytes;    // larger bodies get 413
+	uint32_t read_timeout_ms; // first byte to complete request, 408 on expiry
+	uint32_t write_timeout_ms;
+	uint32_t idle_timeout_ms; // keep-alive wait for the next request
+} HTTP_ServerLimits;
+
+// HTTP/2 over cleartext (h2c), by prior knowledge or Upgrade: h2c.
+// Requests are dispatched to the same handlers; responses are framed
+// per stream and interleaved under the peer's flow-control windows.
+
+#define HTTP_H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP_H2_PROTOCOL "HTTP/2.0"
+#define HTTP_H2_MAX_FRAME_SIZE 16384
+#define HTTP_H2_MAX_CONCURRENT_STREAMS 256
+#define HTTP_H2_OUT_HIGH_WATER (256 * 1024)
+#define HTTP_HPACK_TABLE_SIZE 4096
+
+typedef struct {
+	HTTP_Header *entries;
+	size_t count;
+	size_t cap;
+	size_t size;
+	size_t max_size;
+} HTTP_HpackTable;
+
+int http_hpack_decode(HTTP_HpackTable *t, const uint8_t *buf, size_t len, HTTP_Headers *out, size_t max_list);
+void http_hpack_encode(HTTP_StringBuilder *sb, const char *name, const char *value);
+void http_hpack_table_destroy(HTTP_HpackTable *t);
+
+typedef struct {
+	uint32_t id;
+	HTTP_Request req;
+	HTTP_Response resp;
+	size_t resp_off;
+	bool responding;
+	int64_t send_window;
+} HTTP_H2Stream;
+
+typedef struct {
+	HTTP_HpackTable decoder;
+	HTTP_H2Stream **streams;
+	size_t streams_count;
+	size_t streams_cap;
+	uint32_t last_stream_id;
+	int64_t send_window;
+	uint32_t peer_initial_window;
+	uint32_t peer_max_frame;
+	uint8_t *block; // HEADERS + CONTINUATION fragments
+	size_t block_len;
+	size_t block_cap;
+	uint32_t block_stream;
+	bool block_end_stream;
+	bool preface_done;
+	bool goaway;
+	bool in_paused; // input left unread until conn->out drains
+} HTTP_H2Session;
+
+void http_h2_session_destroy(HTTP_H2Session *h2);
+
+// WebSocket (RFC 6455). Upgraded connections stay on the event loop.
+// Messages are handed to on_message straight out of the receive buffer,
+// so data is only valid during the call and is not NUL-terminated.
+
+#define HTTP_WS_OP_CONT 0x0
+#define HTTP_WS_OP_TEXT 0x1
+#define HTTP_WS_OP_BINARY 0x2
+#define HTTP_WS_OP_CLOSE 0x8
+#define HTTP_WS_OP_PING 0x9
+#define HTTP_WS_OP_PONG 0xA
+
+#define HTTP_WS_MAX_BUFFERED (4 * 1024 * 1024) // unsent bytes before a peer is dropped
+
+typedef struct HTTP_Conn HTTP_WebSocket;
+
+typedef void (*HTTP_WsOpenFunc)(void *ctx, HTTP_WebSocket *ws, HTTP_Request *req);
+typedef void (*HTTP_WsMessageFunc)(void *ctx, HTTP_WebSocket *ws, uint8_t opcode, const uint8_t *data, size_t len);
+typedef void (*HTTP_WsCloseFunc)(void *ctx, HTTP_WebSocket *ws);
+
+typedef struct {
+	const char *target;
+	HTTP_WsOpenFunc on_open;
+	HTTP_WsMessageFunc on_message;
+	HTTP_WsCloseFunc on_close;
+	void *ctx;
+} HTTP_WsRoute;
+
+void http_ws_mask(uint8_t *data, size_t len, const uint8_t key[4]);
+int http_ws_send(HTTP_WebSocket *ws, uint8_t opcode, const void *data, size_t len);
+void http_ws_close(HTTP_WebSocket *ws, uint16_t code);
+
+// Immutable, reference-counted byte buffer: one copy of a payload that
+// many connections queue by reference. Only touched from the event loop.
+typedef struct {
+	size_t refs;
+	size_t len;
+	uint8_t data[];
+} HTTP_SharedBuf;
+
+HTTP_SharedBuf *http_shared_buf_create(const void *data, size_t len);
+HTTP_SharedBuf *http_shared_buf_retain(HTTP_SharedBuf *buf);
+void http_shared_buf_release(HTTP_SharedBuf *buf);
+
+// Server-Sent Events. A hub is a topic that clients subscribe to with a
+// GET on its target. Each published event is encoded once and queued to
+// every subscriber by reference; a subscriber that falls more than
+// HTTP_SSE_MAX_QUEUED events or HTTP_SSE_MAX_QUEUED_BYTES behind is
+// disconnected.
+
+#define HTTP_SSE_MAX_QUEUED 256
+#define HTTP_SSE_MAX_QUEUED_BYTES (1024 * 1024)
+
+typedef struct HTTP_Conn HTTP_SseClient;
+typedef struct HTTP_SseHub HTTP_SseHub;
+
+typedef void (*HTTP_SseOpenFunc)(void *ctx, HTTP_SseHub *hub, HTTP_SseClient *client, HTTP_Request *req);
+
+struct HTTP_SseHub {
+	const char *target;
+	HTTP_SseOpenFunc on_open;
+	void *ctx;
+	HTTP_SseClient **subs;
+	size_t subs_count;
+	size_t subs_cap;
+	uint64_t published;
+	uint64_t dropped; // slow consumers disconnected
+};
+
+// event may be NULL; an event name containing CR or LF is refused.
+size_t http_sse_publish(HTTP_SseHub *hub, const char *event, const char *data);
+int http_sse_send(HTTP_SseClient *client, const char *event, const char *data);
+
+typedef enum {
+	HTTP_CONN_IDLE = 0,
+	HTTP_CONN_READING,
+	HTTP_CONN_WRITING,
+	HTTP_CONN_H2,
+	HTTP_CONN_WS,
+	HTTP_CONN_SSE,
+	HTTP_CONN_PROXY,
+	HTTP_CONN_CLOSED,
+} HTTP_ConnState;
+
+typedef struct {
+	const char *target;
+	HTTP_StreamHandler handler;
+	void *ctx;
+} HTTP_StreamRoute;
+
+// Reverse proxy. Requests under a proxy route are forwarded to one
+// upstream over pooled keep-alive connections. Heads are rewritten
+// (hop-by-hop headers dropped); bodies are moved socket to socket with
+// splice(2) through a pipe, so they never enter userspace.
+
+#define HTTP_PROXY_POOL_SIZE 32
+#define HTTP_PROXY_POOL_IDLE_MS 30000
+#define HTTP_PROXY_TIMEOUT_MS 30000 // upstream inactivity before 504
+
+typedef struct {
+	int fd;
+	uint64_t since;
+} HTTP_ProxyIdle;
 
+typedef struct {
+	const char *target;
+	HTTP_Addr addr;
+	socklen_t addr_len;
+	HTTP_ProxyIdle idle[HTTP_PROXY_POOL_SIZE];
+	size_t idle_count;
+	uint64_t connects;
+	uint64_t reuses;
+} HTTP_ProxyRoute;
+
+typedef struct HTTP_Proxy HTTP_Proxy;
+
+// Response micro-cache for handler routes. GET and HEAD responses are
+// kept fully serialized, keyed by method, target and the request headers
+// named in vary, and served by reference until ttl_ms passes. Handlers
+// run on the event loop, so concurrent misses coalesce by construction:
+// requests that queue up behind a miss are answered from its fill.
+// Only framed 200 responses without Set-Cookie, no-store or private are
+// kept. Each cache holds at most HTTP_CACHE_MAX_BYTES; the entries stored
+// longest ago make room first, so varying the query string can only
+// churn a route's cache, not grow it.
+
+#define HTTP_CACHE_BUCKETS 256
+#define HTTP_CACHE_MAX_ENTRIES 1024
+#define HTTP_CACHE_MAX_RESPONSE_BYTES (1 << 20)
+#define HTTP_CACHE_MAX_BYTES (16u << 20)
+
+typedef struct HTTP_CacheEntry HTTP_CacheEntry;
+
+typedef struct {
+	uint32_t ttl_ms;
+	const char *vary; // comma-separated request header names, or NULL
+	HTTP_CacheEntry *buckets[HTTP_CACHE_BUCKETS];
+	HTTP_CacheEntry *oldest; // in storing order, which is also expiry order
+	HTTP_CacheEntry *newest;
+	size_t count;
+	size_t bytes; // keys and serialized responses
+	uint64_t hits;
+	uint64_t misses;
+} HTTP_Cache;
+
+// Access log. The event loop fills a fixed-size record per response and
+// pushes it into a lock-free bounded ring (any number of producers, so
+// one log can serve several servers); a background thread formats the
+// records as JSON lines and writes them in batches with writev. A full
+// ring drops the record and counts it rather than block the loop.
+
+#define HTTP_ACCESS_LOG_SLOTS 4096 // power of two
+#define HTTP_ACCESS_LOG_TARGET_MAX 256 // longer targets are truncated
+#define HTTP_ACCESS_LOG_BATCH 64
+#define HTTP_ACCESS_LOG_IDLE_MS 5 // writer sleep when the ring is empty
+
+typedef struct {
+	uint64_t time_us; // wall clock when the response was done
+	uint32_t ttfb_us; // request start to response ready
+	uint32_t total_us; // request start to last byte sent
+	uint64_t bytes; // response bytes sent, head included
+	uint16_t status;
+	char method[16];
+	char target[HTTP_ACCESS_LOG_TARGET_MAX];
+	HTTP_Addr peer;
+	socklen_t peer_len;
+} HTTP_AccessRecord;
+
+typedef struct HTTP_AccessLog HTTP_AccessLog;
+
+// Opens (appends to) path and starts the writer thread. Returns NULL on error.
+HTTP_AccessLog *http_access_log_open(const char *path);
+// Writes out what is queued, stops the writer and frees the log.
+void http_access_log_close(HTTP_AccessLog *log);
+// Safe from any thread; never blocks. Returns false if the record was dropped.
+bool http_access_log_push(HTTP_AccessLog *log, const HTTP_AccessRecord *rec);
+uint64_t http_access_log_dropped(HTTP_AccessLog *log);
+
+// Per-peer rate limiting with token buckets: rate_per_sec sustained,
+// bursts up to burst. Each request costs a token and is answered with a
+// prebuilt 429 before it is parsed when its peer's bucket is empty; a
+// new connection from such a peer gets the 429 straight from accept.
+// Buckets live in a sharded open-addressing table updated with atomics
+// only, so a limiter can be shared by servers on several threads. Idle
+// buckets are reclaimed lazily when a probe passes over them.
+
+#define HTTP_RATE_LIMIT_SHARD_BITS 4
+#define HTTP_RATE_LIMIT_SHARDS (1 << HTTP_RATE_LIMIT_SHARD_BITS)
+
+typedef struct HTTP_RateLimiter HTTP_RateLimiter;
+
+// capacity is roughly how many peers are tracked at once.
+HTTP_RateLimiter *http_rate_limiter_create(uint32_t rate_per_sec, uint32_t burst, size_t capacity);
+void http_rate_limiter_destroy(HTTP_RateLimiter *rl);
+// Spends a token for peer; false means over the limit.
+bool http_rate_limiter_allow(HTTP_RateLimiter *rl, const HTTP_Addr *peer, uint64_t now_ms);
+uint64_t http_rate_limiter_limited(HTTP_RateLimiter *rl);
+
+// In-process span recorder. Once started, the server records accept,
+// parse, handler, write and whole-request spans (one track per
+// connection fd, HTTP/2 handlers on track 0) until max_events are taken;
+// http_trace_dump writes them as Chrome trace-event JSON for
+// chrome://tracing or Perfetto. Start, stop and dump from the thread
+// running the server, or while it is not running.
+int http_trace_start(size_t max_events);
+void http_trace_stop(void);
+int http_trace_dump(const char *path);
+
+// Traffic capture: with serv.capture set, every buffered HTTP/1.1 request
+// is appended to a JSONL file as it arrives, raw bytes included, for
+// tools/replay. Lines are {"seq", "t_us" (since open, monotonic),
+// "unix_us", "peer", "raw"}. Lines are buffered and written by the event
+// loop itself, once per round, so capture is meant for collecting traffic,
+// not to be left on. Streamed and proxied requests are not captured.
+typedef struct HTTP_Capture HTTP_Capture;
+
+HTTP_Capture *http_capture_open(const char *path);
+void http_capture_close(HTTP_Capture *cap);
+void http_capture_write(HTTP_Capture *cap, const HTTP_Addr *peer, const uint8_t *raw, size_t len);
+
+typedef struct HTTP_Conn {
+	int fd;
+	HTTP_ConnState state;
+	uint8_t *in;
+	size_t in_len;
+	size_t in_cap;
+	size_t head_len;
+	size_t req_len;
+	HTTP_Response resp;
+	HTTP_StringBuilder out;
+	size_t out_off;
+	bool keep_alive;
+	HTTP_Timer timer;
+	HTTP_H2Session *h2;
+	const HTTP_WsRoute *ws;
+	HTTP_StringBuilder ws_msg; // fragmented message being reassembled
+	uint8_t ws_msg_opcode;
+	bool ws_closing;
+	HTTP_SseHub *sse;
+	size_t sse_index; // position in sse->subs
+	HTTP_SharedBuf **sse_queue; // ring of HTTP_SSE_MAX_QUEUED
+	size_t sse_head;
+	size_t sse_count;
+	size_t sse_off; // bytes of the oldest buffer already sent
+	size_t sse_bytes;
+	const HTTP_StreamRoute *stream;
+	void *stream_state;
+	HTTP_Request stream_req;
+	size_t stream_left; // body bytes not seen yet
+	HTTP_Proxy *proxy;
+	HTTP_SharedBuf *cached; // response served by reference from a cache
+	HTTP_Addr peer;
+	socklen_t peer_len;
+	uint64_t req_start_us; // first byte of the current request
+	uint64_t resp_ready_us; // response queued, for the write span
+	bool log_pending; // log holds a response that is still being sent
+	HTTP_AccessRecord log;
+} HTTP_Conn;
+
+// Listen addresses:
+//   "0.0.0.0:8080", ":8080"  IPv4
+//   "[::]:8080"              IPv6, dual-stack (also accepts IPv4)
+//   "[::1]:8080"             IPv6 only
+//   "unix:/run/app.sock"     Unix domain socket; a stale socket file is replaced
+//   "unix:@app"              Linux abstract Unix socket
 typedef struct {
 	int socket;
-	struct sockaddr_in addr;
+	HTTP_Addr addr;
+	socklen_t addr_len;
+} HTTP_Listener;
+
+typedef struct {
+	HTTP_Listener *listeners;
+	size_t listeners_count;
 	const char **targets;
 	HTTP_HandleFunc *hfs;
 	void **hfs_ctx;
+	HTTP_Cache **caches; // per route, NULL when uncached
 	size_t hfs_count;
 	size_t hfs_cap;
+	HTTP_ServerLimits limits;
+	HTTP_Conn **conns;
+	size_t conns_count;
+	size_t conns_cap;
+	struct pollfd *pfds;
+	size_t pfds_cap;
+	HTTP_TimerWheel timers;
+	uint64_t shed_count;
+	HTTP_WsRoute *ws_routes;
+	size_t ws_routes_count;
+	size_t ws_routes_cap;
+	HTTP_SseHub **sse_hubs;
+	size_t sse_hubs_count;
+	size_t sse_hubs_cap;
+	HTTP_StreamRoute *stream_routes;
+	size_t stream_routes_count;
+	size_t stream_routes_cap;
+	HTTP_ProxyRoute **proxy_routes;
+	size_t proxy_routes_count;
+	size_t proxy_routes_cap;
+	HTTP_TickFunc tick;
+	void *tick_ctx;
+	uint32_t tick_interval_ms;
+	uint64_t tick_next;
+	HTTP_AccessLog *access_log; // NULL: no access logging
+	HTTP_RateLimiter *rate_limiter; // NULL: unlimited
+	HTTP_Capture *capture; // NULL: no capture
 } HTTP_Server;
 
 HTTP_Server http_server_create(uint16_t port);
+HTTP_Server http_server_create_at(const char *addr);
+int http_server_listen(HTTP_Server *serv, const char *addr);
 void http_server_run(HTTP_Server *serv);
+// Every kind of route matches its target the same way: the decoded,
+// normalized path itself and every path below it, so "/api" takes
+// "/api" and "/api/v1" but not "/apiary"; the query plays no part. A
+// target ending in '/' only takes what is below it, and "/" takes only
+// "/". Within a kind the first route registered wins; streamed and
+// proxied routes are tried before SSE, WebSocket and then handler ones.
 void http_server_handle(HTTP_Server *serv, const char *target, HTTP_HandleFunc hf, void *ctx);
+// Like http_server_handle, with a response cache in front of hf. Returns
+// the cache for its hit/miss counters.
+HTTP_Cache *http_server_handle_cached(HTTP_Server *serv, const char *target, HTTP_HandleFunc hf, void *ctx,
+		uint32_t ttl_ms, const char *vary);
 int http_server_serve_file(HTTP_Server *serv, const char *target, const char *content_type, const char *path);
+void http_server_websocket(HTTP_Server *serv, const char *target,
+		HTTP_WsOpenFunc on_open, HTTP_WsMessageFunc on_message, HTTP_WsCloseFunc on_close, void *ctx);
+void http_server_handle_stream(HTTP_Server *serv, const char *target, HTTP_StreamHandler handler, void *ctx);
+HTTP_SseHub *http_server_sse(HTTP_Server *serv, const char *target, HTTP_SseOpenFunc on_open, void *ctx);
+// Forwards target and everything under it to host:port, resolved once
+// here.
+int http_server_proxy(HTTP_Server *serv, const char *target, const char *host, uint16_t port);
+// Calls fn on the event loop every interval_ms, e.g. to push updates.
+void http_server_tick(HTTP_Server *serv, uint32_t interval_ms, HTTP_TickFunc fn, void *ctx);
+// Serializes one frame and writes it to every WebSocket on target (all
+// of them when target is NULL). Returns how many sockets it went to.
+size_t http_ws_broadcast(HTTP_Server *serv, const char *target, uint8_t opcode, const void *data, size_t len);
 
 #endif // HTTP_H
 
@@ -309,6 +925,7 @@ int http_server_serve_file(HTTP_Server *serv, const char *target, const char *co
 char *strdup(const char *str) {
 	size_t str_len = strlen(str) + 1;
 	char *mstr = (char *) malloc(sizeof(char) * str_len);
+	if (!mstr) return NULL;
 	memcpy(mstr, str, str_len);
 	return mstr;
 }
@@ -328,6 +945,18 @@ uint8_t *read_file(const char *path, size_t *out_size) {
 	return buf;
 }
 
+// Writes v in decimal without a terminator and returns the length.
+static size_t http_fmt_uint(char *buf, uint64_t v) {
+	char tmp[20];
+	size_t n = 0;
+	do {
+		tmp[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+	for (size_t i = 0; i < n; i++) buf[i] = tmp[n - 1 - i];
+	return n;
+}
+
 // HTTP headers
 
 HTTP_Headers http_headers_create(size_t cap) {
@@ -370,6 +999,522 @@ void http_headers_destroy(HTTP_Headers *hh) {
 	hh->headers = 0;
 }
 
+// Sockets
+
+static uint64_t http_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t http_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Span recorder; see http_trace_start.
+
+typedef struct {
+	const char *name;
+	uint64_t ts; // us
+	uint64_t dur; // us; UINT64_MAX marks an instant event
+	int tid;
+} HTTP_TraceEvent;
+
+static struct {
+	HTTP_TraceEvent *events;
+	size_t cap;
+	size_t count;
+} http_tracer;
+
+#define http_trace_on() (http_tracer.events != NULL)
+
+static void http_trace_span(const char *name, int tid, uint64_t start_us, uint64_t end_us) {
+	if (!http_trace_on()) return;
+	size_t i = __atomic_fetch_add(&http_tracer.count, 1, __ATOMIC_RELAXED);
+	if (i >= http_tracer.cap) return;
+	http_tracer.events[i] = (HTTP_TraceEvent) { name, start_us, end_us - start_us, tid };
+}
+
+static void http_trace_instant(const char *name, int tid) {
+	if (!http_trace_on()) return;
+	size_t i = __atomic_fetch_add(&http_tracer.count, 1, __ATOMIC_RELAXED);
+	if (i >= http_tracer.cap) return;
+	http_tracer.events[i] = (HTTP_TraceEvent) { name, http_now_us(), UINT64_MAX, tid };
+}
+
+static int http_set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int http_set_blocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) return -1;
+	return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+// Resolver
+
+typedef struct {
+	char host[256];
+	HTTP_Addr addrs[HTTP_RESOLVE_MAX_ADDRS];
+	size_t count;
+	uint64_t expires;
+} HTTP_ResolveEntry;
+
+static HTTP_ResolveEntry http_resolve_cache[HTTP_RESOLVE_CACHE_SIZE];
+static pthread_mutex_t http_resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t http_resolve_slot(const char *host) {
+	uint32_t h = 2166136261u;
+	for (const char *p = host; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+	return h % HTTP_RESOLVE_CACHE_SIZE;
+}
+
+static void http_addr_set_port(HTTP_Addr *a, uint16_t port) {
+	if (a->sa.sa_family == AF_INET6) a->in6.sin6_port = htons(port);
+	else a->in.sin_port = htons(port);
+}
+
+// Interleaves the families as RFC 8305 asks, keeping the resolver's
+// order within each family and starting with whichever came first.
+static size_t http_resolve_sort(HTTP_Addr *out, const HTTP_Addr *in, size_t n) {
+	size_t i = 0, j = 0, k = 0;
+	int first = n ? in[0].sa.sa_family : AF_INET;
+	HTTP_Addr a[HTTP_RESOLVE_MAX_ADDRS], b[HTTP_RESOLVE_MAX_ADDRS];
+	size_t na = 0, nb = 0;
+	for (size_t x = 0; x < n; x++) {
+		if (in[x].sa.sa_family == first) a[na++] = in[x];
+		else b[nb++] = in[x];
+	}
+	while (i < na || j < nb) {
+		if (i < na) out[k++] = a[i++];
+		if (j < nb) out[k++] = b[j++];
+	}
+	return k;
+}
+
+int http_resolve(const char *host, uint16_t port, HTTP_Addr *out, size_t max, size_t *count) {
+	*count = 0;
+	size_t hlen = strlen(host);
+	if (hlen == 0 || hlen >= sizeof(http_resolve_cache[0].host)) return -1;
+
+	HTTP_ResolveEntry *e = &http_resolve_cache[http_resolve_slot(host)];
+	uint64_t now = http_now_ms();
+
+	pthread_mutex_lock(&http_resolve_lock);
+	if (e->expires > now && strcmp(e->host, host) == 0) {
+		size_t n = e->count < max ? e->count : max;
+		memcpy(out, e->addrs, sizeof(HTTP_Addr) * n);
+		pthread_mutex_unlock(&http_resolve_lock);
+
+		for (size_t i = 0; i < n; i++) http_addr_set_port(&out[i], port);
+		*count = n;
+		return n > 0 ? 0 : -1;
+	}
+	pthread_mutex_unlock(&http_resolve_lock);
+
+	// The lookup itself runs unlocked so one slow name doesn't stall
+	// every other thread that resolves through the cache.
+	struct addrinfo hints = {0}, *res = NULL;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	int rc = getaddrinfo(host, NULL, &hints, &res);
+
+	HTTP_Addr found[HTTP_RESOLVE_MAX_ADDRS];
+	size_t n = 0;
+	if (rc == 0) {
+		for (struct addrinfo *ai = res; ai && n < HTTP_RESOLVE_MAX_ADDRS; ai = ai->ai_next) {
+			if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) continue;
+			if (ai->ai_addrlen > sizeof(found[n])) continue;
+			memset(&found[n], 0, sizeof(found[n]));
+			memcpy(&found[n], ai->ai_addr, ai->ai_addrlen);
+			n++;
+		}
+		freeaddrinfo(res);
+	}
+
+	// Transient failures (EAI_AGAIN, EAI_SYSTEM, ...) are not cached.
+	bool negative = rc == EAI_NONAME;
+#ifdef EAI_NODATA
+	negative = negative || rc == EAI_NODATA;
+#endif
+	HTTP_Addr sorted[HTTP_RESOLVE_MAX_ADDRS];
+	n = http_resolve_sort(sorted, found, n);
+	if (rc == 0 || negative) {
+		pthread_mutex_lock(&http_resolve_lock);
+		memcpy(e->host, host, hlen + 1);
+		memcpy(e->addrs, sorted, sizeof(HTTP_Addr) * n);
+		e->count = n;
+		e->expires = now + (n > 0 ? HTTP_RESOLVE_TTL_MS : HTTP_RESOLVE_NEGATIVE_TTL_MS);
+		pthread_mutex_unlock(&http_resolve_lock);
+	}
+
+	if (n == 0) return -1;
+	if (n > max) n = max;
+	for (size_t i = 0; i < n; i++) {
+		out[i] = sorted[i];
+		http_addr_set_port(&out[i], port);
+	}
+	*count = n;
+	return 0;
+}
+
+void http_resolve_cache_clear(void) {
+	pthread_mutex_lock(&http_resolve_lock);
+	memset(http_resolve_cache, 0, sizeof(http_resolve_cache));
+	pthread_mutex_unlock(&http_resolve_lock);
+}
+
+static socklen_t http_addr_len(const HTTP_Addr *a) {
+	return a->sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+// Happy eyeballs: start the next attempt whenever the previous one has
+// not connected within HTTP_CONNECT_ATTEMPT_DELAY_MS, then keep the first
+// socket that completes and drop the rest.
+int http_connect(const char *host, uint16_t port) {
+	HTTP_Addr addrs[HTTP_RESOLVE_MAX_ADDRS];
+	size_t n;
+	if (http_resolve(host, port, addrs, HTTP_RESOLVE_MAX_ADDRS, &n) < 0) return -1;
+
+	struct pollfd pfds[HTTP_RESOLVE_MAX_ADDRS];
+	size_t pending = 0, next = 0;
+	int winner = -1;
+	uint64_t deadline = http_now_ms() + HTTP_CONNECT_TIMEOUT_MS;
+
+	while (winner < 0) {
+		uint64_t now = http_now_ms();
+		if (now >= deadline) break;
+
+		while (next < n && pending < HTTP_RESOLVE_MAX_ADDRS) {
+			int s = socket(addrs[next].sa.sa_family, SOCK_STREAM, 0);
+			if (s < 0 || http_set_nonblocking(s) < 0) {
+				if (s >= 0) close(s);
+				next++;
+				continue;
+			}
+
+			int rc = connect(s, &addrs[next].sa, http_addr_len(&addrs[next]));
+			next++;
+			if (rc == 0) { winner = s; break; }
+			if (errno != EINPROGRESS) { close(s); continue; }
+
+			pfds[pending++] = (struct pollfd) { .fd = s, .events = POLLOUT };
+			break;
+		}
+		if (winner >= 0 || pending == 0) break;
+
+		uint64_t wait = deadline - now;
+		if (next < n && wait > HTTP_CONNECT_ATTEMPT_DELAY_MS) wait = HTTP_CONNECT_ATTEMPT_DELAY_MS;
+
+		int r = poll(pfds, pending, (int)wait);
+		if (r < 0 && errno != EINTR) break;
+
+		for (size_t i = 0; i < pending;) {
+			if (!pfds[i].revents) { i++; continue; }
+
+			int soerr = 0;
+			socklen_t len = sizeof(soerr);
+			getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+			if (soerr == 0 && winner < 0) {
+				winner = pfds[i].fd;
+			} else {
+				close(pfds[i].fd);
+			}
+			pfds[i] = pfds[--pending];
+		}
+	}
+
+	for (size_t i = 0; i < pending; i++) close(pfds[i].fd);
+	if (winner >= 0 && http_set_blocking(winner) < 0) {
+		close(winner);
+		winner = -1;
+	}
+	return winner;
+}
+
+// URL
+
+HTTP_Url http_url_split(const char *target) {
+	HTTP_Url url = {0};
+	size_t len = strlen(target);
+	size_t path_end = strcspn(target, "?#");
+	url.path = (HTTP_Slice) { target, path_end };
+
+	const char *hash = (const char *) memchr(target + path_end, '#', len - path_end);
+	size_t frag_at = hash ? (size_t)(hash - target) : len;
+	if (target[path_end] == '?') url.query = (HTTP_Slice) { target + path_end + 1, frag_at - path_end - 1 };
+	if (hash) url.fragment = (HTTP_Slice) { hash + 1, len - frag_at - 1 };
+	return url;
+}
+
+static int http_hex_digit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Plain runs between escapes are found 16 bytes at a time and moved in
+// one go; only the escapes themselves are handled byte by byte.
+size_t http_percent_decode(char *dst, const char *src, size_t len, bool form) {
+	size_t i = 0, o = 0;
+	while (i < len) {
+		size_t run = i;
+#ifdef __SSE2__
+		const __m128i pct = _mm_set1_epi8('%'), plus = _mm_set1_epi8(form ? '+' : '%');
+		while (run + 16 <= len) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + run));
+			int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+			if (mask) { run += (size_t) __builtin_ctz((unsigned) mask); goto found; }
+			run += 16;
+		}
+#endif
+		while (run < len && src[run] != '%' && !(form && src[run] == '+')) run++;
+#ifdef __SSE2__
+	found:
+#endif
+		if (run > i) {
+			if (dst + o != src + i) memmove(dst + o, src + i, run - i);
+			o += run - i;
+			i = run;
+		}
+		if (i == len) break;
+
+		if (src[i] == '+') {
+			dst[o++] = ' ';
+			i++;
+			continue;
+		}
+		int hi = i + 2 < len ? http_hex_digit(src[i + 1]) : -1;
+		int lo = hi >= 0 ? http_hex_digit(src[i + 2]) : -1;
+		if (lo < 0) {
+			dst[o++] = src[i++];
+			continue;
+		}
+		dst[o++] = (char)((hi << 4) | lo);
+		i += 3;
+	}
+	return o;
+}
+
+// Dot segments and empty segments all start with "/." or "//", so most
+// paths are recognized as clean by a vector scan for those pairs.
+static bool http_path_is_clean(const char *path, size_t len) {
+	if (len > 0 && path[0] == '.') return false;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i slash = _mm_set1_epi8('/'), dot = _mm_set1_epi8('.');
+	for (; i + 17 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(path + i));
+		__m128i next = _mm_loadu_si128((const __m128i *)(path + i + 1));
+		__m128i pair = _mm_and_si128(_mm_cmpeq_epi8(v, slash),
+			_mm_or_si128(_mm_cmpeq_epi8(next, slash), _mm_cmpeq_epi8(next, dot)));
+		if (_mm_movemask_epi8(pair)) return false;
+	}
+#endif
+	for (; i + 1 < len; i++)
+		if (path[i] == '/' && (path[i + 1] == '/' || path[i + 1] == '.')) return false;
+	return true;
+}
+
+size_t http_path_normalize(char *path, size_t len) {
+	if (http_path_is_clean(path, len)) return len;
+
+	bool absolute = len > 0 && path[0] == '/';
+	bool trailing = false; // the result ends in a directory
+	size_t o = 0, i = 0;
+	for (;;) {
+		while (i < len && path[i] == '/') i++;
+		if (i == len) break;
+		size_t start = i;
+		while (i < len && path[i] != '/') i++;
+		size_t seg = i - start;
+
+		if (seg == 1 && path[start] == '.') {
+			trailing = true;
+			continue;
+		}
+		if (seg == 2 && path[start] == '.' && path[start + 1] == '.') {
+			while (o > 0 && path[o - 1] != '/') o--;
+			if (o > 0) o--;
+			trailing = true;
+			continue;
+		}
+
+		if (o > 0 || absolute) path[o++] = '/';
+		memmove(path + o, path + start, seg);
+		o += seg;
+		trailing = i < len;
+	}
+
+	if (absolute && (o == 0 || trailing)) path[o++] = '/';
+	return o;
+}
+
+// Decodes a request path for routing into dst, which must not overlap
+// src. "%2F" stays encoded so it can never become a separator, and
+// "%00" is refused with SIZE_MAX since the path is used as a C string.
+static size_t http_path_decode(char *dst, const char *src, size_t len) {
+	size_t o = 0, i = 0, start = 0;
+	for (;;) {
+		const char *p = (const char *) memchr(src + i, '%', len - i);
+		if (!p) break;
+		i = (size_t)(p - src);
+		if (i + 2 < len && src[i + 1] == '0' && src[i + 2] == '0') return SIZE_MAX;
+		if (i + 2 < len && src[i + 1] == '2' && (src[i + 2] | 0x20) == 'f') {
+			o += http_percent_decode(dst + o, src + start, i - start, false);
+			memcpy(dst + o, "%2F", 3);
+			o += 3;
+			start = i + 3;
+		}
+		i++;
+	}
+	return o + http_percent_decode(dst + o, src + start, len - start, false);
+}
+
+// Returns -1 if the path cannot be decoded.
+static int http_req_split_target(HTTP_Request *req) {
+	req->url = http_url_split(req->target);
+	free(req->path);
+	req->path = (char *) malloc(req->url.path.len + 2);
+	if (!req->path) return -1;
+	size_t n = http_path_decode(req->path, req->url.path.ptr, req->url.path.len);
+	if (n == SIZE_MAX) {
+		free(req->path);
+		req->path = NULL;
+		return -1;
+	}
+	n = http_path_normalize(req->path, n);
+	req->path[n] = '\0';
+	return 0;
+}
+
+const char *http_req_query(HTTP_Request *hr, const char *key) {
+	if (!hr->params_parsed) {
+		hr->params = http_headers_create(0);
+		hr->params_parsed = true;
+
+		const char *p = hr->url.query.ptr, *end = p + hr->url.query.len;
+		while (p && p < end) {
+			const char *amp = (const char *) memchr(p, '&', (size_t)(end - p));
+			if (!amp) amp = end;
+			const char *eq = (const char *) memchr(p, '=', (size_t)(amp - p));
+			const char *kend = eq ? eq : amp;
+
+			if (kend > p) {
+				char *k = (char *) malloc((size_t)(kend - p) + 1);
+				k[http_percent_decode(k, p, (size_t)(kend - p), true)] = '\0';
+				const char *v = eq ? eq + 1 : amp;
+				char *val = (char *) malloc((size_t)(amp - v) + 1);
+				val[http_percent_decode(val, v, (size_t)(amp - v), true)] = '\0';
+				http_headers_add(&hr->params, (HTTP_Header) { k, val });
+			}
+			p = amp + 1;
+		}
+	}
+	return http_headers_get(&hr->params, key);
+}
+
+// Raw heads
+
+// Returns the length of a request or response head including the blank line,
+// or 0 if it is not complete yet.
+static size_t http_find_head_end(const uint8_t *buf, size_t len) {
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + len;
+	while ((p = (const uint8_t *) memchr(p, '\n', end - p)) != NULL) {
+		if (p + 2 < end && p[1] == '\r' && p[2] == '\n' && p > buf && p[-1] == '\r')
+			return (size_t)(p + 3 - buf);
+		p++;
+	}
+	return 0;
+}
+
+static bool http_slice_ieq(HTTP_Slice s, const char *lit) {
+	return strlen(lit) == s.len && strncasecmp(s.ptr, lit, s.len) == 0;
+}
+
+// Looks for token in a comma-separated header value, ignoring case and
+// any "=argument" after it, as in Cache-Control: private="Set-Cookie".
+static bool http_token_list_has(HTTP_Slice list, const char *token) {
+	const char *p = list.ptr, *end = list.ptr + list.len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+		const char *t = p;
+		while (p < end && *p != ',') p++;
+		const char *te = (const char *) memchr(t, '=', (size_t)(p - t));
+		if (!te) te = p;
+		while (te > t && (te[-1] == ' ' || te[-1] == '\t')) te--;
+		if (http_slice_ieq((HTTP_Slice) { t, (size_t)(te - t) }, token)) return true;
+	}
+	return false;
+}
+
+// Steps through the "Name: value" lines of a raw head; *p starts after
+// the first line. Returns false at the blank line. Lines without a colon
+// come back with an empty name.
+static bool http_head_next(const char **p, const char *end, HTTP_Slice *name, HTTP_Slice *value) {
+	const char *eol = (const char *) memchr(*p, '\n', (size_t)(end - *p));
+	if (!eol) return false;
+	const char *le = eol > *p && eol[-1] == '\r' ? eol - 1 : eol;
+	if (le == *p) return false;
+
+	const char *colon = (const char *) memchr(*p, ':', (size_t)(le - *p));
+	*name = (HTTP_Slice) { *p, colon ? (size_t)(colon - *p) : 0 };
+	const char *v = colon ? colon + 1 : le;
+	while (v < le && (*v == ' ' || *v == '\t')) v++;
+	const char *ve = le;
+	while (ve > v && (ve[-1] == ' ' || ve[-1] == '\t')) ve--;
+	*value = (HTTP_Slice) { v, (size_t)(ve - v) };
+	*p = eol + 1;
+	return true;
+}
+
+static HTTP_Slice http_head_get(const char *head, size_t len, const char *key) {
+	const char *p = (const char *) memchr(head, '\n', len);
+	HTTP_Slice name, value;
+	if (p) {
+		p++;
+		while (http_head_next(&p, head + len, &name, &value))
+			if (http_slice_ieq(name, key)) return value;
+	}
+	return (HTTP_Slice) { NULL, 0 };
+}
+
+// Finds the body length a request head declares. Content-Length is
+// matched without regard to case and must appear once, as a plain
+// decimal number. Returns 0 (with *out 0 if there is none), -1 if it is
+// malformed or repeated, or -2 if the head uses Transfer-Encoding,
+// which requests may not.
+static int http_head_content_length(const uint8_t *head, size_t len, size_t *out) {
+	const char *p = (const char *) memchr(head, '\n', len);
+	HTTP_Slice name, value;
+	bool seen = false;
+	*out = 0;
+	if (!p) return 0;
+	p++;
+	while (http_head_next(&p, (const char *) head + len, &name, &value)) {
+		if (http_slice_ieq(name, "Transfer-Encoding")) return -2;
+		if (!http_slice_ieq(name, "Content-Length")) continue;
+		if (seen || value.len == 0) return -1;
+		seen = true;
+		size_t v = 0;
+		for (size_t i = 0; i < value.len; i++) {
+			char ch = value.ptr[i];
+			if (ch < '0' || ch > '9' || v > (SIZE_MAX - 9) / 10) return -1;
+			v = v * 10 + (size_t)(ch - '0');
+		}
+		*out = v;
+	}
+	return 0;
+}
+
 // HTTP Request
 
 static ssize_t send_all(int sock, const void *buf, size_t len) {
@@ -397,30 +1542,9 @@ HTTP_Response http_make_request(HTTP_Request *req, const char *host, uint16_t po
 	if (req->body_len > 0 && req->body != NULL)
 		memcpy(request + header_len, req->body, req->body_len);
 
-	struct hostent *h = gethostbyname(host);
-	if (!h) { *err = HTTP_ERROR_MAKING_REQUEST; return (HTTP_Response){0}; }
-
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int sock = http_connect(host, port);
 	if (sock < 0) { *err = HTTP_ERROR_MAKING_REQUEST; return (HTTP_Response){0}; }
 
-	struct sockaddr_in addr = {0};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-
-	if (h->h_addrtype == AF_INET) {
-		memcpy(&addr.sin_addr, h->h_addr_list[0], sizeof(struct in_addr));
-	} else {
-		close(sock);
-		*err = HTTP_ERROR_MAKING_REQUEST;
-		return (HTTP_Response){0};
-	}
-
-	if (connect(sock, (struct sockaddr *)&addr, sizeof addr) < 0) {
-		close(sock);
-		*err = HTTP_ERROR_MAKING_REQUEST;
-		return (HTTP_Response){0};
-	}
-
 	if (send_all(sock, request, req_len) != (ssize_t)req_len) {
 		close(sock);
 		*err = HTTP_ERROR_MAKING_REQUEST;
@@ -470,16 +1594,26 @@ HTTP_Request http_req_create() {
 	return (HTTP_Request) {NULL, 0, NULL, http_headers_create(0)};
 }
 
-HTTP_Request http_req_parse(uint8_t *bytes, HTTP_Error *err) {
+// Parses the request line and headers; *body is set to where the body
+// starts. Nothing past the blank line is read. Header lines go through
+// http_head_next, the same tokenizer the framing checks use.
+static HTTP_Request http_req_parse_head(uint8_t *bytes, size_t len, HTTP_Error *err, char **body) {
 	HTTP_Request req = http_req_create();
 	*err = HTTP_ERROR_NULL;
 
+	size_t head_len = http_find_head_end(bytes, len);
+	if (head_len == 0) {
+		*err = HTTP_ERROR_PARSING_HEADERS;
+		return req;
+	}
+	const char *end = (const char *) bytes + head_len;
+
 	char *str = (char *) bytes;
 	char *lp = str;
 	size_t sl_cnt = 0;
 
 	// status line parsing
-	while (!(str[-1] == '\r' && *str == '\n')) {
+	while (!(str > (char *) bytes && str[-1] == '\r' && *str == '\n')) {
 		if (*str == '\n') {
 			*err = HTTP_ERROR_PARSING_STATUS_LINE;
 			return req;
@@ -503,55 +1637,60 @@ HTTP_Request http_req_parse(uint8_t *bytes, HTTP_Error *err) {
 		*err = HTTP_ERROR_PARSING_STATUS_LINE;
 		return req;
 	}
+	if (http_req_split_target(&req) < 0) {
+		*err = HTTP_ERROR_PARSING_STATUS_LINE;
+		return req;
+	}
 
-	// headers parsing
-	while (!(str[-2] == '\r' && str[-1] == '\n' && str[0] == '\r' && str[1] == '\n')) {
-		HTTP_Header header = {0};
-		const char *lp = str;
-
-		while (*str && !(*str == ':' && *(str+1) == ' ')) str++;
-		if (!*str) {
+	// headers parsing; a name needs its colon and may not hold blanks
+	const char *p = str;
+	HTTP_Slice name, value;
+	while (http_head_next(&p, end, &name, &value)) {
+		if (name.len == 0 || memchr(name.ptr, ' ', name.len) || memchr(name.ptr, '\t', name.len)) {
 			*err = HTTP_ERROR_PARSING_HEADERS;
 			return req;
 		}
 
-		header.key = (char *) malloc(str - lp + 1);
-		memcpy(header.key, lp, str - lp);
-		header.key[str - lp] = '\0';
-
-		str += 2;
-		lp = str;
-
-		while (*str && !(str[0] == '\r' && str[1] == '\n')) str++;
-		if (!*str) {
+		HTTP_Header header;
+		header.key = (char *) malloc(name.len + 1);
+		header.value = (char *) malloc(value.len + 1);
+		if (!header.key || !header.value) {
+			free(header.key);
+			free(header.value);
 			*err = HTTP_ERROR_PARSING_HEADERS;
 			return req;
 		}
-
-		header.value = (char *) malloc(str - lp + 1);
-		memcpy(header.value, lp, str - lp);
-		header.value[str - lp] = '\0';
-
-		str += 2;
-
+		memcpy(header.key, name.ptr, name.len);
+		header.key[name.len] = '\0';
+		memcpy(header.value, value.ptr, value.len);
+		header.value[value.len] = '\0';
 		http_headers_add(&req.headers, header);
 	}
 
-	str += 2;
+	*body = (char *) end;
+	return req;
+}
 
-	char *content_length = http_headers_get(&req.headers, "Content-Length");
-	if (content_length == NULL) {
+HTTP_Request http_req_parse(uint8_t *bytes, size_t len, HTTP_Error *err) {
+	char *str;
+	HTTP_Request req = http_req_parse_head(bytes, len, err, &str);
+	if (*err) return req;
+
+	size_t head_len = (size_t)((uint8_t *) str - bytes);
+	size_t body_len;
+	if (http_head_content_length(bytes, head_len, &body_len) < 0 || body_len > len - head_len) {
+		*err = HTTP_ERROR_PARSING_HEADERS;
 		return req;
 	}
+	if (body_len == 0) return req;
 
-	req.body_len = atoll(content_length);
-	if (req.body_len == 0) {
+	req.body = (uint8_t *) malloc(body_len);
+	if (!req.body) {
 		*err = HTTP_ERROR_PARSING_HEADERS;
 		return req;
 	}
-
-	req.body = (uint8_t *) malloc(req.body_len * sizeof(uint8_t));
-	memcpy(req.body, str, req.body_len * sizeof(uint8_t));
+	memcpy(req.body, str, body_len);
+	req.body_len = body_len;
 
 	return req;
 }
@@ -568,24 +1707,29 @@ void http_req_set_status_line(HTTP_Request *hr, const char *method, const char *
 
 void http_req_set_body(HTTP_Request *hr, uint8_t *body, size_t len) {
 	char buf[32];
-	sprintf(buf, "%zu", len);
+	buf[http_fmt_uint(buf, len)] = '\0';
 	http_req_add_header(hr, "Content-Length", buf);
 	hr->body = body;
 	hr->body_len = len;
 }
 
-char *http_req_header_to_str(HTTP_Request *hr) {
-	HTTP_StringBuilder str = http_sb_create(128);
-	http_sb_append_strf(&str, "%s %s %s\r\n", hr->method, hr->target, hr->protocol);
+void http_req_header_to_sb(HTTP_Request *hr, HTTP_StringBuilder *sb) {
+	http_sb_append_str(sb, hr->method);
+	http_sb_append_char(sb, ' ');
+	http_sb_append_str(sb, hr->target);
+	http_sb_append_char(sb, ' ');
+	http_sb_append_str(sb, hr->protocol);
+	http_sb_append_strn(sb, "\r\n", 2);
 
-	for (size_t i = 0; i < hr->headers.count; i++) {
-		http_sb_append_strf(
-				&str, "%s: %s\r\n",
-				hr->headers.headers[i].key,
-				hr->headers.headers[i].value);
-	}
+	for (size_t i = 0; i < hr->headers.count; i++)
+		http_sb_append_header(sb, hr->headers.headers[i].key, hr->headers.headers[i].value);
+
+	http_sb_append_strn(sb, "\r\n", 2);
+}
 
-	http_sb_append_str(&str, "\r\n");
+char *http_req_header_to_str(HTTP_Request *hr) {
+	HTTP_StringBuilder str = http_sb_create(128);
+	http_req_header_to_sb(hr, &str);
 	return http_sb_to_str(str);
 }
 
@@ -595,6 +1739,8 @@ void http_req_destroy(HTTP_Request *hr) {
 	free(hr->target);
 	http_headers_destroy(&hr->headers);
 	free(hr->body);
+	free(hr->path);
+	if (hr->params_parsed) http_headers_destroy(&hr->params);
 }
 
 // HTTP Response
@@ -695,8 +1841,8 @@ void http_resp_set_status_line(HTTP_Response *hr, uint16_t status_code, const ch
 }
 
 void http_resp_set_body(HTTP_Response *hr, uint8_t *body, size_t len) {
-	char buf[128];
-	sprintf(buf, "%zu", len);
+	char buf[32];
+	buf[http_fmt_uint(buf, len)] = '\0';
 	http_resp_add_header(hr, "Content-Length", buf);
 	hr->body = body;
 	hr->body_len = len;
@@ -706,18 +1852,23 @@ void http_resp_add_header(HTTP_Response *hr, const char *key, const char *value)
 	http_headers_add(&hr->headers, (HTTP_Header) {strdup(key), strdup(value)});
 }
 
-char *http_resp_header_to_str(HTTP_Response *hr) {
-	HTTP_StringBuilder str = http_sb_create(128);
-	http_sb_append_strf(&str, "%s %i %s\r\n", hr->protocol, (int)hr->status_code, hr->reason_phrase);
+void http_resp_header_to_sb(HTTP_Response *hr, HTTP_StringBuilder *sb) {
+	http_sb_append_str(sb, hr->protocol ? hr->protocol : PROTOCOL);
+	http_sb_append_char(sb, ' ');
+	http_sb_append_status(sb, hr->status_code);
+	http_sb_append_char(sb, ' ');
+	if (hr->reason_phrase) http_sb_append_str(sb, hr->reason_phrase);
+	http_sb_append_strn(sb, "\r\n", 2);
 
-	for (size_t i = 0; i < hr->headers.count; i++) {
-		http_sb_append_strf(
-				&str, "%s: %s\r\n",
-				hr->headers.headers[i].key,
-				hr->headers.headers[i].value);
-	}
+	for (size_t i = 0; i < hr->headers.count; i++)
+		http_sb_append_header(sb, hr->headers.headers[i].key, hr->headers.headers[i].value);
+
+	http_sb_append_strn(sb, "\r\n", 2);
+}
 
-	http_sb_append_str(&str, "\r\n");
+char *http_resp_header_to_str(HTTP_Response *hr) {
+	HTTP_StringBuilder str = http_sb_create(128);
+	http_resp_header_to_sb(hr, &str);
 	return http_sb_to_str(str);
 }
 
@@ -728,126 +1879,4360 @@ void http_resp_destroy(HTTP_Response *hr) {
 	free(hr->body);
 }
 
-static void http_server_grow_if_needed(HTTP_Server *serv) {
-	if (serv->hfs_count < serv->hfs_cap) return;
-	size_t newcap = serv->hfs_cap ? serv->hfs_cap * 2 : 8;
+// Pipelined client
 
-	const char **nt = (const char **) realloc((void*)serv->targets, sizeof(*nt) * newcap);
-	if (!nt) { perror("realloc targets"); exit(1); }
-	serv->targets = nt;
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-	HTTP_HandleFunc *nh = (HTTP_HandleFunc *) realloc(serv->hfs, sizeof(*nh) * newcap);
-	if (!nh) { perror("realloc hfs"); exit(1); }
-	serv->hfs = nh;
+typedef enum {
+	HTTP_CLIENT_DONE,
+	HTTP_CLIENT_RESEND, // the server closed before it read the rest
+	HTTP_CLIENT_FAILED,
+	HTTP_CLIENT_BAD_RESPONSE,
+} HTTP_ClientRound;
+
+HTTP_Client http_client_create(const char *host, uint16_t port) {
+	return (HTTP_Client) { .fd = -1, .host = strdup(host), .port = port };
+}
 
-	void **nc = (void **) realloc(serv->hfs_ctx, sizeof(*nc) * newcap);
-	if (!nc) { perror("realloc hfs_ctx"); exit(1); }
+static void http_client_close(HTTP_Client *c) {
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+	c->in_len = 0;
+	c->chunk_scan = 0;
+	http_sb_destroy(&c->chunked);
+}
+
+void http_client_destroy(HTTP_Client *c) {
+	http_client_close(c);
+	free(c->in);
+	free(c->host);
+	c->in = NULL;
+	c->in_cap = 0;
+	c->host = NULL;
+}
+
+static char *http_slice_dup(HTTP_Slice s) {
+	char *d = (char *) malloc(s.len + 1);
+	if (!d) return NULL;
+	memcpy(d, s.ptr, s.len);
+	d[s.len] = '\0';
+	return d;
+}
+
+// Decodes the complete chunks of a chunked body that starts at
+// c->in + start into c->chunked, dropping them from c->in as it goes.
+// Returns the end offset of the body and its trailers once the last
+// chunk is in, 0 if more is needed, -1 if the framing is malformed, or
+// -2 if out of memory.
+static ssize_t http_client_dechunk(HTTP_Client *c, size_t start) {
+	if (c->chunk_scan == 0) {
+		c->chunked = http_sb_create(4096);
+		if (!c->chunked.str) return -2;
+		c->chunk_scan = start;
+	}
+
+	const char *buf = (const char *) c->in;
+	ssize_t end = 0;
+	for (;;) {
+		size_t pos = c->chunk_scan;
+		const char *eol = (const char *) memchr(buf + pos, '\n', c->in_len - pos);
+		if (!eol) {
+			if (c->in_len - pos > 1024) end = -1;
+			break;
+		}
+
+		size_t size = 0, i = 0;
+		for (; buf + pos + i < eol; i++) {
+			int d = http_hex_digit(buf[pos + i]);
+			if (d < 0) break;
+			if (size > HTTP_CLIENT_MAX_BODY_BYTES) return -1;
+			size = (size << 4) | (size_t) d;
+		}
+		if (i == 0 || eol[-1] != '\r') return -1;
+		size_t data = (size_t)(eol + 1 - buf);
+
+		if (size == 0) {
+			// Trailers, if any, end at the first empty line.
+			const char *t = (const char *) memmem(eol - 1, c->in_len - (data - 2), "\r\n\r\n", 4);
+			if (t) end = (ssize_t)(t + 4 - buf);
+			else if (c->in_len - data > HTTP_CLIENT_MAX_HEAD_BYTES) end = -1;
+			break;
+		}
+		if (c->chunked.cnt + size > HTTP_CLIENT_MAX_BODY_BYTES) return -1;
+		if (c->in_len < data + size + 2) break;
+		if (buf[data + size] != '\r' || buf[data + size + 1] != '\n') return -1;
+		if (c->chunked.cnt + size >= c->chunked.cap) {
+			size_t cap = c->chunked.cap;
+			while (cap <= c->chunked.cnt + size) cap *= 2;
+			char *str = (char *) realloc(c->chunked.str, cap);
+			if (!str) return -2;
+			c->chunked.str = str;
+			c->chunked.cap = cap;
+		}
+		http_sb_append_strn(&c->chunked, buf + data, size);
+		c->chunk_scan = data + size + 2;
+	}
+
+	// Keep only the head and what is left of the body.
+	if (end == 0 && c->chunk_scan > start) {
+		memmove(c->in + start, c->in + c->chunk_scan, c->in_len - c->chunk_scan);
+		c->in_len -= c->chunk_scan - start;
+		c->chunk_scan = start;
+	}
+	return end;
+}
+
+// Parses the response at the front of c->in, skipping 1xx interim
+// responses. Returns 1 and consumes it once it is complete, 0 if more
+// is needed, -1 if it is malformed, or -2 if out of memory.
+static int http_client_parse(HTTP_Client *c, bool head_req, bool eof, HTTP_Response *resp, bool *closing) {
+	size_t head_len;
+	const char *head, *eol;
+	uint16_t status;
+	for (;;) {
+		head_len = http_find_head_end(c->in, c->in_len);
+		if (head_len == 0) return c->in_len > HTTP_CLIENT_MAX_HEAD_BYTES ? -1 : 0;
+
+		head = (const char *) c->in;
+		eol = (const char *) memchr(head, '\n', head_len);
+		if (eol - head < 13 || memcmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ') return -1;
+		status = 0;
+		for (int i = 9; i < 12; i++) {
+			if (head[i] < '0' || head[i] > '9') return -1;
+			status = (uint16_t)(status * 10 + (head[i] - '0'));
+		}
+		if (head[12] != ' ' && head[12] != '\r') return -1;
+		if (status >= 200) break;
+		if (status == 101) return -1;
+		memmove(c->in, c->in + head_len, c->in_len - head_len);
+		c->in_len -= head_len;
+	}
+
+	HTTP_Slice te = http_head_get(head, head_len, "Transfer-Encoding");
+	HTTP_Slice cl = http_head_get(head, head_len, "Content-Length");
+	HTTP_Slice connection = http_head_get(head, head_len, "Connection");
+	bool keep_alive = head[7] == '1'
+		? !http_token_list_has(connection, "close")
+		: http_token_list_has(connection, "keep-alive");
+
+	bool chunked = false;
+	size_t body_len = 0, end;
+	if (head_req || status == 204 || status == 304) {
+		end = head_len;
+	} else if (te.len && http_token_list_has(te, "chunked")) {
+		ssize_t n = http_client_dechunk(c, head_len);
+		if (n <= 0) return (int) n;
+		chunked = true;
+		end = (size_t) n;
+	} else if (cl.len && !te.len) {
+		for (size_t i = 0; i < cl.len; i++) {
+			if (cl.ptr[i] < '0' || cl.ptr[i] > '9') return -1;
+			body_len = body_len * 10 + (size_t)(cl.ptr[i] - '0');
+			if (body_len > HTTP_CLIENT_MAX_BODY_BYTES) return -1;
+		}
+		if (c->in_len < head_len + body_len) return 0;
+		end = head_len + body_len;
+	} else {
+		// Delimited by the server closing the connection.
+		if (!eof) return c->in_len - head_len > HTTP_CLIENT_MAX_BODY_BYTES ? -1 : 0;
+		body_len = c->in_len - head_len;
+		end = c->in_len;
+		keep_alive = false;
+	}
+
+	HTTP_Response r = http_resp_create();
+	free(r.protocol);
+	r.protocol = http_slice_dup((HTTP_Slice) { head, 8 });
+	r.status_code = status;
+	const char *le = eol[-1] == '\r' ? eol - 1 : eol;
+	const char *reason = head[12] == ' ' ? head + 13 : le;
+	r.reason_phrase = http_slice_dup((HTTP_Slice) { reason, (size_t)(le - reason) });
+	if (!r.protocol || !r.reason_phrase || !r.headers.headers) goto oom;
+
+	const char *p = eol + 1;
+	HTTP_Slice name, value;
+	while (http_head_next(&p, head + head_len, &name, &value)) {
+		if (!name.len) continue;
+		HTTP_Header h = { http_slice_dup(name), http_slice_dup(value) };
+		if (!h.key || !h.value) {
+			free(h.key);
+			free(h.value);
+			goto oom;
+		}
+		http_headers_add(&r.headers, h);
+	}
+
+	if (chunked) {
+		r.body = (uint8_t *) c->chunked.str;
+		r.body_len = c->chunked.cnt;
+		c->chunked = (HTTP_StringBuilder) {0};
+		c->chunk_scan = 0;
+	} else if (body_len > 0) {
+		r.body = (uint8_t *) malloc(body_len);
+		if (!r.body) goto oom;
+		memcpy(r.body, c->in + head_len, body_len);
+		r.body_len = body_len;
+	}
+	*resp = r;
+
+	memmove(c->in, c->in + end, c->in_len - end);
+	c->in_len -= end;
+	*closing = !keep_alive;
+	return 1;
+
+oom:
+	http_resp_destroy(&r);
+	return -2;
+}
+
+// Sends the requests on c->fd and reads responses until all of them are
+// in or the connection ends. Reading starts while the requests are still
+// going out, so a server that answers before it has read the whole batch
+// cannot deadlock against us.
+static HTTP_ClientRound http_client_round(HTTP_Client *c, HTTP_Request *reqs, size_t count, HTTP_Response *resps, size_t *got, bool reused) {
+	HTTP_ClientRound res = HTTP_CLIENT_FAILED;
+	HTTP_StringBuilder heads = http_sb_create(256 * count);
+	size_t *ends = (size_t *) malloc(count * sizeof(size_t));
+	struct iovec *iov = (struct iovec *) malloc((2 * count + 1) * sizeof(struct iovec));
+	bool closing = false, eof = false, got_bytes = false;
+	*got = 0;
+	if (!heads.str || !ends || !iov) goto out;
+
+	for (size_t i = 0; i < count; i++) {
+		http_req_header_to_sb(&reqs[i], &heads);
+		ends[i] = heads.cnt;
+	}
+
+	// Heads of requests without a body share one iovec.
+	size_t iovcnt = 0, from = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (reqs[i].body_len == 0 || reqs[i].body == NULL) continue;
+		iov[iovcnt++] = (struct iovec) { heads.str + from, ends[i] - from };
+		iov[iovcnt++] = (struct iovec) { reqs[i].body, reqs[i].body_len };
+		from = ends[i];
+	}
+	if (from < heads.cnt) iov[iovcnt++] = (struct iovec) { heads.str + from, heads.cnt - from };
+
+	size_t at = 0;
+	while (*got < count) {
+		struct pollfd pfd = { c->fd, (short)(POLLIN | (at < iovcnt ? POLLOUT : 0)), 0 };
+		int pr = poll(&pfd, 1, HTTP_CLIENT_TIMEOUT_MS);
+		if (pr < 0 && errno == EINTR) continue;
+		if (pr <= 0) break;
+
+		if (at < iovcnt && (pfd.revents & (POLLOUT | POLLERR | POLLHUP))) {
+			struct msghdr msg = {0};
+			msg.msg_iov = iov + at;
+			msg.msg_iovlen = iovcnt - at < IOV_MAX ? iovcnt - at : IOV_MAX;
+			ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+			// On a write error, the read side tells what the server made of it.
+			if (n < 0 && errno != EAGAIN && errno != EINTR) at = iovcnt;
+			while (n > 0) {
+				if ((size_t) n >= iov[at].iov_len) {
+					n -= (ssize_t) iov[at++].iov_len;
+				} else {
+					iov[at].iov_base = (uint8_t *) iov[at].iov_base + n;
+					iov[at].iov_len -= (size_t) n;
+					n = 0;
+				}
+			}
+		}
+		if (!(pfd.revents & (POLLIN | POLLERR | POLLHUP))) continue;
+
+		if (c->in_cap - c->in_len < 16384) {
+			size_t cap = c->in_cap ? c->in_cap * 2 : 65536;
+			uint8_t *in = (uint8_t *) realloc(c->in, cap);
+			if (!in) goto out;
+			c->in = in;
+			c->in_cap = cap;
+		}
+		ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+		if (n > 0) {
+			c->in_len += (size_t) n;
+			got_bytes = true;
+		} else {
+			eof = true;
+		}
+
+		while (*got < count && !closing) {
+			bool head_req = strcmp(reqs[*got].method, METHOD_HEAD) == 0;
+			int r = http_client_parse(c, head_req, eof, &resps[*got], &closing);
+			if (r < 0) {
+				if (r == -1) res = HTTP_CLIENT_BAD_RESPONSE;
+				goto out;
+			}
+			if (r == 0) break;
+			(*got)++;
+		}
+		if (closing || eof) break;
+	}
+
+	if (*got == count) res = HTTP_CLIENT_DONE;
+	else if (closing || (eof && reused && !got_bytes)) res = HTTP_CLIENT_RESEND;
+
+out:
+	if (res != HTTP_CLIENT_DONE || closing || eof) http_client_close(c);
+	free(iov);
+	free(ends);
+	http_sb_destroy(&heads);
+	return res;
+}
+
+size_t http_client_batch(HTTP_Client *c, HTTP_Request *reqs, size_t count, HTTP_Response *resps, HTTP_Error *err) {
+	*err = HTTP_ERROR_NULL;
+	memset(resps, 0, count * sizeof(HTTP_Response));
+
+	size_t done = 0;
+	while (done < count) {
+		bool reused = c->fd >= 0;
+		if (!reused) {
+			c->fd = http_connect(c->host, c->port);
+			if (c->fd < 0 || http_set_nonblocking(c->fd) < 0) {
+				http_client_close(c);
+				break;
+			}
+		}
+
+		size_t got = 0;
+		HTTP_ClientRound r = http_client_round(c, reqs + done, count - done, resps + done, &got, reused);
+		done += got;
+		if (r == HTTP_CLIENT_BAD_RESPONSE) {
+			*err = HTTP_ERROR_PARSING_HEADERS;
+			return done;
+		}
+		// A fresh connection that got nothing back is not retried.
+		if (r == HTTP_CLIENT_FAILED || (r == HTTP_CLIENT_RESEND && got == 0 && !reused)) break;
+	}
+
+	if (done < count) *err = HTTP_ERROR_MAKING_REQUEST;
+	return done;
+}
+
+// Multipart
+
+bool http_header_param(const char *value, size_t value_len, const char *key, const char **out, size_t *out_len) {
+	size_t klen = strlen(key);
+	const char *p = value, *end = value + value_len;
+	while (p < end) {
+		const char *semi = (const char *) memchr(p, ';', (size_t)(end - p));
+		if (!semi) break;
+		p = semi + 1;
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if ((size_t)(end - p) <= klen || strncasecmp(p, key, klen) != 0 || p[klen] != '=') continue;
+
+		const char *v = p + klen + 1;
+		if (v < end && *v == '"') {
+			const char *q = (const char *) memchr(v + 1, '"', (size_t)(end - v - 1));
+			if (!q) return false;
+			*out = v + 1;
+			*out_len = (size_t)(q - v - 1);
+		} else {
+			const char *e = v;
+			while (e < end && *e != ';' && *e != ' ' && *e != '\t') e++;
+			*out = v;
+			*out_len = (size_t)(e - v);
+		}
+		return true;
+	}
+	return false;
+}
+
+int http_multipart_init(HTTP_Multipart *mp, const char *content_type, const HTTP_MultipartCallbacks *cb, void *ctx) {
+	memset(mp, 0, sizeof *mp);
+	const char *boundary;
+	size_t blen;
+	if (!content_type || !http_header_param(content_type, strlen(content_type), "boundary", &boundary, &blen)) return -1;
+	if (blen == 0 || blen > HTTP_MULTIPART_MAX_BOUNDARY) return -1;
+
+	mp->cb = *cb;
+	mp->ctx = ctx;
+	memcpy(mp->delim, "\r\n--", 4);
+	memcpy(mp->delim + 4, boundary, blen);
+	mp->delim_len = 4 + blen;
+
+	for (size_t i = 0; i < 256; i++) mp->skip[i] = (uint8_t) mp->delim_len;
+	for (size_t i = 0; i + 1 < mp->delim_len; i++) mp->skip[mp->delim[i]] = (uint8_t)(mp->delim_len - 1 - i);
+
+	// The first delimiter may open the body without a CRLF in front of it.
+	memcpy(mp->hold, "\r\n", 2);
+	mp->hold_len = 2;
+	mp->state = HTTP_MULTIPART_PREAMBLE;
+	return 0;
+}
+
+void http_multipart_destroy(HTTP_Multipart *mp) {
+	free(mp->head);
+	mp->head = NULL;
+	mp->head_len = mp->head_cap = 0;
+}
+
+// Boyer-Moore-Horspool, with memchr to get to the next possible
+// alignment of the delimiter's last byte in long runs of data.
+static const uint8_t *http_multipart_search(const HTTP_Multipart *mp, const uint8_t *hay, size_t n) {
+	size_t m = mp->delim_len;
+	if (n < m) return NULL;
+	uint8_t last = mp->delim[m - 1];
+	size_t i = 0;
+	while (i <= n - m) {
+		uint8_t c = hay[i + m - 1];
+		if (c == last && memcmp(hay + i, mp->delim, m - 1) == 0) return hay + i;
+		if (c != last && mp->skip[c] == m) {
+			const uint8_t *next = (const uint8_t *) memchr(hay + i + m, last, n - i - m);
+			if (!next) return NULL;
+			i = (size_t)(next - hay) - (m - 1);
+			continue;
+		}
+		i += mp->skip[c];
+	}
+	return NULL;
+}
+
+static int http_multipart_fail(HTTP_Multipart *mp) {
+	mp->state = HTTP_MULTIPART_ERROR;
+	return -1;
+}
+
+static int http_multipart_data(HTTP_Multipart *mp, const uint8_t *data, size_t len) {
+	if (len == 0 || mp->state != HTTP_MULTIPART_DATA || !mp->cb.on_data) return 0;
+	return mp->cb.on_data(mp->ctx, data, len);
+}
+
+static int http_multipart_headers(HTTP_Multipart *mp) {
+	const char *p = mp->head, *end = mp->head + mp->head_len - 2;
+	while (p < end) {
+		const char *eol = (const char *) memchr(p, '\r', (size_t)(end - p));
+		if (!eol) eol = end;
+		const char *colon = (const char *) memchr(p, ':', (size_t)(eol - p));
+		if (!colon) return -1;
+
+		const char *v = colon + 1;
+		while (v < eol && (*v == ' ' || *v == '\t')) v++;
+		if (mp->cb.on_header && mp->cb.on_header(mp->ctx, p, (size_t)(colon - p), v, (size_t)(eol - v)) != 0) return -1;
+		p = eol + 2;
+	}
+	return 0;
+}
+
+// Collects the part's header block, which ends at the first empty line.
+// Returns how many bytes it took from data, or -1.
+static ssize_t http_multipart_head(HTTP_Multipart *mp, const uint8_t *data, size_t len) {
+	size_t take = 0;
+	while (take < len) {
+		if (mp->head_len == mp->head_cap) {
+			if (mp->head_cap >= HTTP_MULTIPART_MAX_HEADER_BYTES) return -1;
+			size_t cap = mp->head_cap ? mp->head_cap * 2 : 256;
+			char *nh = (char *) realloc(mp->head, cap);
+			if (!nh) return -1;
+			mp->head = nh;
+			mp->head_cap = cap;
+		}
+		char c = (char) data[take++];
+		mp->head[mp->head_len++] = c;
+		if (c != '\n') continue;
+
+		size_t n = mp->head_len;
+		bool empty = n == 2 && mp->head[0] == '\r';
+		if (!empty && !(n >= 4 && memcmp(mp->head + n - 4, "\r\n\r\n", 4) == 0)) continue;
+
+		if (http_multipart_headers(mp) < 0) return -1;
+		mp->head_len = 0;
+		mp->state = HTTP_MULTIPART_DATA;
+		return (ssize_t) take;
+	}
+	return (ssize_t) take;
+}
+
+// Consumes what follows a delimiter: "--" ends the body, CRLF starts the
+// next part. Returns how many bytes it took, or -1.
+static ssize_t http_multipart_delimiter(HTTP_Multipart *mp, const uint8_t *data, size_t len) {
+	size_t take = 0;
+	while (take < len && mp->tail_len < 2) {
+		uint8_t c = data[take++];
+		// Transport padding between the boundary and its CRLF is allowed.
+		if (mp->tail_len == 0 && (c == ' ' || c == '\t')) continue;
+		mp->tail[mp->tail_len++] = c;
+	}
+	if (mp->tail_len < 2) return (ssize_t) take;
+
+	mp->tail_len = 0;
+	if (memcmp(mp->tail, "--", 2) == 0) {
+		mp->state = HTTP_MULTIPART_DONE;
+		return (ssize_t) len;
+	}
+	if (memcmp(mp->tail, "\r\n", 2) != 0) return -1;
+	if (mp->cb.on_part_begin && mp->cb.on_part_begin(mp->ctx) != 0) return -1;
+	mp->state = HTTP_MULTIPART_HEADERS;
+	return (ssize_t) take;
+}
+
+// Called with the delimiter found: finishes the current part, if any.
+static int http_multipart_boundary(HTTP_Multipart *mp) {
+	bool in_part = mp->state == HTTP_MULTIPART_DATA;
+	mp->state = HTTP_MULTIPART_DELIMITER;
+	if (in_part && mp->cb.on_part_end && mp->cb.on_part_end(mp->ctx) != 0) return -1;
+	return 0;
+}
+
+// Data (or preamble) up to the next delimiter. Everything before the
+// last delim_len - 1 bytes is passed on in place; only that tail can be
+// the start of a delimiter that completes in the next chunk.
+static ssize_t http_multipart_body(HTTP_Multipart *mp, const uint8_t *data, size_t len) {
+	size_t m = mp->delim_len;
+
+	if (mp->hold_len > 0) {
+		uint8_t tmp[2 * (4 + HTTP_MULTIPART_MAX_BOUNDARY)];
+		size_t extra = len < m ? len : m;
+		memcpy(tmp, mp->hold, mp->hold_len);
+		memcpy(tmp + mp->hold_len, data, extra);
+		size_t n = mp->hold_len + extra;
+
+		const uint8_t *hit = http_multipart_search(mp, tmp, n);
+		if (hit) {
+			size_t at = (size_t)(hit - tmp);
+			if (http_multipart_data(mp, tmp, at) != 0) return -1;
+			size_t used = at + m - mp->hold_len;
+			mp->hold_len = 0;
+			if (http_multipart_boundary(mp) < 0) return -1;
+			return (ssize_t) used;
+		}
+
+		size_t safe = n >= m ? n - (m - 1) : 0;
+		if (safe >= mp->hold_len) {
+			if (http_multipart_data(mp, mp->hold, mp->hold_len) != 0) return -1;
+			mp->hold_len = 0;
+			return 0;
+		}
+
+		// The chunk is too short to decide; all of it joins the hold.
+		if (http_multipart_data(mp, tmp, safe) != 0) return -1;
+		memmove(mp->hold, tmp + safe, n - safe);
+		mp->hold_len = n - safe;
+		return (ssize_t) len;
+	}
+
+	const uint8_t *hit = http_multipart_search(mp, data, len);
+	if (hit) {
+		size_t at = (size_t)(hit - data);
+		if (http_multipart_data(mp, data, at) != 0) return -1;
+		if (http_multipart_boundary(mp) < 0) return -1;
+		return (ssize_t)(at + m);
+	}
+
+	// Hold back the longest suffix that is a prefix of the delimiter.
+	size_t from = len > m - 1 ? len - (m - 1) : 0;
+	for (; from < len; from++) {
+		if (data[from] == '\r' && memcmp(data + from, mp->delim, len - from) == 0) break;
+	}
+	if (http_multipart_data(mp, data, from) != 0) return -1;
+	memcpy(mp->hold, data + from, len - from);
+	mp->hold_len = len - from;
+	return (ssize_t) len;
+}
+
+int http_multipart_feed(HTTP_Multipart *mp, const uint8_t *data, size_t len) {
+	size_t off = 0;
+	while (off < len) {
+		ssize_t n;
+		switch (mp->state) {
+			case HTTP_MULTIPART_PREAMBLE:
+			case HTTP_MULTIPART_DATA:
+				n = http_multipart_body(mp, data + off, len - off);
+				break;
+			case HTTP_MULTIPART_DELIMITER:
+				n = http_multipart_delimiter(mp, data + off, len - off);
+				break;
+			case HTTP_MULTIPART_HEADERS:
+				n = http_multipart_head(mp, data + off, len - off);
+				break;
+			case HTTP_MULTIPART_DONE:
+				return 0; // the epilogue is ignored
+			default:
+				return -1;
+		}
+		if (n < 0) return http_multipart_fail(mp);
+		off += (size_t) n;
+	}
+	return 0;
+}
+
+// Returns 0 if the body ended with the closing delimiter.
+int http_multipart_finish(HTTP_Multipart *mp) {
+	return mp->state == HTTP_MULTIPART_DONE ? 0 : -1;
+}
+
+static void http_server_grow_if_needed(HTTP_Server *serv) {
+	if (serv->hfs_count < serv->hfs_cap) return;
+	size_t newcap = serv->hfs_cap ? serv->hfs_cap * 2 : 8;
+
+	const char **nt = (const char **) realloc((void*)serv->targets, sizeof(*nt) * newcap);
+	if (!nt) { perror("realloc targets"); exit(1); }
+	serv->targets = nt;
+
+	HTTP_HandleFunc *nh = (HTTP_HandleFunc *) realloc(serv->hfs, sizeof(*nh) * newcap);
+	if (!nh) { perror("realloc hfs"); exit(1); }
+	serv->hfs = nh;
+
+	void **nc = (void **) realloc(serv->hfs_ctx, sizeof(*nc) * newcap);
+	if (!nc) { perror("realloc hfs_ctx"); exit(1); }
 	serv->hfs_ctx = nc;
 
-	serv->hfs_cap = newcap;
+	HTTP_Cache **ncache = (HTTP_Cache **) realloc(serv->caches, sizeof(*ncache) * newcap);
+	if (!ncache) { perror("realloc caches"); exit(1); }
+	serv->caches = ncache;
+
+	serv->hfs_cap = newcap;
+}
+
+void http_server_handle(HTTP_Server *serv, const char *target, HTTP_HandleFunc hf, void *ctx) {
+	http_server_grow_if_needed(serv);
+	serv->targets[serv->hfs_count] = target;
+	serv->hfs[serv->hfs_count] = hf;
+	serv->hfs_ctx[serv->hfs_count] = ctx;
+	serv->caches[serv->hfs_count] = NULL;
+	serv->hfs_count++;
+}
+
+HTTP_Cache *http_server_handle_cached(HTTP_Server *serv, const char *target, HTTP_HandleFunc hf, void *ctx,
+		uint32_t ttl_ms, const char *vary) {
+	HTTP_Cache *cache = (HTTP_Cache *) calloc(1, sizeof *cache);
+	if (!cache) { perror("calloc cache"); exit(1); }
+	cache->ttl_ms = ttl_ms;
+	cache->vary = vary;
+	http_server_handle(serv, target, hf, ctx);
+	serv->caches[serv->hfs_count - 1] = cache;
+	return cache;
+}
+
+void http_server_websocket(HTTP_Server *serv, const char *target,
+		HTTP_WsOpenFunc on_open, HTTP_WsMessageFunc on_message, HTTP_WsCloseFunc on_close, void *ctx) {
+	if (serv->ws_routes_count == serv->ws_routes_cap) {
+		size_t newcap = serv->ws_routes_cap ? serv->ws_routes_cap * 2 : 8;
+		HTTP_WsRoute *nr = (HTTP_WsRoute *) realloc(serv->ws_routes, sizeof(*nr) * newcap);
+		if (!nr) { perror("realloc ws_routes"); exit(1); }
+		serv->ws_routes = nr;
+		serv->ws_routes_cap = newcap;
+	}
+	serv->ws_routes[serv->ws_routes_count++] = (HTTP_WsRoute) { target, on_open, on_message, on_close, ctx };
+}
+
+void http_server_handle_stream(HTTP_Server *serv, const char *target, HTTP_StreamHandler handler, void *ctx) {
+	if (serv->stream_routes_count == serv->stream_routes_cap) {
+		size_t newcap = serv->stream_routes_cap ? serv->stream_routes_cap * 2 : 8;
+		HTTP_StreamRoute *nr = (HTTP_StreamRoute *) realloc(serv->stream_routes, sizeof(*nr) * newcap);
+		if (!nr) { perror("realloc stream_routes"); exit(1); }
+		serv->stream_routes = nr;
+		serv->stream_routes_cap = newcap;
+	}
+	serv->stream_routes[serv->stream_routes_count++] = (HTTP_StreamRoute) { target, handler, ctx };
+}
+
+HTTP_SseHub *http_server_sse(HTTP_Server *serv, const char *target, HTTP_SseOpenFunc on_open, void *ctx) {
+	if (serv->sse_hubs_count == serv->sse_hubs_cap) {
+		size_t newcap = serv->sse_hubs_cap ? serv->sse_hubs_cap * 2 : 8;
+		HTTP_SseHub **nh = (HTTP_SseHub **) realloc(serv->sse_hubs, sizeof(*nh) * newcap);
+		if (!nh) { perror("realloc sse_hubs"); exit(1); }
+		serv->sse_hubs = nh;
+		serv->sse_hubs_cap = newcap;
+	}
+
+	HTTP_SseHub *hub = (HTTP_SseHub *) calloc(1, sizeof *hub);
+	if (!hub) { perror("calloc sse hub"); exit(1); }
+	hub->target = target;
+	hub->on_open = on_open;
+	hub->ctx = ctx;
+	serv->sse_hubs[serv->sse_hubs_count++] = hub;
+	return hub;
+}
+
+int http_server_proxy(HTTP_Server *serv, const char *target, const char *host, uint16_t port) {
+	HTTP_Addr addr;
+	size_t count;
+	if (http_resolve(host, port, &addr, 1, &count) < 0 || count == 0) return -1;
+
+	if (serv->proxy_routes_count == serv->proxy_routes_cap) {
+		size_t newcap = serv->proxy_routes_cap ? serv->proxy_routes_cap * 2 : 8;
+		HTTP_ProxyRoute **nr = (HTTP_ProxyRoute **) realloc(serv->proxy_routes, sizeof(*nr) * newcap);
+		if (!nr) return -1;
+		serv->proxy_routes = nr;
+		serv->proxy_routes_cap = newcap;
+	}
+
+	HTTP_ProxyRoute *route = (HTTP_ProxyRoute *) calloc(1, sizeof *route);
+	if (!route) return -1;
+	route->target = target;
+	route->addr = addr;
+	route->addr_len = http_addr_len(&addr);
+	serv->proxy_routes[serv->proxy_routes_count++] = route;
+	return 0;
+}
+
+void http_server_tick(HTTP_Server *serv, uint32_t interval_ms, HTTP_TickFunc fn, void *ctx) {
+	serv->tick = fn;
+	serv->tick_ctx = ctx;
+	serv->tick_interval_ms = interval_ms ? interval_ms : 1;
+	serv->tick_next = 0;
+}
+
+// Parses one of the listen address forms documented next to HTTP_Listener.
+static int http_listen_addr_parse(const char *str, HTTP_Addr *addr, socklen_t *len) {
+	memset(addr, 0, sizeof *addr);
+
+	if (strncmp(str, "unix:", 5) == 0) {
+		const char *path = str + 5;
+		size_t plen = strlen(path);
+		if (plen == 0 || plen >= sizeof(addr->un.sun_path)) return -1;
+		addr->un.sun_family = AF_UNIX;
+		memcpy(addr->un.sun_path, path, plen);
+		// Abstract sockets are named by a leading NUL and the exact length.
+		if (path[0] == '@') addr->un.sun_path[0] = '\0';
+		*len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + plen + (path[0] == '@' ? 0 : 1));
+		return 0;
+	}
+
+	const char *colon = strrchr(str, ':');
+	if (!colon) return -1;
+	char *end;
+	long port = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || colon[1] == '\0' || port < 0 || port > 65535) return -1;
+
+	char host[64];
+	size_t hlen = (size_t)(colon - str);
+	if (hlen >= sizeof(host)) return -1;
+	memcpy(host, str, hlen);
+	host[hlen] = '\0';
+
+	if (host[0] == '[') {
+		if (hlen < 2 || host[hlen - 1] != ']') return -1;
+		host[hlen - 1] = '\0';
+		addr->in6.sin6_family = AF_INET6;
+		addr->in6.sin6_port = htons((uint16_t)port);
+		if (inet_pton(AF_INET6, host + 1, &addr->in6.sin6_addr) != 1) return -1;
+		*len = sizeof(addr->in6);
+		return 0;
+	}
+
+	addr->in.sin_family = AF_INET;
+	addr->in.sin_port = htons((uint16_t)port);
+	if (hlen == 0 || strcmp(host, "*") == 0) addr->in.sin_addr.s_addr = htonl(INADDR_ANY);
+	else if (inet_pton(AF_INET, host, &addr->in.sin_addr) != 1) return -1;
+	*len = sizeof(addr->in);
+	return 0;
+}
+
+int http_server_listen(HTTP_Server *serv, const char *addr) {
+	HTTP_Listener l = { .socket = -1 };
+	if (http_listen_addr_parse(addr, &l.addr, &l.addr_len) < 0) return -1;
+
+	HTTP_Listener *nl = (HTTP_Listener *) realloc(serv->listeners, sizeof(*nl) * (serv->listeners_count + 1));
+	if (!nl) return -1;
+	serv->listeners = nl;
+	serv->listeners[serv->listeners_count++] = l;
+	return 0;
+}
+
+static void http_server_init(HTTP_Server *serv) {
+	serv->hfs_cap = 32;
+	serv->targets = (const char **) malloc(sizeof(char*) * serv->hfs_cap);
+	serv->hfs = (HTTP_HandleFunc *) malloc(sizeof(HTTP_HandleFunc) * serv->hfs_cap);
+	serv->hfs_ctx = (void **) malloc(sizeof(void*) * serv->hfs_cap);
+	serv->caches = (HTTP_Cache **) malloc(sizeof(HTTP_Cache*) * serv->hfs_cap);
+	if (!serv->targets || !serv->hfs || !serv->hfs_ctx || !serv->caches) {
+		perror("malloc");
+		exit(1);
+	}
+
+	serv->limits = (HTTP_ServerLimits) {
+		.backlog = HTTP_SERVER_DEFAULT_BACKLOG,
+		.max_connections = HTTP_SERVER_DEFAULT_MAX_CONNECTIONS,
+		.max_header_bytes = HTTP_SERVER_DEFAULT_MAX_HEADER_BYTES,
+		.max_body_bytes = HTTP_SERVER_DEFAULT_MAX_BODY_BYTES,
+		.read_timeout_ms = HTTP_SERVER_DEFAULT_READ_TIMEOUT_MS,
+		.write_timeout_ms = HTTP_SERVER_DEFAULT_WRITE_TIMEOUT_MS,
+		.idle_timeout_ms = HTTP_SERVER_DEFAULT_IDLE_TIMEOUT_MS,
+	};
+}
+
+HTTP_Server http_server_create(uint16_t port) {
+	HTTP_Server serv = {0};
+	http_server_init(&serv);
+
+	char addr[16];
+	snprintf(addr, sizeof(addr), ":%u", (unsigned) port);
+	http_server_listen(&serv, addr);
+
+	return serv;
+}
+
+HTTP_Server http_server_create_at(const char *addr) {
+	HTTP_Server serv = {0};
+	http_server_init(&serv);
+
+	if (http_server_listen(&serv, addr) < 0) {
+		fprintf(stderr, "invalid listen address: %s\n", addr);
+		exit(1);
+	}
+
+	return serv;
+}
+
+// Timer wheel
+
+void http_timer_wheel_init(HTTP_TimerWheel *tw, uint64_t now) {
+	memset(tw, 0, sizeof *tw);
+	tw->now = now;
+}
+
+static void http_timer_link(HTTP_TimerWheel *tw, HTTP_Timer *timer) {
+	uint64_t diff = timer->expires - tw->now;
+	size_t level = 0;
+	while (level + 1 < HTTP_TIMER_WHEEL_LEVELS &&
+			diff >= (uint64_t)1 << (HTTP_TIMER_WHEEL_BITS * (level + 1))) {
+		level++;
+	}
+
+	size_t slot = (timer->expires >> (HTTP_TIMER_WHEEL_BITS * level)) & (HTTP_TIMER_WHEEL_SLOTS - 1);
+	HTTP_Timer **head = &tw->slots[level][slot];
+	timer->next = *head;
+	if (*head) (*head)->pprev = &timer->next;
+	*head = timer;
+	timer->pprev = head;
+	timer->level = (uint8_t)level;
+	tw->counts[level]++;
+}
+
+void http_timer_cancel(HTTP_TimerWheel *tw, HTTP_Timer *timer) {
+	if (!timer->pprev) return;
+	*timer->pprev = timer->next;
+	if (timer->next) timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	tw->counts[timer->level]--;
+}
+
+void http_timer_arm(HTTP_TimerWheel *tw, HTTP_Timer *timer, uint64_t expires) {
+	http_timer_cancel(tw, timer);
+
+	uint64_t max = ((uint64_t)1 << (HTTP_TIMER_WHEEL_BITS * HTTP_TIMER_WHEEL_LEVELS)) - 1;
+	if (expires <= tw->now) expires = tw->now + 1;
+	if (expires - tw->now > max) expires = tw->now + max;
+
+	timer->expires = expires;
+	http_timer_link(tw, timer);
+}
+
+// Moves a slot into a local list so callbacks may cancel or re-arm any
+// timer, including the ones still waiting in that list.
+static void http_timer_take_slot(HTTP_TimerWheel *tw, size_t level, size_t slot, HTTP_Timer **list) {
+	*list = tw->slots[level][slot];
+	tw->slots[level][slot] = NULL;
+	if (*list) (*list)->pprev = list;
+}
+
+static void http_timer_cascade(HTTP_TimerWheel *tw, size_t level) {
+	size_t slot = (tw->now >> (HTTP_TIMER_WHEEL_BITS * level)) & (HTTP_TIMER_WHEEL_SLOTS - 1);
+	HTTP_Timer *list;
+	http_timer_take_slot(tw, level, slot, &list);
+	while (list) {
+		HTTP_Timer *timer = list;
+		http_timer_cancel(tw, timer);
+		http_timer_link(tw, timer);
+	}
+}
+
+void http_timer_wheel_advance(HTTP_TimerWheel *tw, uint64_t now, HTTP_TimerFunc cb, void *ctx) {
+	const uint64_t mask = HTTP_TIMER_WHEEL_SLOTS - 1;
+
+	while (tw->now < now) {
+		// Nothing can fire on level 0 before the next cascade point.
+		if (tw->counts[0] == 0) {
+			uint64_t boundary = (tw->now | mask) + 1;
+			if (boundary > now) { tw->now = now; break; }
+			tw->now = boundary - 1;
+		}
+
+		tw->now++;
+		for (size_t level = 1; level < HTTP_TIMER_WHEEL_LEVELS; level++) {
+			if ((tw->now >> (HTTP_TIMER_WHEEL_BITS * (level - 1))) & mask) break;
+			http_timer_cascade(tw, level);
+		}
+
+		HTTP_Timer *list;
+		http_timer_take_slot(tw, 0, tw->now & mask, &list);
+		while (list) {
+			HTTP_Timer *timer = list;
+			http_timer_cancel(tw, timer);
+			cb(ctx, timer);
+		}
+	}
+}
+
+// Milliseconds until the next tick that has work to do (an expiry or a
+// cascade), or -1 when no timer is armed.
+int64_t http_timer_wheel_next(HTTP_TimerWheel *tw) {
+	int64_t best = -1;
+	for (size_t level = 0; level < HTTP_TIMER_WHEEL_LEVELS; level++) {
+		if (tw->counts[level] == 0) continue;
+		size_t shift = HTTP_TIMER_WHEEL_BITS * level;
+		uint64_t base = tw->now >> shift;
+		for (uint64_t j = 1; j <= HTTP_TIMER_WHEEL_SLOTS; j++) {
+			if (!tw->slots[level][(base + j) & (HTTP_TIMER_WHEEL_SLOTS - 1)]) continue;
+			int64_t wait = (int64_t)(((base + j) << shift) - tw->now);
+			if (best < 0 || wait < best) best = wait;
+			break;
+		}
+	}
+	return best;
+}
+
+// Server connections
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Prebuilt responses used to reject or shed a connection without
+// touching the parser, the handlers or the allocator.
+static const char HTTP_RESP_BAD_REQUEST[] =
+	"HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_REQUEST_TIMEOUT[] =
+	"HTTP/1.1 408 Request Timeout\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_PAYLOAD_TOO_LARGE[] =
+	"HTTP/1.1 413 Payload Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_HEADER_FIELDS_TOO_LARGE[] =
+	"HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_TOO_MANY_REQUESTS[] =
+	"HTTP/1.1 429 Too Many Requests\r\nConnection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_NOT_IMPLEMENTED[] =
+	"HTTP/1.1 501 Not Implemented\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_BAD_GATEWAY[] =
+	"HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_GATEWAY_TIMEOUT[] =
+	"HTTP/1.1 504 Gateway Timeout\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char HTTP_RESP_SERVICE_UNAVAILABLE[] =
+	"HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+
+static void http_conn_set_timeout(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now, uint32_t timeout_ms) {
+	if (timeout_ms) http_timer_arm(&serv->timers, &conn->timer, now + timeout_ms);
+	else http_timer_cancel(&serv->timers, &conn->timer);
+}
+
+static void http_conn_close(HTTP_Conn *conn) {
+	if (conn->state == HTTP_CONN_CLOSED) return;
+	close(conn->fd);
+	conn->state = HTTP_CONN_CLOSED;
+}
+
+// Best effort: the socket buffer of a fresh connection always has room
+// for these, and nobody waits on a client that is being rejected anyway.
+static void http_conn_reject(HTTP_Conn *conn, const char *resp, size_t len) {
+	send(conn->fd, resp, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	http_conn_close(conn);
+}
+
+static void http_conn_clear_response(HTTP_Conn *conn) {
+	if (conn->cached) {
+		// The body points into the shared buffer.
+		conn->resp.body = NULL;
+		http_shared_buf_release(conn->cached);
+		conn->cached = NULL;
+	}
+	http_resp_destroy(&conn->resp);
+	conn->resp = (HTTP_Response) {0};
+	http_sb_reset(&conn->out);
+	conn->out_off = 0;
+}
+
+static void http_sse_unsubscribe(HTTP_Conn *conn);
+static void http_proxy_destroy(HTTP_Proxy *p);
+
+static void http_conn_destroy(HTTP_Conn *conn) {
+	http_conn_close(conn);
+	http_conn_clear_response(conn);
+	http_sb_destroy(&conn->out);
+	http_h2_session_destroy(conn->h2);
+	if (conn->ws && conn->ws->on_close) conn->ws->on_close(conn->ws->ctx, conn);
+	http_sb_destroy(&conn->ws_msg);
+	http_sse_unsubscribe(conn);
+	http_proxy_destroy(conn->proxy);
+	if (conn->stream) {
+		conn->stream->handler.end(conn->stream_state, &conn->stream_req, NULL);
+		http_req_destroy(&conn->stream_req);
+	}
+	free(conn->in);
+	free(conn);
+}
+
+// The one matching rule for every kind of route, described next to the
+// http_server_* registration functions.
+static bool http_route_match(const char *target, const char *path) {
+	size_t tlen = strlen(target);
+	if (strncmp(target, path, tlen) != 0) return false;
+	if (path[tlen] == '\0') return true;
+	if (tlen == 1) return false; // "/" is the root only
+	return path[tlen] == '/' || target[tlen - 1] == '/';
+}
+
+// Returns the index of the handler route for path, or -1.
+static int http_server_route(HTTP_Server *serv, const char *path) {
+	for (size_t i = 0; i < serv->hfs_count; i++)
+		if (http_route_match(serv->targets[i], path)) return (int) i;
+	return -1;
+}
+
+static void http_server_call(HTTP_Server *serv, int tid, int route, HTTP_Request *req, HTTP_Response *resp) {
+	HTTP_PROBE2(handler__begin, tid, serv->targets[route]);
+	uint64_t start = http_trace_on() ? http_now_us() : 0;
+	serv->hfs[route](serv->hfs_ctx[route], req, resp);
+	if (http_trace_on()) http_trace_span(serv->targets[route], tid, start, http_now_us());
+	HTTP_PROBE2(handler__end, tid, resp->status_code);
+}
+
+// tid names the connection for tracing.
+static void http_server_dispatch(HTTP_Server *serv, int tid, HTTP_Request *req, HTTP_Response *resp) {
+	const char *path = req->path ? req->path : req->target;
+	int i = http_server_route(serv, path);
+	HTTP_PROBE3(route__match, tid, path, i);
+	if (i >= 0) {
+		http_server_call(serv, tid, i, req, resp);
+		return;
+	}
+
+	http_resp_set_status_line(resp, STATUS_NOT_FOUND, "Not Found");
+	http_resp_add_header(resp, "Connection", "close");
+
+	char *not_found_msg = strdup("404 Not Found");
+	http_resp_set_body(resp, (uint8_t *) not_found_msg, strlen(not_found_msg));
+}
+
+// Looks for token in every key header, matching both without regard to
+// case. With token NULL, tells whether there is a key header at all.
+static bool http_headers_has_token(HTTP_Headers *hh, const char *key, const char *token) {
+	for (size_t i = 0; i < hh->count; i++) {
+		HTTP_Header *h = &hh->headers[i];
+		if (strcasecmp(h->key, key) != 0) continue;
+		if (!token || http_token_list_has((HTTP_Slice) { h->value, strlen(h->value) }, token)) return true;
+	}
+	return false;
+}
+
+static bool http_req_keep_alive(HTTP_Request *req) {
+	if (strcmp(req->protocol, PROTOCOL) != 0) return false;
+	return !http_headers_has_token(&req->headers, "Connection", "close");
+}
+
+// Keep-alive only when both sides allow it and the response is framed,
+// otherwise the client can only detect its end by the close.
+static bool http_resp_keep_alive(HTTP_Response *resp) {
+	if (http_headers_has_token(&resp->headers, "Connection", "close")) return false;
+	return http_headers_has_token(&resp->headers, "Content-Length", NULL);
+}
+
+static bool http_conn_keep_alive(HTTP_Request *req, HTTP_Response *resp) {
+	return http_req_keep_alive(req) && http_resp_keep_alive(resp);
+}
+
+// Returns 1 when the whole response is written, 0 when the socket is
+// full and -1 on error.
+static int http_conn_flush(HTTP_Conn *conn) {
+	size_t head_len = conn->out.cnt;
+	size_t total = head_len + conn->resp.body_len;
+	while (conn->out_off < total) {
+		struct iovec iov[2];
+		int iovcnt = 0;
+		if (conn->out_off < head_len) {
+			iov[iovcnt].iov_base = conn->out.str + conn->out_off;
+			iov[iovcnt++].iov_len = head_len - conn->out_off;
+			if (conn->resp.body_len > 0) {
+				iov[iovcnt].iov_base = conn->resp.body;
+				iov[iovcnt++].iov_len = conn->resp.body_len;
+			}
+		} else {
+			size_t off = conn->out_off - head_len;
+			iov[iovcnt].iov_base = conn->resp.body + off;
+			iov[iovcnt++].iov_len = conn->resp.body_len - off;
+		}
+
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		conn->out_off += (size_t)n;
+	}
+	return 1;
+}
+
+// Streaming protocols (HTTP/2, WebSocket) queue whole frames in conn->out
+// instead of a head plus body. Returns 1 once it is drained, 0 when the
+// socket is full and -1 on error.
+static int http_conn_flush_out(HTTP_Conn *conn) {
+	while (conn->out_off < conn->out.cnt) {
+		ssize_t n = send(conn->fd, conn->out.str + conn->out_off, conn->out.cnt - conn->out_off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Drop what is already sent so a busy stream does not keep growing the buffer.
+				if (conn->out_off >= conn->out.cnt / 2) {
+					memmove(conn->out.str, conn->out.str + conn->out_off, conn->out.cnt - conn->out_off);
+					conn->out.cnt -= conn->out_off;
+					conn->out.str[conn->out.cnt] = '\0';
+					conn->out_off = 0;
+				}
+				return 0;
+			}
+			return -1;
+		}
+		conn->out_off += (size_t) n;
+	}
+	http_sb_reset(&conn->out);
+	conn->out_off = 0;
+	return 1;
+}
+
+// HPACK
+
+typedef struct {
+	const char *name;
+	const char *value;
+} HTTP_HpackEntry;
+
+static const HTTP_HpackEntry http_hpack_static[61] = {
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""},
+};
+
+static const uint16_t http_hpack_huff_syms[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256,
+};
+
+// First code, code count and offset into http_hpack_huff_syms per length.
+static const struct { uint32_t first; uint16_t count; uint16_t offset; } http_hpack_huff_lens[31] = {
+	{0, 0, 0},
+	{0, 0, 0},
+	{0, 0, 0},
+	{0, 0, 0},
+	{0, 0, 0},
+	{0x0, 10, 0},
+	{0x14, 26, 10},
+	{0x5c, 32, 36},
+	{0xf8, 6, 68},
+	{0, 0, 0},
+	{0x3f8, 5, 74},
+	{0x7fa, 3, 79},
+	{0xffa, 2, 82},
+	{0x1ff8, 6, 84},
+	{0x3ffc, 2, 90},
+	{0x7ffc, 3, 92},
+	{0, 0, 0},
+	{0, 0, 0},
+	{0, 0, 0},
+	{0x7fff0, 3, 95},
+	{0xfffe6, 8, 98},
+	{0x1fffdc, 13, 106},
+	{0x3fffd2, 26, 119},
+	{0x7fffd8, 29, 145},
+	{0xffffea, 12, 174},
+	{0x1ffffec, 4, 186},
+	{0x3ffffe0, 15, 190},
+	{0x7ffffde, 19, 205},
+	{0xfffffe2, 29, 224},
+	{0, 0, 0},
+	{0x3ffffffc, 4, 253},
+};
+
+static int http_hpack_int(const uint8_t **p, const uint8_t *end, uint8_t prefix, size_t *out) {
+	if (*p >= end) return -1;
+	size_t max = (1u << prefix) - 1;
+	size_t v = **p & max;
+	(*p)++;
+	if (v < max) { *out = v; return 0; }
+
+	for (size_t shift = 0; *p < end && shift < 28; shift += 7) {
+		uint8_t b = *(*p)++;
+		v += (size_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) { *out = v; return 0; }
+	}
+	return -1;
+}
+
+static int http_hpack_huff_decode(const uint8_t *src, size_t len, HTTP_StringBuilder *out) {
+	uint32_t code = 0;
+	size_t bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--) {
+			code = (code << 1) | ((src[i] >> b) & 1);
+			if (++bits > 30) return -1;
+			uint32_t first = http_hpack_huff_lens[bits].first;
+			if (http_hpack_huff_lens[bits].count == 0 || code < first || code - first >= http_hpack_huff_lens[bits].count) continue;
+
+			uint16_t sym = http_hpack_huff_syms[http_hpack_huff_lens[bits].offset + code - first];
+			if (sym == 256) return -1;
+			http_sb_append_char(out, (char) sym);
+			code = 0;
+			bits = 0;
+		}
+	}
+	// Padding is the most significant bits of EOS: fewer than 8 ones.
+	if (bits > 7 || code != (1u << bits) - 1) return -1;
+	return 0;
+}
+
+static char *http_hpack_string(const uint8_t **p, const uint8_t *end) {
+	if (*p >= end) return NULL;
+	bool huff = (**p & 0x80) != 0;
+	size_t len;
+	if (http_hpack_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p)) return NULL;
+
+	HTTP_StringBuilder sb = http_sb_create(len + 1);
+	if (huff) {
+		if (http_hpack_huff_decode(*p, len, &sb) < 0) { http_sb_destroy(&sb); return NULL; }
+	} else {
+		http_sb_append_strn(&sb, (const char *) *p, len);
+	}
+	*p += len;
+	return http_sb_to_str(sb);
+}
+
+static size_t http_hpack_entry_size(const HTTP_Header *h) {
+	return strlen(h->key) + strlen(h->value) + 32;
+}
+
+static void http_hpack_evict(HTTP_HpackTable *t, size_t max) {
+	while (t->count > 0 && t->size > max) {
+		HTTP_Header *h = &t->entries[--t->count];
+		t->size -= http_hpack_entry_size(h);
+		free(h->key);
+		free(h->value);
+	}
+}
+
+// Newest entries live at index 0, as HPACK numbers them. Returns -1 if
+// out of memory.
+static int http_hpack_insert(HTTP_HpackTable *t, const char *name, const char *value) {
+	HTTP_Header h = { strdup(name), strdup(value) };
+	if (!h.key || !h.value) {
+		free(h.key);
+		free(h.value);
+		return -1;
+	}
+	size_t sz = http_hpack_entry_size(&h);
+	if (sz > t->max_size) {
+		http_hpack_evict(t, 0);
+		free(h.key);
+		free(h.value);
+		return 0;
+	}
+
+	http_hpack_evict(t, t->max_size - sz);
+	if (t->count == t->cap) {
+		size_t cap = t->cap ? t->cap * 2 : 16;
+		HTTP_Header *entries = (HTTP_Header *) realloc(t->entries, sizeof(HTTP_Header) * cap);
+		if (!entries) {
+			free(h.key);
+			free(h.value);
+			return -1;
+		}
+		t->entries = entries;
+		t->cap = cap;
+	}
+	memmove(t->entries + 1, t->entries, sizeof(HTTP_Header) * t->count);
+	t->entries[0] = h;
+	t->count++;
+	t->size += sz;
+	return 0;
+}
+
+static int http_hpack_lookup(HTTP_HpackTable *t, size_t index, const char **name, const char **value) {
+	if (index == 0) return -1;
+	if (index <= 61) {
+		*name = http_hpack_static[index - 1].name;
+		*value = http_hpack_static[index - 1].value;
+		return 0;
+	}
+	index -= 62;
+	if (index >= t->count) return -1;
+	*name = t->entries[index].key;
+	*value = t->entries[index].value;
+	return 0;
+}
+
+int http_hpack_decode(HTTP_HpackTable *t, const uint8_t *buf, size_t len, HTTP_Headers *out, size_t max_list) {
+	const uint8_t *p = buf, *end = buf + len;
+	size_t list_size = 0;
+
+	while (p < end) {
+		uint8_t b = *p;
+		size_t index;
+		const char *name, *value;
+
+		if (b & 0x80) {
+			if (http_hpack_int(&p, end, 7, &index) < 0 || http_hpack_lookup(t, index, &name, &value) < 0) return -1;
+			http_headers_add(out, (HTTP_Header) { strdup(name), strdup(value) });
+		} else if ((b & 0xe0) == 0x20) {
+			size_t size;
+			if (http_hpack_int(&p, end, 5, &size) < 0 || size > HTTP_HPACK_TABLE_SIZE) return -1;
+			t->max_size = size;
+			http_hpack_evict(t, size);
+			continue;
+		} else {
+			// Literal: with incremental indexing (01), without (0000) or never indexed (0001).
+			bool indexing = (b & 0xc0) == 0x40;
+			if (http_hpack_int(&p, end, indexing ? 6 : 4, &index) < 0) return -1;
+
+			char *key;
+			if (index == 0) {
+				key = http_hpack_string(&p, end);
+			} else {
+				if (http_hpack_lookup(t, index, &name, &value) < 0) return -1;
+				key = strdup(name);
+			}
+			char *val = key ? http_hpack_string(&p, end) : NULL;
+			if (!val) { free(key); return -1; }
+
+			if (indexing && http_hpack_insert(t, key, val) < 0) {
+				free(key);
+				free(val);
+				return -1;
+			}
+			http_headers_add(out, (HTTP_Header) { key, val });
+		}
+
+		HTTP_Header *h = &out->headers[out->count - 1];
+		list_size += http_hpack_entry_size(h);
+		if (list_size > max_list) return -1;
+	}
+	return 0;
+}
+
+static void http_hpack_put_int(HTTP_StringBuilder *sb, uint8_t first, uint8_t prefix, size_t v) {
+	size_t max = (1u << prefix) - 1;
+	if (v < max) { http_sb_append_char(sb, (char)(first | v)); return; }
+	http_sb_append_char(sb, (char)(first | max));
+	v -= max;
+	while (v >= 0x80) {
+		http_sb_append_char(sb, (char)((v & 0x7f) | 0x80));
+		v >>= 7;
+	}
+	http_sb_append_char(sb, (char) v);
+}
+
+// Stateless encoder: static table hits are indexed, everything else is
+// sent as a plain literal without indexing, so there is no dynamic table
+// to keep in sync with the peer.
+void http_hpack_encode(HTTP_StringBuilder *sb, const char *name, const char *value) {
+	size_t name_index = 0;
+	for (size_t i = 0; i < 61; i++) {
+		if (strcmp(http_hpack_static[i].name, name) != 0) continue;
+		if (strcmp(http_hpack_static[i].value, value) == 0) {
+			http_hpack_put_int(sb, 0x80, 7, i + 1);
+			return;
+		}
+		if (!name_index) name_index = i + 1;
+	}
+
+	http_hpack_put_int(sb, 0x00, 4, name_index);
+	if (!name_index) {
+		size_t nlen = strlen(name);
+		http_hpack_put_int(sb, 0x00, 7, nlen);
+		http_sb_append_strn(sb, name, nlen);
+	}
+	size_t vlen = strlen(value);
+	http_hpack_put_int(sb, 0x00, 7, vlen);
+	http_sb_append_strn(sb, value, vlen);
+}
+
+void http_hpack_table_destroy(HTTP_HpackTable *t) {
+	http_hpack_evict(t, 0);
+	free(t->entries);
+	t->entries = NULL;
+	t->cap = 0;
+}
+
+// HTTP/2
+
+#define HTTP_H2_FRAME_HEADER_SIZE 9
+#define HTTP_H2_PREFACE_LEN (sizeof(HTTP_H2_PREFACE) - 1)
+
+enum {
+	HTTP_H2_DATA = 0x0,
+	HTTP_H2_HEADERS = 0x1,
+	HTTP_H2_PRIORITY = 0x2,
+	HTTP_H2_RST_STREAM = 0x3,
+	HTTP_H2_SETTINGS = 0x4,
+	HTTP_H2_PUSH_PROMISE = 0x5,
+	HTTP_H2_PING = 0x6,
+	HTTP_H2_GOAWAY = 0x7,
+	HTTP_H2_WINDOW_UPDATE = 0x8,
+	HTTP_H2_CONTINUATION = 0x9,
+};
+
+enum {
+	HTTP_H2_FLAG_END_STREAM = 0x1,
+	HTTP_H2_FLAG_ACK = 0x1,
+	HTTP_H2_FLAG_END_HEADERS = 0x4,
+	HTTP_H2_FLAG_PADDED = 0x8,
+	HTTP_H2_FLAG_PRIORITY = 0x20,
+};
+
+enum {
+	HTTP_H2_NO_ERROR = 0x0,
+	HTTP_H2_PROTOCOL_ERROR = 0x1,
+	HTTP_H2_FLOW_CONTROL_ERROR = 0x3,
+	HTTP_H2_FRAME_SIZE_ERROR = 0x6,
+	HTTP_H2_REFUSED_STREAM = 0x7,
+	HTTP_H2_CANCEL = 0x8,
+	HTTP_H2_COMPRESSION_ERROR = 0x9,
+};
+
+static uint32_t http_h2_u32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void http_h2_frame(HTTP_StringBuilder *out, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t len) {
+	uint8_t h[HTTP_H2_FRAME_HEADER_SIZE] = {
+		(uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t) len,
+		type, flags,
+		(uint8_t)((stream >> 24) & 0x7f), (uint8_t)(stream >> 16), (uint8_t)(stream >> 8), (uint8_t) stream,
+	};
+	http_sb_append_strn(out, (const char *) h, sizeof(h));
+	if (len) http_sb_append_strn(out, (const char *) payload, len);
+}
+
+static void http_h2_frame_u32(HTTP_StringBuilder *out, uint8_t type, uint32_t stream, uint32_t v) {
+	uint8_t p[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t) v };
+	http_h2_frame(out, type, 0, stream, p, sizeof(p));
+}
+
+static void http_h2_goaway(HTTP_H2Session *h2, HTTP_StringBuilder *out, uint32_t code) {
+	if (h2->goaway) return;
+	uint32_t last = h2->last_stream_id;
+	uint8_t p[8] = {
+		(uint8_t)(last >> 24), (uint8_t)(last >> 16), (uint8_t)(last >> 8), (uint8_t) last,
+		(uint8_t)(code >> 24), (uint8_t)(code >> 16), (uint8_t)(code >> 8), (uint8_t) code,
+	};
+	http_h2_frame(out, HTTP_H2_GOAWAY, 0, 0, p, sizeof(p));
+	h2->goaway = true;
+}
+
+static HTTP_H2Stream *http_h2_stream_find(HTTP_H2Session *h2, uint32_t id) {
+	for (size_t i = 0; i < h2->streams_count; i++)
+		if (h2->streams[i]->id == id) return h2->streams[i];
+	return NULL;
+}
+
+static void http_h2_stream_destroy(HTTP_H2Stream *st) {
+	http_req_destroy(&st->req);
+	http_resp_destroy(&st->resp);
+	free(st);
+}
+
+static void http_h2_stream_remove(HTTP_H2Session *h2, HTTP_H2Stream *st) {
+	for (size_t i = 0; i < h2->streams_count; i++) {
+		if (h2->streams[i] != st) continue;
+		h2->streams[i] = h2->streams[--h2->streams_count];
+		break;
+	}
+	http_h2_stream_destroy(st);
+}
+
+static HTTP_H2Stream *http_h2_stream_open(HTTP_H2Session *h2, uint32_t id) {
+	if (h2->streams_count == h2->streams_cap) {
+		size_t newcap = h2->streams_cap ? h2->streams_cap * 2 : 16;
+		HTTP_H2Stream **ns = (HTTP_H2Stream **) realloc(h2->streams, sizeof(*ns) * newcap);
+		if (!ns) return NULL;
+		h2->streams = ns;
+		h2->streams_cap = newcap;
+	}
+
+	HTTP_H2Stream *st = (HTTP_H2Stream *) calloc(1, sizeof *st);
+	if (!st) return NULL;
+	st->id = id;
+	st->req = http_req_create();
+	st->send_window = h2->peer_initial_window;
+	h2->streams[h2->streams_count++] = st;
+	if (id > h2->last_stream_id) h2->last_stream_id = id;
+	return st;
+}
+
+void http_h2_session_destroy(HTTP_H2Session *h2) {
+	if (!h2) return;
+	for (size_t i = 0; i < h2->streams_count; i++) http_h2_stream_destroy(h2->streams[i]);
+	free(h2->streams);
+	http_hpack_table_destroy(&h2->decoder);
+	free(h2->block);
+	free(h2);
+}
+
+// HTTP/2 names are lowercase; handlers look headers up the HTTP/1 way.
+static char *http_h2_canonical_name(const char *name) {
+	char *s = strdup(name);
+	bool up = true;
+	for (char *p = s; *p; p++) {
+		if (up && *p >= 'a' && *p <= 'z') *p = (char)(*p - 'a' + 'A');
+		up = *p == '-';
+	}
+	return s;
+}
+
+static bool http_h2_hop_header(const char *name) {
+	static const char *hop[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+	for (size_t i = 0; i < sizeof(hop) / sizeof(hop[0]); i++)
+		if (strcmp(hop[i], name) == 0) return true;
+	return false;
+}
+
+// Turns a decoded header list into the request the handlers expect.
+static int http_h2_build_request(HTTP_H2Stream *st, HTTP_Headers *hh) {
+	HTTP_Request *req = &st->req;
+	for (size_t i = 0; i < hh->count; i++) {
+		HTTP_Header *h = &hh->headers[i];
+		if (h->key[0] == ':') {
+			char **slot = NULL;
+			if (strcmp(h->key, ":method") == 0) slot = &req->method;
+			else if (strcmp(h->key, ":path") == 0) slot = &req->target;
+			else if (strcmp(h->key, ":authority") == 0) {
+				http_req_add_header(req, "Host", h->value);
+				continue;
+			} else if (strcmp(h->key, ":scheme") == 0) continue;
+			else return -1;
+			if (*slot) return -1;
+			*slot = strdup(h->value);
+		} else {
+			http_headers_add(&req->headers, (HTTP_Header) { http_h2_canonical_name(h->key), strdup(h->value) });
+		}
+	}
+	if (!req->method || !req->target) return -1;
+	req->protocol = strdup(HTTP_H2_PROTOCOL);
+	return http_req_split_target(req);
+}
+
+static void http_h2_send_headers(HTTP_H2Session *h2, HTTP_StringBuilder *out, HTTP_H2Stream *st) {
+	HTTP_StringBuilder block = http_sb_create(256);
+	char status[8];
+	status[http_fmt_uint(status, st->resp.status_code)] = '\0';
+	http_hpack_encode(&block, ":status", status);
+
+	char name[256];
+	for (size_t i = 0; i < st->resp.headers.count; i++) {
+		HTTP_Header *h = &st->resp.headers.headers[i];
+		size_t len = strlen(h->key);
+		if (len >= sizeof(name)) continue;
+		for (size_t j = 0; j <= len; j++)
+			name[j] = (h->key[j] >= 'A' && h->key[j] <= 'Z') ? (char)(h->key[j] - 'A' + 'a') : h->key[j];
+		if (http_h2_hop_header(name)) continue;
+		http_hpack_encode(&block, name, h->value);
+	}
+
+	bool end_stream = st->resp.body_len == 0;
+	size_t off = 0;
+	do {
+		size_t n = block.cnt - off;
+		if (n > h2->peer_max_frame) n = h2->peer_max_frame;
+		uint8_t type = off == 0 ? HTTP_H2_HEADERS : HTTP_H2_CONTINUATION;
+		uint8_t flags = off + n == block.cnt ? HTTP_H2_FLAG_END_HEADERS : 0;
+		if (off == 0 && end_stream) flags |= HTTP_H2_FLAG_END_STREAM;
+		http_h2_frame(out, type, flags, st->id, block.str + off, n);
+		off += n;
+	} while (off < block.cnt);
+
+	http_sb_destroy(&block);
+}
+
+static const HTTP_WsRoute *http_ws_route(HTTP_Server *serv, const char *path);
+static HTTP_SseHub *http_sse_hub(HTTP_Server *serv, const char *path);
+static const HTTP_StreamRoute *http_stream_route(HTTP_Server *serv, const char *path);
+static HTTP_ProxyRoute *http_proxy_route(HTTP_Server *serv, const char *path);
+
+// Streams are answered by the handler routes only; cached routes run
+// their handler without the cache. WebSocket, SSE, streamed and proxied
+// routes take over an HTTP/1.1 connection, so they get 501 here instead
+// of falling through to another route.
+static void http_h2_respond(HTTP_Server *serv, HTTP_H2Session *h2, HTTP_StringBuilder *out, HTTP_H2Stream *st) {
+	st->resp = http_resp_create();
+	const char *path = st->req.path ? st->req.path : st->req.target;
+	if (http_ws_route(serv, path) || http_sse_hub(serv, path) || http_stream_route(serv, path) || http_proxy_route(serv, path)) {
+		http_resp_set_status_line(&st->resp, STATUS_NOT_IMPLEMENTED, "Not Implemented");
+		char *msg = strdup("501 Not Implemented");
+		http_resp_set_body(&st->resp, (uint8_t *) msg, strlen(msg));
+	} else {
+		http_server_dispatch(serv, 0, &st->req, &st->resp);
+	}
+
+	// HEAD keeps the headers, Content-Length included, and ends the
+	// stream on HEADERS.
+	if (strcmp(st->req.method, METHOD_HEAD) == 0) {
+		free(st->resp.body);
+		st->resp.body = NULL;
+		st->resp.body_len = 0;
+	}
+	http_h2_send_headers(h2, out, st);
+	st->responding = true;
+	if (st->resp.body_len == 0) http_h2_stream_remove(h2, st);
+}
+
+// Frames pending response bodies one DATA frame per stream per round, as
+// far as the flow-control windows and the output high-water mark allow.
+static void http_h2_pump(HTTP_H2Session *h2, HTTP_StringBuilder *out) {
+	bool progress = true;
+	while (progress && h2->send_window > 0 && out->cnt < HTTP_H2_OUT_HIGH_WATER) {
+		progress = false;
+		for (size_t i = 0; i < h2->streams_count;) {
+			HTTP_H2Stream *st = h2->streams[i];
+			size_t left = st->resp.body_len - st->resp_off;
+			if (!st->responding || st->send_window <= 0 || h2->send_window <= 0) { i++; continue; }
+
+			size_t n = left;
+			if (n > h2->peer_max_frame) n = h2->peer_max_frame;
+			if ((int64_t) n > st->send_window) n = (size_t) st->send_window;
+			if ((int64_t) n > h2->send_window) n = (size_t) h2->send_window;
+
+			bool last = n == left;
+			http_h2_frame(out, HTTP_H2_DATA, last ? HTTP_H2_FLAG_END_STREAM : 0, st->id, st->resp.body + st->resp_off, n);
+			st->resp_off += n;
+			st->send_window -= (int64_t) n;
+			h2->send_window -= (int64_t) n;
+			progress = true;
+
+			if (last) http_h2_stream_remove(h2, st);
+			else i++;
+		}
+	}
+}
+
+static int http_h2_apply_settings(HTTP_H2Session *h2, const uint8_t *p, size_t len) {
+	if (len % 6) return HTTP_H2_FRAME_SIZE_ERROR;
+	for (size_t i = 0; i < len; i += 6) {
+		uint16_t id = (uint16_t)((p[i] << 8) | p[i + 1]);
+		uint32_t v = http_h2_u32(p + i + 2);
+		switch (id) {
+			case 0x4: // SETTINGS_INITIAL_WINDOW_SIZE
+				if (v > 0x7fffffff) return HTTP_H2_FLOW_CONTROL_ERROR;
+				for (size_t s = 0; s < h2->streams_count; s++)
+					h2->streams[s]->send_window += (int64_t) v - h2->peer_initial_window;
+				h2->peer_initial_window = v;
+				break;
+			case 0x5: // SETTINGS_MAX_FRAME_SIZE
+				if (v < 16384 || v > 16777215) return HTTP_H2_PROTOCOL_ERROR;
+				h2->peer_max_frame = v;
+				break;
+			default:
+				break;
+		}
+	}
+	return HTTP_H2_NO_ERROR;
+}
+
+static int http_h2_end_headers(HTTP_Server *serv, HTTP_H2Session *h2, HTTP_StringBuilder *out) {
+	HTTP_Headers hh = http_headers_create(0);
+	int rc = http_hpack_decode(&h2->decoder, h2->block, h2->block_len, &hh, serv->limits.max_header_bytes);
+	uint32_t id = h2->block_stream;
+	h2->block_stream = 0;
+	h2->block_len = 0;
+	if (rc < 0) {
+		http_headers_destroy(&hh);
+		return HTTP_H2_COMPRESSION_ERROR;
+	}
+
+	// Trailers on a stream we already know are accepted and dropped.
+	HTTP_H2Stream *st = http_h2_stream_find(h2, id);
+	if (st) {
+		http_headers_destroy(&hh);
+		if (h2->block_end_stream && !st->responding) http_h2_respond(serv, h2, out, st);
+		return HTTP_H2_NO_ERROR;
+	}
+
+	if (h2->streams_count >= HTTP_H2_MAX_CONCURRENT_STREAMS) {
+		http_headers_destroy(&hh);
+		http_h2_frame_u32(out, HTTP_H2_RST_STREAM, id, HTTP_H2_REFUSED_STREAM);
+		if (id > h2->last_stream_id) h2->last_stream_id = id;
+		return HTTP_H2_NO_ERROR;
+	}
+
+	st = http_h2_stream_open(h2, id);
+	if (!st) {
+		http_headers_destroy(&hh);
+		return HTTP_H2_PROTOCOL_ERROR;
+	}
+	rc = http_h2_build_request(st, &hh);
+	http_headers_destroy(&hh);
+	if (rc < 0) {
+		http_h2_frame_u32(out, HTTP_H2_RST_STREAM, id, HTTP_H2_PROTOCOL_ERROR);
+		http_h2_stream_remove(h2, st);
+		return HTTP_H2_NO_ERROR;
+	}
+
+	if (h2->block_end_stream) http_h2_respond(serv, h2, out, st);
+	return HTTP_H2_NO_ERROR;
+}
+
+static int http_h2_append_block(HTTP_H2Session *h2, const uint8_t *p, size_t len, size_t max) {
+	if (h2->block_len + len > max) return -1;
+	if (h2->block_len + len > h2->block_cap) {
+		size_t cap = h2->block_cap ? h2->block_cap : 1024;
+		while (cap < h2->block_len + len) cap *= 2;
+		uint8_t *nb = (uint8_t *) realloc(h2->block, cap);
+		if (!nb) return -1;
+		h2->block = nb;
+		h2->block_cap = cap;
+	}
+	memcpy(h2->block + h2->block_len, p, len);
+	h2->block_len += len;
+	return 0;
+}
+
+// Strips padding (and the priority block of HEADERS) from a payload.
+static int http_h2_unpad(uint8_t flags, bool priority, const uint8_t **p, size_t *len) {
+	size_t pad = 0;
+	if (flags & HTTP_H2_FLAG_PADDED) {
+		if (*len < 1) return -1;
+		pad = (*p)[0];
+		(*p)++;
+		(*len)--;
+	}
+	if (priority && (flags & HTTP_H2_FLAG_PRIORITY)) {
+		if (*len < 5) return -1;
+		*p += 5;
+		*len -= 5;
+	}
+	if (pad > *len) return -1;
+	*len -= pad;
+	return 0;
+}
+
+static int http_h2_frame_in(HTTP_Server *serv, HTTP_H2Session *h2, HTTP_StringBuilder *out,
+		uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+	if (h2->block_stream && (type != HTTP_H2_CONTINUATION || id != h2->block_stream))
+		return HTTP_H2_PROTOCOL_ERROR;
+
+	switch (type) {
+		case HTTP_H2_DATA: {
+			size_t flow = len;
+			if (id == 0 || http_h2_unpad(flags, false, &p, &len) < 0) return HTTP_H2_PROTOCOL_ERROR;
+
+			// Receive windows are replenished straight away: bodies are
+			// bounded by max_body_bytes instead. The stream's own window
+			// only matters while more DATA can still come on it.
+			HTTP_H2Stream *st = http_h2_stream_find(h2, id);
+			bool open = st && !st->responding;
+			if (flow > 0) {
+				http_h2_frame_u32(out, HTTP_H2_WINDOW_UPDATE, 0, (uint32_t) flow);
+				if (open && !(flags & HTTP_H2_FLAG_END_STREAM))
+					http_h2_frame_u32(out, HTTP_H2_WINDOW_UPDATE, id, (uint32_t) flow);
+			}
+			if (!open) return HTTP_H2_NO_ERROR;
+
+			if (st->req.body_len + len > serv->limits.max_body_bytes) {
+				http_h2_frame_u32(out, HTTP_H2_RST_STREAM, id, HTTP_H2_CANCEL);
+				http_h2_stream_remove(h2, st);
+				return HTTP_H2_NO_ERROR;
+			}
+			if (len > 0) {
+				uint8_t *nb = (uint8_t *) realloc(st->req.body, st->req.body_len + len);
+				if (!nb) return HTTP_H2_PROTOCOL_ERROR;
+				memcpy(nb + st->req.body_len, p, len);
+				st->req.body = nb;
+				st->req.body_len += len;
+			}
+			if (flags & HTTP_H2_FLAG_END_STREAM) http_h2_respond(serv, h2, out, st);
+			return HTTP_H2_NO_ERROR;
+		}
+
+		case HTTP_H2_HEADERS:
+			if (id == 0 || http_h2_unpad(flags, true, &p, &len) < 0) return HTTP_H2_PROTOCOL_ERROR;
+			if (!http_h2_stream_find(h2, id) && (!(id & 1) || id <= h2->last_stream_id)) return HTTP_H2_PROTOCOL_ERROR;
+			h2->block_stream = id;
+			h2->block_end_stream = (flags & HTTP_H2_FLAG_END_STREAM) != 0;
+			if (http_h2_append_block(h2, p, len, serv->limits.max_header_bytes) < 0) return HTTP_H2_PROTOCOL_ERROR;
+			if (flags & HTTP_H2_FLAG_END_HEADERS) return http_h2_end_headers(serv, h2, out);
+			return HTTP_H2_NO_ERROR;
+
+		case HTTP_H2_CONTINUATION:
+			if (!h2->block_stream) return HTTP_H2_PROTOCOL_ERROR;
+			if (http_h2_append_block(h2, p, len, serv->limits.max_header_bytes) < 0) return HTTP_H2_PROTOCOL_ERROR;
+			if (flags & HTTP_H2_FLAG_END_HEADERS) return http_h2_end_headers(serv, h2, out);
+			return HTTP_H2_NO_ERROR;
+
+		case HTTP_H2_RST_STREAM: {
+			if (id == 0 || len != 4) return HTTP_H2_PROTOCOL_ERROR;
+			HTTP_H2Stream *st = http_h2_stream_find(h2, id);
+			if (st) http_h2_stream_remove(h2, st);
+			return HTTP_H2_NO_ERROR;
+		}
+
+		case HTTP_H2_SETTINGS: {
+			if (id != 0) return HTTP_H2_PROTOCOL_ERROR;
+			if (flags & HTTP_H2_FLAG_ACK) return len ? HTTP_H2_FRAME_SIZE_ERROR : HTTP_H2_NO_ERROR;
+			int rc = http_h2_apply_settings(h2, p, len);
+			if (rc) return rc;
+			http_h2_frame(out, HTTP_H2_SETTINGS, HTTP_H2_FLAG_ACK, 0, NULL, 0);
+			return HTTP_H2_NO_ERROR;
+		}
+
+		case HTTP_H2_PING:
+			if (id != 0 || len != 8) return HTTP_H2_PROTOCOL_ERROR;
+			if (!(flags & HTTP_H2_FLAG_ACK)) http_h2_frame(out, HTTP_H2_PING, HTTP_H2_FLAG_ACK, 0, p, len);
+			return HTTP_H2_NO_ERROR;
+
+		case HTTP_H2_GOAWAY: // streams in flight are still answered
+			return HTTP_H2_NO_ERROR;
+
+		case HTTP_H2_WINDOW_UPDATE: {
+			if (len != 4) return HTTP_H2_FRAME_SIZE_ERROR;
+			uint32_t inc = http_h2_u32(p) & 0x7fffffff;
+			if (inc == 0) return HTTP_H2_PROTOCOL_ERROR;
+			if (id == 0) {
+				h2->send_window += inc;
+				if (h2->send_window > 0x7fffffff) return HTTP_H2_FLOW_CONTROL_ERROR;
+			} else {
+				HTTP_H2Stream *st = http_h2_stream_find(h2, id);
+				if (st) st->send_window += inc;
+			}
+			return HTTP_H2_NO_ERROR;
+		}
+
+		case HTTP_H2_PUSH_PROMISE:
+			return HTTP_H2_PROTOCOL_ERROR;
+
+		default: // PRIORITY and unknown frame types are ignored
+			return HTTP_H2_NO_ERROR;
+	}
+}
+
+static void http_h2_write(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	HTTP_H2Session *h2 = conn->h2;
+	for (;;) {
+		int r = http_conn_flush_out(conn);
+		if (r < 0) { http_conn_close(conn); return; }
+		if (r == 0) {
+			http_conn_set_timeout(serv, conn, now, serv->limits.write_timeout_ms);
+			return;
+		}
+
+		if (!h2->goaway) http_h2_pump(h2, &conn->out);
+		if (conn->out.cnt == 0) break;
+	}
+
+	if (h2->goaway) { http_conn_close(conn); return; }
+	http_conn_set_timeout(serv, conn, now, serv->limits.idle_timeout_ms);
+}
+
+static void http_h2_process(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	HTTP_H2Session *h2 = conn->h2;
+	size_t off = 0;
+
+	if (!h2->preface_done) {
+		size_t n = conn->in_len < HTTP_H2_PREFACE_LEN ? conn->in_len : HTTP_H2_PREFACE_LEN;
+		if (memcmp(conn->in, HTTP_H2_PREFACE, n) != 0) { http_conn_close(conn); return; }
+		if (n < HTTP_H2_PREFACE_LEN) { http_h2_write(serv, conn, now); return; }
+		h2->preface_done = true;
+		off = HTTP_H2_PREFACE_LEN;
+	}
+
+	// Control frames and responses are written for frames as they come
+	// in, so a peer that never reads is stopped at the high-water mark.
+	h2->in_paused = false;
+	while (!h2->goaway && conn->in_len - off >= HTTP_H2_FRAME_HEADER_SIZE) {
+		if (conn->out.cnt - conn->out_off >= HTTP_H2_OUT_HIGH_WATER) {
+			h2->in_paused = true;
+			break;
+		}
+		const uint8_t *f = conn->in + off;
+		size_t len = ((size_t) f[0] << 16) | ((size_t) f[1] << 8) | f[2];
+		if (len > HTTP_H2_MAX_FRAME_SIZE) {
+			http_h2_goaway(h2, &conn->out, HTTP_H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (conn->in_len - off < HTTP_H2_FRAME_HEADER_SIZE + len) break;
+
+		uint32_t id = http_h2_u32(f + 5) & 0x7fffffff;
+		int rc = http_h2_frame_in(serv, h2, &conn->out, f[3], f[4], id, f + HTTP_H2_FRAME_HEADER_SIZE, len);
+		off += HTTP_H2_FRAME_HEADER_SIZE + len;
+		if (rc != HTTP_H2_NO_ERROR) http_h2_goaway(h2, &conn->out, (uint32_t) rc);
+	}
+
+	memmove(conn->in, conn->in + off, conn->in_len - off);
+	conn->in_len -= off;
+	conn->in[conn->in_len] = '\0';
+
+	http_h2_write(serv, conn, now);
+}
+
+static void http_h2_start(HTTP_Server *serv, HTTP_Conn *conn) {
+	HTTP_H2Session *h2 = (HTTP_H2Session *) calloc(1, sizeof *h2);
+	if (!h2) { http_conn_close(conn); return; }
+	h2->decoder.max_size = HTTP_HPACK_TABLE_SIZE;
+	h2->send_window = 65535;
+	h2->peer_initial_window = 65535;
+	h2->peer_max_frame = 16384;
+
+	conn->h2 = h2;
+	conn->state = HTTP_CONN_H2;
+	conn->head_len = conn->req_len = 0;
+
+	uint32_t streams = HTTP_H2_MAX_CONCURRENT_STREAMS, list = (uint32_t) serv->limits.max_header_bytes;
+	uint8_t settings[] = {
+		0x00, 0x03, (uint8_t)(streams >> 24), (uint8_t)(streams >> 16), (uint8_t)(streams >> 8), (uint8_t) streams,
+		0x00, 0x06, (uint8_t)(list >> 24), (uint8_t)(list >> 16), (uint8_t)(list >> 8), (uint8_t) list,
+	};
+	http_h2_frame(&conn->out, HTTP_H2_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+static int http_base64url_decode(const char *s, uint8_t *out, size_t cap) {
+	uint32_t acc = 0;
+	int bits = 0;
+	size_t n = 0;
+	for (; *s && *s != '='; s++) {
+		int v;
+		if (*s >= 'A' && *s <= 'Z') v = *s - 'A';
+		else if (*s >= 'a' && *s <= 'z') v = *s - 'a' + 26;
+		else if (*s >= '0' && *s <= '9') v = *s - '0' + 52;
+		else if (*s == '-' || *s == '+') v = 62;
+		else if (*s == '_' || *s == '/') v = 63;
+		else return -1;
+		acc = (acc << 6) | (uint32_t) v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == cap) return -1;
+			out[n++] = (uint8_t)(acc >> bits);
+		}
+	}
+	return (int) n;
+}
+
+// HTTP/1.1 Upgrade: h2c. The request that asked for it becomes stream 1
+// and is answered over HTTP/2 right after the 101.
+static void http_h2_upgrade(HTTP_Server *serv, HTTP_Conn *conn, HTTP_Request *req, uint64_t now) {
+	uint8_t settings[256];
+	int slen = http_base64url_decode(http_headers_get(&req->headers, "HTTP2-Settings"), settings, sizeof(settings));
+
+	static const char switching[] =
+		"HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	http_sb_append_strn(&conn->out, switching, sizeof(switching) - 1);
+
+	size_t rest = conn->in_len - conn->req_len;
+	memmove(conn->in, conn->in + conn->req_len, rest);
+	conn->in_len = rest;
+	conn->in[conn->in_len] = '\0';
+
+	http_h2_start(serv, conn);
+	HTTP_H2Session *h2 = conn->h2;
+	if (!h2) { http_req_destroy(req); return; }
+	if (slen < 0 || http_h2_apply_settings(h2, settings, (size_t) slen) != HTTP_H2_NO_ERROR) {
+		http_req_destroy(req);
+		http_h2_goaway(h2, &conn->out, HTTP_H2_PROTOCOL_ERROR);
+		http_h2_write(serv, conn, now);
+		return;
+	}
+
+	HTTP_H2Stream *st = http_h2_stream_open(h2, 1);
+	if (!st) { http_req_destroy(req); http_conn_close(conn); return; }
+	http_req_destroy(&st->req);
+	st->req = *req;
+	http_h2_respond(serv, h2, &conn->out, st);
+
+	http_h2_process(serv, conn, now);
+}
+
+// WebSocket
+
+static void http_sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint8_t block[64];
+	uint64_t bits = (uint64_t) len * 8;
+
+	for (size_t off = 0; off <= len + 8; off += 64) {
+		for (size_t i = 0; i < 64; i++) {
+			size_t pos = off + i;
+			if (pos < len) block[i] = data[pos];
+			else if (pos == len) block[i] = 0x80;
+			else block[i] = 0;
+		}
+		// The length goes into the last 8 bytes of the final block.
+		if (off + 64 >= len + 9) {
+			for (int i = 0; i < 8; i++) block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+		}
+
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++) w[i] = http_h2_u32(block + 4 * i);
+		for (int i = 16; i < 80; i++) {
+			uint32_t v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+			w[i] = (v << 1) | (v >> 31);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+			else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+			else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+			else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+			uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+			e = d; d = c; c = (b << 30) | (b >> 2); b = a; a = t;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+
+	for (int i = 0; i < 5; i++) {
+		out[4 * i] = (uint8_t)(h[i] >> 24);
+		out[4 * i + 1] = (uint8_t)(h[i] >> 16);
+		out[4 * i + 2] = (uint8_t)(h[i] >> 8);
+		out[4 * i + 3] = (uint8_t) h[i];
+	}
+}
+
+static void http_base64_encode(HTTP_StringBuilder *sb, const uint8_t *data, size_t len) {
+	static const char abc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	for (size_t i = 0; i < len; i += 3) {
+		uint32_t v = (uint32_t) data[i] << 16;
+		if (i + 1 < len) v |= (uint32_t) data[i + 1] << 8;
+		if (i + 2 < len) v |= data[i + 2];
+		http_sb_append_char(sb, abc[(v >> 18) & 63]);
+		http_sb_append_char(sb, abc[(v >> 12) & 63]);
+		http_sb_append_char(sb, i + 1 < len ? abc[(v >> 6) & 63] : '=');
+		http_sb_append_char(sb, i + 2 < len ? abc[v & 63] : '=');
+	}
+}
+
+// XORs the key over 16 (or 8) bytes at a time; the masking key repeats
+// every 4 bytes, so a widened copy of it lines up with every chunk.
+void http_ws_mask(uint8_t *data, size_t len, const uint8_t key[4]) {
+	uint32_t k32;
+	memcpy(&k32, key, 4);
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i k128 = _mm_set1_epi32((int) k32);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		_mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k128));
+	}
+#endif
+	uint64_t k64 = ((uint64_t) k32 << 32) | k32;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, data + i, 8);
+		v ^= k64;
+		memcpy(data + i, &v, 8);
+	}
+	for (; i < len; i++) data[i] ^= key[i & 3];
+}
+
+// Server frames are never masked, so the header is all there is to add.
+static size_t http_ws_frame_header(uint8_t h[10], uint8_t opcode, size_t len) {
+	h[0] = (uint8_t)(0x80 | opcode);
+	if (len < 126) {
+		h[1] = (uint8_t) len;
+		return 2;
+	}
+	if (len <= 0xffff) {
+		h[1] = 126;
+		h[2] = (uint8_t)(len >> 8);
+		h[3] = (uint8_t) len;
+		return 4;
+	}
+	h[1] = 127;
+	for (int i = 0; i < 8; i++) h[2 + i] = (uint8_t)((uint64_t) len >> (56 - 8 * i));
+	return 10;
+}
+
+// Sends what it can right away and queues the rest. A peer that lets
+// more than HTTP_WS_MAX_BUFFERED pile up is dropped.
+static int http_ws_write_raw(HTTP_WebSocket *ws, const uint8_t *frame, size_t len) {
+	if (ws->state != HTTP_CONN_WS || ws->ws_closing) return -1;
+
+	size_t sent = 0;
+	if (ws->out_off == ws->out.cnt) {
+		while (sent < len) {
+			ssize_t n = send(ws->fd, frame + sent, len - sent, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+				http_conn_close(ws);
+				return -1;
+			}
+			sent += (size_t) n;
+		}
+	}
+	if (sent == len) return 0;
+
+	if (ws->out.cnt - ws->out_off + (len - sent) > HTTP_WS_MAX_BUFFERED) {
+		http_conn_close(ws);
+		return -1;
+	}
+	http_sb_append_strn(&ws->out, (const char *) frame + sent, len - sent);
+	return 0;
+}
+
+static int http_ws_queue(HTTP_WebSocket *ws, uint8_t opcode, const void *data, size_t len) {
+	uint8_t h[10];
+	size_t hlen = http_ws_frame_header(h, opcode, len);
+	if (len < 128) {
+		uint8_t frame[10 + 128];
+		memcpy(frame, h, hlen);
+		if (len) memcpy(frame + hlen, data, len);
+		return http_ws_write_raw(ws, frame, hlen + len);
+	}
+
+	uint8_t *frame = (uint8_t *) malloc(hlen + len);
+	if (!frame) return -1;
+	memcpy(frame, h, hlen);
+	memcpy(frame + hlen, data, len);
+	int rc = http_ws_write_raw(ws, frame, hlen + len);
+	free(frame);
+	return rc;
+}
+
+int http_ws_send(HTTP_WebSocket *ws, uint8_t opcode, const void *data, size_t len) {
+	return http_ws_queue(ws, opcode, data, len);
+}
+
+// Queues a close frame; the connection is closed once it is written.
+void http_ws_close(HTTP_WebSocket *ws, uint16_t code) {
+	uint8_t payload[2] = { (uint8_t)(code >> 8), (uint8_t) code };
+	if (http_ws_queue(ws, HTTP_WS_OP_CLOSE, payload, sizeof(payload)) == 0) ws->ws_closing = true;
+}
+
+size_t http_ws_broadcast(HTTP_Server *serv, const char *target, uint8_t opcode, const void *data, size_t len) {
+	uint8_t h[10];
+	size_t hlen = http_ws_frame_header(h, opcode, len);
+	uint8_t *frame = (uint8_t *) malloc(hlen + len);
+	if (!frame) return 0;
+	memcpy(frame, h, hlen);
+	if (len) memcpy(frame + hlen, data, len);
+
+	size_t sent = 0;
+	for (size_t i = 0; i < serv->conns_count; i++) {
+		HTTP_Conn *conn = serv->conns[i];
+		if (conn->state != HTTP_CONN_WS || conn->ws_closing) continue;
+		if (target && strcmp(conn->ws->target, target) != 0) continue;
+		if (http_ws_write_raw(conn, frame, hlen + len) == 0) sent++;
+	}
+
+	free(frame);
+	return sent;
+}
+
+static void http_ws_write(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	int r = http_conn_flush_out(conn);
+	if (r < 0 || (r == 1 && conn->ws_closing)) { http_conn_close(conn); return; }
+	// Quiet subscribers are fine; only a stalled write is timed out.
+	http_conn_set_timeout(serv, conn, now, r == 0 ? serv->limits.write_timeout_ms : 0);
+}
+
+static void http_ws_fail(HTTP_Conn *conn, uint16_t code) {
+	http_ws_close(conn, code);
+	if (!conn->ws_closing) http_conn_close(conn);
+}
+
+static void http_ws_message(HTTP_Conn *conn, uint8_t opcode, const uint8_t *data, size_t len) {
+	if (conn->ws->on_message) conn->ws->on_message(conn->ws->ctx, conn, opcode, data, len);
+}
+
+// Parses frames in place: payloads are unmasked inside conn->in and
+// passed on without copying unless a message is fragmented.
+static void http_ws_process(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	size_t off = 0;
+	while (conn->state == HTTP_CONN_WS && !conn->ws_closing) {
+		uint8_t *f = conn->in + off;
+		size_t avail = conn->in_len - off;
+		if (avail < 2) break;
+
+		bool fin = (f[0] & 0x80) != 0;
+		uint8_t opcode = f[0] & 0x0f;
+		uint64_t plen = f[1] & 0x7f;
+		size_t hlen = 2;
+		if (plen == 126) {
+			if (avail < 4) break;
+			plen = ((uint64_t) f[2] << 8) | f[3];
+			hlen = 4;
+		} else if (plen == 127) {
+			if (avail < 10) break;
+			plen = 0;
+			for (int i = 0; i < 8; i++) plen = (plen << 8) | f[2 + i];
+			hlen = 10;
+		}
+
+		if ((f[0] & 0x70) || !(f[1] & 0x80) || ((opcode & 0x8) && (!fin || plen > 125))) {
+			http_ws_fail(conn, 1002);
+			break;
+		}
+		if (plen > serv->limits.max_body_bytes) {
+			http_ws_fail(conn, 1009);
+			break;
+		}
+		hlen += 4;
+		if (avail < hlen + plen) break;
+
+		uint8_t *payload = f + hlen;
+		size_t len = (size_t) plen;
+		http_ws_mask(payload, len, f + hlen - 4);
+		off += hlen + len;
+
+		switch (opcode) {
+			case HTTP_WS_OP_TEXT:
+			case HTTP_WS_OP_BINARY:
+				if (conn->ws_msg_opcode) { http_ws_fail(conn, 1002); break; }
+				if (fin) { http_ws_message(conn, opcode, payload, len); break; }
+				conn->ws_msg_opcode = opcode;
+				if (!conn->ws_msg.str) conn->ws_msg = http_sb_create(len + 1);
+				http_sb_append_strn(&conn->ws_msg, (const char *) payload, len);
+				break;
+
+			case HTTP_WS_OP_CONT:
+				if (!conn->ws_msg_opcode) { http_ws_fail(conn, 1002); break; }
+				if (conn->ws_msg.cnt + len > serv->limits.max_body_bytes) { http_ws_fail(conn, 1009); break; }
+				http_sb_append_strn(&conn->ws_msg, (const char *) payload, len);
+				if (fin) {
+					http_ws_message(conn, conn->ws_msg_opcode, (const uint8_t *) conn->ws_msg.str, conn->ws_msg.cnt);
+					http_sb_reset(&conn->ws_msg);
+					conn->ws_msg_opcode = 0;
+				}
+				break;
+
+			case HTTP_WS_OP_CLOSE: {
+				uint16_t code = len >= 2 ? (uint16_t)((payload[0] << 8) | payload[1]) : 1000;
+				http_ws_close(conn, code);
+				if (!conn->ws_closing) http_conn_close(conn);
+				break;
+			}
+
+			case HTTP_WS_OP_PING:
+				http_ws_queue(conn, HTTP_WS_OP_PONG, payload, len);
+				break;
+
+			case HTTP_WS_OP_PONG:
+				break;
+
+			default:
+				http_ws_fail(conn, 1002);
+				break;
+		}
+	}
+
+	if (conn->state == HTTP_CONN_CLOSED) return;
+	// Once our close frame is queued, anything more the peer sends is
+	// dropped, so a full buffer never leaves POLLIN armed with nothing
+	// to take it.
+	if (conn->ws_closing) off = conn->in_len;
+	memmove(conn->in, conn->in + off, conn->in_len - off);
+	conn->in_len -= off;
+	conn->in[conn->in_len] = '\0';
+	http_ws_write(serv, conn, now);
+}
+
+static const HTTP_WsRoute *http_ws_route(HTTP_Server *serv, const char *path) {
+	for (size_t i = 0; i < serv->ws_routes_count; i++)
+		if (http_route_match(serv->ws_routes[i].target, path)) return &serv->ws_routes[i];
+	return NULL;
+}
+
+// Answers the opening handshake with 101 and hands the connection over
+// to the route. Returns false if the request is not a usable upgrade.
+static bool http_ws_upgrade(HTTP_Server *serv, HTTP_Conn *conn, HTTP_Request *req, const HTTP_WsRoute *route, uint64_t now) {
+	static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	char *key = http_headers_get(&req->headers, "Sec-WebSocket-Key");
+	char *version = http_headers_get(&req->headers, "Sec-WebSocket-Version");
+	if (strcmp(req->method, METHOD_GET) != 0 || !key || !version || strcmp(version, "13") != 0) return false;
+
+	HTTP_StringBuilder accept = http_sb_create(64);
+	http_sb_append_str(&accept, key);
+	http_sb_append_str(&accept, guid);
+	uint8_t digest[20];
+	http_sha1((const uint8_t *) accept.str, accept.cnt, digest);
+	http_sb_reset(&accept);
+	http_base64_encode(&accept, digest, sizeof(digest));
+
+	http_sb_append_str(&conn->out, "HTTP/1.1 101 Switching Protocols\r\n");
+	http_sb_append_header(&conn->out, "Upgrade", "websocket");
+	http_sb_append_header(&conn->out, "Connection", "Upgrade");
+	http_sb_append_header(&conn->out, "Sec-WebSocket-Accept", accept.str);
+	http_sb_append_str(&conn->out, "\r\n");
+	http_sb_destroy(&accept);
+
+	size_t rest = conn->in_len - conn->req_len;
+	memmove(conn->in, conn->in + conn->req_len, rest);
+	conn->in_len = rest;
+	conn->in[conn->in_len] = '\0';
+	conn->head_len = conn->req_len = 0;
+
+	conn->ws = route;
+	conn->state = HTTP_CONN_WS;
+	if (route->on_open) route->on_open(route->ctx, conn, req);
+	http_ws_process(serv, conn, now);
+	return true;
+}
+
+// Rate limiting
+
+#define HTTP_RATE_LIMIT_PROBES 16
+
+typedef struct {
+	uint64_t key; // 0: empty
+	// last refill (ms since epoch, high 32 bits) | millitokens; 0 only
+	// while the slot is empty. The epoch is set a millisecond back so no
+	// claimed state is 0.
+	uint64_t state;
+} HTTP_RateSlot;
+
+struct HTTP_RateLimiter {
+	uint32_t rate;
+	uint32_t burst;
+	uint32_t idle_ms; // an idle bucket is full again after this long
+	uint64_t epoch;
+	size_t shard_mask; // slots per shard - 1
+	uint64_t limited;
+	uint64_t untracked;
+	HTTP_RateSlot *shards[HTTP_RATE_LIMIT_SHARDS];
+};
+
+HTTP_RateLimiter *http_rate_limiter_create(uint32_t rate_per_sec, uint32_t burst, size_t capacity) {
+	HTTP_RateLimiter *rl = (HTTP_RateLimiter *) calloc(1, sizeof *rl);
+	if (!rl) return NULL;
+	size_t per_shard = 64;
+	while (per_shard * HTTP_RATE_LIMIT_SHARDS < capacity) per_shard *= 2;
+	rl->rate = rate_per_sec ? rate_per_sec : 1;
+	rl->burst = burst ? burst : 1;
+	rl->idle_ms = (uint32_t)((uint64_t) rl->burst * 1000 / rl->rate) + 1000;
+	rl->epoch = http_now_ms() - 1;
+	rl->shard_mask = per_shard - 1;
+	for (size_t i = 0; i < HTTP_RATE_LIMIT_SHARDS; i++) {
+		rl->shards[i] = (HTTP_RateSlot *) calloc(per_shard, sizeof(HTTP_RateSlot));
+		if (!rl->shards[i]) { http_rate_limiter_destroy(rl); return NULL; }
+	}
+	return rl;
+}
+
+void http_rate_limiter_destroy(HTTP_RateLimiter *rl) {
+	if (!rl) return;
+	for (size_t i = 0; i < HTTP_RATE_LIMIT_SHARDS; i++) free(rl->shards[i]);
+	free(rl);
+}
+
+uint64_t http_rate_limiter_limited(HTTP_RateLimiter *rl) {
+	return __atomic_load_n(&rl->limited, __ATOMIC_RELAXED);
+}
+
+// IPv4 peers are keyed by address, IPv6 peers by their /64, which is
+// what one client usually gets. Unix sockets are not limited.
+static uint64_t http_rate_key(const HTTP_Addr *peer) {
+	if (peer->sa.sa_family == AF_INET)
+		return 0x0000ffff00000000ULL | ntohl(peer->in.sin_addr.s_addr);
+	if (peer->sa.sa_family != AF_INET6) return 0;
+
+	const uint8_t *a = peer->in6.sin6_addr.s6_addr;
+	if (IN6_IS_ADDR_V4MAPPED(&peer->in6.sin6_addr))
+		return 0x0000ffff00000000ULL | ((uint64_t) a[12] << 24 | (uint64_t) a[13] << 16 | (uint64_t) a[14] << 8 | a[15]);
+	uint64_t key = 0;
+	for (int i = 0; i < 8; i++) key = key << 8 | a[i];
+	return key ? key : 1;
+}
+
+// A slot is claimed by stamping its state with a full bucket as of now,
+// then writing the key. Only one thread can replace a given state, so
+// one that loses a claim never touches the winner's bucket, and a stamp
+// whose key write is lost just ages out like any idle bucket.
+static HTTP_RateSlot *http_rate_slot(HTTP_RateLimiter *rl, uint64_t key, uint32_t now) {
+	uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+	HTTP_RateSlot *shard = rl->shards[h >> (64 - HTTP_RATE_LIMIT_SHARD_BITS)];
+	uint64_t full = (uint64_t) now << 32 | (uint64_t) rl->burst * 1000;
+
+	for (size_t i = 0; i < HTTP_RATE_LIMIT_PROBES; i++) {
+		HTTP_RateSlot *slot = &shard[(h + i) & rl->shard_mask];
+		uint64_t k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if (k == key) return slot;
+
+		// Lazy expiry: a bucket idle long enough to be full again carries
+		// no information and can be handed to another peer. An empty slot
+		// with a state is being claimed right now.
+		uint64_t st = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (k == 0 ? st != 0 : (int32_t)(now - (uint32_t)(st >> 32)) <= (int32_t) rl->idle_ms) continue;
+		if (!__atomic_compare_exchange_n(&slot->state, &st, full, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			// Lost to another claim, perhaps for this key. If its key is
+			// not written yet we probe on, and a second slot for the key
+			// ages out unused.
+			if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key) return slot;
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&slot->key, &k, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return slot;
+	}
+	return NULL;
+}
+
+// Refills the bucket and, if take, spends one token. Returns false when
+// the bucket is empty.
+static bool http_rate_limiter_check(HTTP_RateLimiter *rl, const HTTP_Addr *peer, uint64_t now_ms, bool take) {
+	uint64_t key = http_rate_key(peer);
+	if (key == 0) return true;
+	uint32_t now = (uint32_t)(now_ms - rl->epoch);
+	HTTP_RateSlot *slot = http_rate_slot(rl, key, now);
+	if (!slot) {
+		// Probe window full of live buckets: fail open.
+		__atomic_fetch_add(&rl->untracked, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	uint64_t cap = (uint64_t) rl->burst * 1000;
+	uint64_t st = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+	for (;;) {
+		// Another thread may have stamped a millisecond we have not seen.
+		int32_t elapsed = (int32_t)(now - (uint32_t)(st >> 32));
+		if (elapsed < 0) elapsed = 0;
+		uint64_t tokens = (st & 0xffffffffULL) + (uint64_t) elapsed * rl->rate;
+		if (tokens > cap) tokens = cap;
+		if (tokens < 1000) {
+			__atomic_fetch_add(&rl->limited, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+		if (!take) return true;
+		uint64_t next = (uint64_t) now << 32 | (tokens - 1000);
+		if (__atomic_compare_exchange_n(&slot->state, &st, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return true;
+	}
+}
+
+bool http_rate_limiter_allow(HTTP_RateLimiter *rl, const HTTP_Addr *peer, uint64_t now_ms) {
+	return http_rate_limiter_check(rl, peer, now_ms, true);
+}
+
+// Access log
+
+typedef struct {
+	size_t seq;
+	HTTP_AccessRecord rec;
+} HTTP_AccessSlot;
+
+struct HTTP_AccessLog {
+	int fd;
+	pthread_t thread;
+	bool stop;
+	uint64_t dropped;
+	char pad0[64];
+	size_t head; // next slot producers claim
+	char pad1[64];
+	size_t tail; // next slot the writer reads
+	HTTP_AccessSlot slots[HTTP_ACCESS_LOG_SLOTS];
+};
+
+// Bounded MPMC queue after Vyukov: a slot's seq says whether it is free
+// for the producer at position pos (seq == pos) or holds that
+// position's record (seq == pos + 1).
+bool http_access_log_push(HTTP_AccessLog *log, const HTTP_AccessRecord *rec) {
+	size_t pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+	for (;;) {
+		HTTP_AccessSlot *slot = &log->slots[pos & (HTTP_ACCESS_LOG_SLOTS - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&log->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				slot->rec = *rec;
+				__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (diff < 0) {
+			__atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+			return false;
+		} else {
+			pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static bool http_access_log_pop(HTTP_AccessLog *log, HTTP_AccessRecord *rec) {
+	HTTP_AccessSlot *slot = &log->slots[log->tail & (HTTP_ACCESS_LOG_SLOTS - 1)];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log->tail + 1) return false;
+	*rec = slot->rec;
+	__atomic_store_n(&slot->seq, log->tail + HTTP_ACCESS_LOG_SLOTS, __ATOMIC_RELEASE);
+	log->tail++;
+	return true;
+}
+
+uint64_t http_access_log_dropped(HTTP_AccessLog *log) {
+	return __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+}
+
+static size_t http_json_escape(char *dst, size_t cap, const char *src) {
+	static const char hex[] = "0123456789abcdef";
+	size_t n = 0;
+	for (const unsigned char *s = (const unsigned char *) src; *s && n + 6 < cap; s++) {
+		if (*s == '"' || *s == '\\') {
+			dst[n++] = '\\';
+			dst[n++] = (char) *s;
+		} else if (*s < 0x20 || *s == 0x7f) {
+			memcpy(dst + n, "\\u00", 4);
+			dst[n + 4] = hex[*s >> 4];
+			dst[n + 5] = hex[*s & 15];
+			n += 6;
+		} else {
+			dst[n++] = (char) *s;
+		}
+	}
+	return n;
+}
+
+// "1.2.3.4:80", "[::1]:80" or "unix"; size must be INET6_ADDRSTRLEN + 8.
+static void http_addr_format(const HTTP_Addr *addr, char *out, size_t size) {
+	snprintf(out, size, "unix");
+	if (addr->sa.sa_family == AF_INET) {
+		inet_ntop(AF_INET, &addr->in.sin_addr, out, (socklen_t) size);
+		snprintf(out + strlen(out), 8, ":%u", (unsigned) ntohs(addr->in.sin_port));
+	} else if (addr->sa.sa_family == AF_INET6) {
+		out[0] = '[';
+		inet_ntop(AF_INET6, &addr->in6.sin6_addr, out + 1, (socklen_t)(size - 1));
+		snprintf(out + strlen(out), 8, "]:%u", (unsigned) ntohs(addr->in6.sin6_port));
+	}
+}
+
+static size_t http_access_record_format(const HTTP_AccessRecord *rec, char *line, size_t cap) {
+	char peer[INET6_ADDRSTRLEN + 8];
+	http_addr_format(&rec->peer, peer, sizeof(peer));
+
+	time_t sec = (time_t)(rec->time_us / 1000000);
+	struct tm tm;
+	gmtime_r(&sec, &tm);
+	char ts[32];
+	strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	char method[sizeof(rec->method) * 6], target[HTTP_ACCESS_LOG_TARGET_MAX * 6];
+	method[http_json_escape(method, sizeof(method), rec->method)] = '\0';
+	target[http_json_escape(target, sizeof(target), rec->target)] = '\0';
+
+	int n = snprintf(line, cap,
+		"{\"ts\":\"%s.%06uZ\",\"peer\":\"%s\",\"method\":\"%s\",\"target\":\"%s\",\"status\":%u,"
+		"\"bytes\":%llu,\"ttfb_us\":%u,\"dur_us\":%u}\n",
+		ts, (unsigned)(rec->time_us % 1000000), peer, method, target, (unsigned) rec->status,
+		(unsigned long long) rec->bytes, (unsigned) rec->ttfb_us, (unsigned) rec->total_us);
+	if (n < 0) return 0;
+	return (size_t) n < cap ? (size_t) n : cap - 1;
+}
+
+static void http_writev_all(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= (ssize_t) iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= (size_t) n;
+		}
+	}
+}
+
+#define HTTP_ACCESS_LOG_LINE_MAX (HTTP_ACCESS_LOG_TARGET_MAX * 6 + 384)
+
+static void *http_access_log_writer(void *arg) {
+	HTTP_AccessLog *log = (HTTP_AccessLog *) arg;
+	char (*lines)[HTTP_ACCESS_LOG_LINE_MAX] = (char (*)[HTTP_ACCESS_LOG_LINE_MAX]) malloc(HTTP_ACCESS_LOG_BATCH * HTTP_ACCESS_LOG_LINE_MAX);
+	if (!lines) return NULL;
+	struct iovec iov[HTTP_ACCESS_LOG_BATCH];
+	HTTP_AccessRecord rec;
+
+	for (;;) {
+		bool stop = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+		int n = 0;
+		while (n < HTTP_ACCESS_LOG_BATCH && http_access_log_pop(log, &rec)) {
+			iov[n].iov_base = lines[n];
+			iov[n].iov_len = http_access_record_format(&rec, lines[n], HTTP_ACCESS_LOG_LINE_MAX);
+			n++;
+		}
+		if (n > 0) {
+			http_writev_all(log->fd, iov, n);
+			continue;
+		}
+		if (stop) break;
+		struct timespec idle = { 0, HTTP_ACCESS_LOG_IDLE_MS * 1000000L };
+		nanosleep(&idle, NULL);
+	}
+	free(lines);
+	return NULL;
+}
+
+HTTP_AccessLog *http_access_log_open(const char *path) {
+	HTTP_AccessLog *log = (HTTP_AccessLog *) calloc(1, sizeof *log);
+	if (!log) return NULL;
+	for (size_t i = 0; i < HTTP_ACCESS_LOG_SLOTS; i++) log->slots[i].seq = i;
+	log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (log->fd < 0) { free(log); return NULL; }
+	if (pthread_create(&log->thread, NULL, http_access_log_writer, log) != 0) {
+		close(log->fd);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
+
+void http_access_log_close(HTTP_AccessLog *log) {
+	if (!log) return;
+	__atomic_store_n(&log->stop, true, __ATOMIC_RELEASE);
+	pthread_join(log->thread, NULL);
+	close(log->fd);
+	free(log);
+}
+
+static void http_conn_log_begin(HTTP_Server *serv, HTTP_Conn *conn, const char *method, size_t method_len,
+		const char *target, size_t target_len) {
+	conn->log_pending = serv->access_log != NULL;
+	if (!conn->log_pending) return;
+	if (method_len >= sizeof(conn->log.method)) method_len = sizeof(conn->log.method) - 1;
+	if (target_len >= sizeof(conn->log.target)) target_len = sizeof(conn->log.target) - 1;
+	memcpy(conn->log.method, method, method_len);
+	conn->log.method[method_len] = '\0';
+	memcpy(conn->log.target, target, target_len);
+	conn->log.target[target_len] = '\0';
+	conn->log.peer = conn->peer;
+	conn->log.peer_len = conn->peer_len;
+}
+
+static void http_conn_log_ready(HTTP_Conn *conn, uint16_t status) {
+	if (!conn->log_pending) return;
+	conn->log.status = status;
+	conn->log.ttfb_us = (uint32_t)(http_now_us() - conn->req_start_us);
+}
+
+static void http_conn_log_end(HTTP_Server *serv, HTTP_Conn *conn, uint64_t bytes) {
+	if (!conn->log_pending || !serv->access_log) return;
+	conn->log_pending = false;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	conn->log.time_us = (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+	conn->log.total_us = (uint32_t)(http_now_us() - conn->req_start_us);
+	conn->log.bytes = bytes;
+	http_access_log_push(serv->access_log, &conn->log);
+}
+
+// Capture
+
+struct HTTP_Capture {
+	FILE *f;
+	uint64_t start_us;
+	uint64_t count;
+	bool dirty; // written since the last flush
+};
+
+HTTP_Capture *http_capture_open(const char *path) {
+	HTTP_Capture *cap = (HTTP_Capture *) calloc(1, sizeof *cap);
+	if (!cap) return NULL;
+	cap->f = fopen(path, "a");
+	if (!cap->f) { free(cap); return NULL; }
+	setvbuf(cap->f, NULL, _IOFBF, 1 << 20);
+	cap->start_us = http_now_us();
+	return cap;
+}
+
+void http_capture_close(HTTP_Capture *cap) {
+	if (!cap) return;
+	fclose(cap->f);
+	free(cap);
+}
+
+// Bytes outside printable ASCII become \u00XX, so "raw" read back as
+// Latin-1 gives the exact request bytes.
+void http_capture_write(HTTP_Capture *cap, const HTTP_Addr *peer, const uint8_t *raw, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	char addr[INET6_ADDRSTRLEN + 8];
+	http_addr_format(peer, addr, sizeof(addr));
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(cap->f, "{\"seq\":%llu,\"t_us\":%llu,\"unix_us\":%llu,\"peer\":\"%s\",\"raw\":\"",
+		(unsigned long long) cap->count++, (unsigned long long)(http_now_us() - cap->start_us),
+		(unsigned long long) ts.tv_sec * 1000000 + (unsigned long long) ts.tv_nsec / 1000, addr);
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t c = raw[i];
+		if (c == '"' || c == '\\') {
+			putc('\\', cap->f);
+			putc(c, cap->f);
+		} else if (c == '\r') {
+			fputs("\\r", cap->f);
+		} else if (c == '\n') {
+			fputs("\\n", cap->f);
+		} else if (c < 0x20 || c >= 0x7f) {
+			char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+			fwrite(esc, 1, sizeof(esc), cap->f);
+		} else {
+			putc(c, cap->f);
+		}
+	}
+	fputs("\"}\n", cap->f);
+	cap->dirty = true;
+}
+
+// The event loop flushes once per round, so a batch of requests costs
+// one write and little is lost if the process is killed.
+static void http_capture_flush(HTTP_Capture *cap) {
+	if (!cap->dirty) return;
+	fflush(cap->f);
+	cap->dirty = false;
+}
+
+// Tracing
+
+int http_trace_start(size_t max_events) {
+	HTTP_TraceEvent *events = (HTTP_TraceEvent *) malloc(sizeof(*events) * (max_events ? max_events : 1));
+	if (!events) return -1;
+	free(http_tracer.events);
+	http_tracer.cap = max_events;
+	http_tracer.count = 0;
+	http_tracer.events = events;
+	return 0;
+}
+
+void http_trace_stop(void) {
+	free(http_tracer.events);
+	http_tracer.events = NULL;
+	http_tracer.cap = http_tracer.count = 0;
+}
+
+int http_trace_dump(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f) return -1;
+	size_t n = http_tracer.count < http_tracer.cap ? http_tracer.count : http_tracer.cap;
+	int pid = (int) getpid();
+	char name[HTTP_ACCESS_LOG_TARGET_MAX * 6];
+	fputs("{\"traceEvents\":[\n", f);
+	for (size_t i = 0; i < n; i++) {
+		HTTP_TraceEvent *e = &http_tracer.events[i];
+		name[http_json_escape(name, sizeof(name), e->name)] = '\0';
+		if (e->dur == UINT64_MAX)
+			fprintf(f, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,\"tid\":%d}",
+				name, (unsigned long long) e->ts, pid, e->tid);
+		else
+			fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d}",
+				name, (unsigned long long) e->ts, (unsigned long long) e->dur, pid, e->tid);
+		fputs(i + 1 < n ? ",\n" : "\n", f);
+	}
+	fprintf(f, "],\"otherData\":{\"dropped\":%zu}}\n", http_tracer.count - n);
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+// Shared buffers
+
+HTTP_SharedBuf *http_shared_buf_create(const void *data, size_t len) {
+	HTTP_SharedBuf *buf = (HTTP_SharedBuf *) malloc(sizeof(HTTP_SharedBuf) + len);
+	if (!buf) return NULL;
+	buf->refs = 1;
+	buf->len = len;
+	if (len) memcpy(buf->data, data, len);
+	return buf;
+}
+
+HTTP_SharedBuf *http_shared_buf_retain(HTTP_SharedBuf *buf) {
+	buf->refs++;
+	return buf;
+}
+
+void http_shared_buf_release(HTTP_SharedBuf *buf) {
+	if (buf && --buf->refs == 0) free(buf);
+}
+
+// Server-Sent Events
+
+#define HTTP_SSE_IOV_MAX 16
+
+// Returns NULL if the event name would break out of its field.
+static HTTP_SharedBuf *http_sse_encode(const char *event, const char *data) {
+	if (event && event[strcspn(event, "\r\n")] != '\0') return NULL;
+
+	HTTP_StringBuilder sb = http_sb_create(64 + strlen(data));
+	if (event) {
+		http_sb_append_str(&sb, "event: ");
+		http_sb_append_str(&sb, event);
+		http_sb_append_char(&sb, '\n');
+	}
+
+	// One data: field per line, ended by CRLF, CR or LF as the client
+	// splits them; it joins them back with '\n'.
+	const char *p = data;
+	for (;;) {
+		size_t n = strcspn(p, "\r\n");
+		http_sb_append_str(&sb, "data: ");
+		http_sb_append_strn(&sb, p, n);
+		http_sb_append_char(&sb, '\n');
+		if (p[n] == '\0') break;
+		p += p[n] == '\r' && p[n + 1] == '\n' ? n + 2 : n + 1;
+	}
+	http_sb_append_char(&sb, '\n');
+
+	HTTP_SharedBuf *buf = http_shared_buf_create(sb.str, sb.cnt);
+	http_sb_destroy(&sb);
+	return buf;
+}
+
+static void http_sse_unsubscribe(HTTP_Conn *conn) {
+	HTTP_SseHub *hub = conn->sse;
+	if (!hub) return;
+	HTTP_Conn *last = hub->subs[--hub->subs_count];
+	hub->subs[conn->sse_index] = last;
+	last->sse_index = conn->sse_index;
+	conn->sse = NULL;
+
+	for (size_t i = 0; i < conn->sse_count; i++)
+		http_shared_buf_release(conn->sse_queue[(conn->sse_head + i) % HTTP_SSE_MAX_QUEUED]);
+	conn->sse_count = 0;
+	free(conn->sse_queue);
+	conn->sse_queue = NULL;
+}
+
+// Writes the response head left in conn->out, then as many queued events
+// as fit in one writev. Returns 1 when everything is sent, 0 when the
+// socket is full and -1 on error.
+static int http_sse_flush(HTTP_Conn *conn) {
+	while (conn->out_off < conn->out.cnt || conn->sse_count > 0) {
+		struct iovec iov[HTTP_SSE_IOV_MAX];
+		int iovcnt = 0;
+		if (conn->out_off < conn->out.cnt) {
+			iov[iovcnt].iov_base = conn->out.str + conn->out_off;
+			iov[iovcnt++].iov_len = conn->out.cnt - conn->out_off;
+		}
+		for (size_t i = 0; i < conn->sse_count && iovcnt < HTTP_SSE_IOV_MAX; i++) {
+			HTTP_SharedBuf *buf = conn->sse_queue[(conn->sse_head + i) % HTTP_SSE_MAX_QUEUED];
+			size_t skip = i == 0 ? conn->sse_off : 0;
+			iov[iovcnt].iov_base = buf->data + skip;
+			iov[iovcnt++].iov_len = buf->len - skip;
+		}
+
+		ssize_t n = writev(conn->fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+
+		size_t left = (size_t) n;
+		if (conn->out_off < conn->out.cnt) {
+			size_t head = conn->out.cnt - conn->out_off;
+			size_t k = left < head ? left : head;
+			conn->out_off += k;
+			left -= k;
+			if (conn->out_off == conn->out.cnt) {
+				http_sb_reset(&conn->out);
+				conn->out_off = 0;
+			}
+		}
+		while (left > 0) {
+			HTTP_SharedBuf *buf = conn->sse_queue[conn->sse_head];
+			size_t rest = buf->len - conn->sse_off;
+			if (left < rest) {
+				conn->sse_off += left;
+				conn->sse_bytes -= left;
+				break;
+			}
+			left -= rest;
+			conn->sse_bytes -= rest;
+			conn->sse_off = 0;
+			conn->sse_head = (conn->sse_head + 1) % HTTP_SSE_MAX_QUEUED;
+			conn->sse_count--;
+			http_shared_buf_release(buf);
+		}
+	}
+	return 1;
+}
+
+// Queues a reference and tries to send right away. A subscriber that is
+// already too far behind is dropped instead of buffering without bound.
+static int http_sse_enqueue(HTTP_Conn *conn, HTTP_SharedBuf *buf) {
+	if (conn->state != HTTP_CONN_SSE) return -1;
+	if (conn->sse_count == HTTP_SSE_MAX_QUEUED || conn->sse_bytes + buf->len > HTTP_SSE_MAX_QUEUED_BYTES) {
+		if (conn->sse) conn->sse->dropped++;
+		http_conn_close(conn);
+		return -1;
+	}
+
+	conn->sse_queue[(conn->sse_head + conn->sse_count) % HTTP_SSE_MAX_QUEUED] = http_shared_buf_retain(buf);
+	conn->sse_count++;
+	conn->sse_bytes += buf->len;
+
+	if (http_sse_flush(conn) < 0) {
+		http_conn_close(conn);
+		return -1;
+	}
+	return 0;
+}
+
+size_t http_sse_publish(HTTP_SseHub *hub, const char *event, const char *data) {
+	HTTP_SharedBuf *buf = http_sse_encode(event, data);
+	if (!buf) return 0;
+
+	size_t sent = 0;
+	for (size_t i = 0; i < hub->subs_count; i++)
+		if (http_sse_enqueue(hub->subs[i], buf) == 0) sent++;
+	hub->published++;
+
+	http_shared_buf_release(buf);
+	return sent;
+}
+
+int http_sse_send(HTTP_SseClient *client, const char *event, const char *data) {
+	HTTP_SharedBuf *buf = http_sse_encode(event, data);
+	if (!buf) return -1;
+	int rc = http_sse_enqueue(client, buf);
+	http_shared_buf_release(buf);
+	return rc;
+}
+
+static void http_sse_write(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	int r = http_sse_flush(conn);
+	if (r < 0) { http_conn_close(conn); return; }
+	// A subscriber is idle by design; only a stalled write is timed out.
+	http_conn_set_timeout(serv, conn, now, r == 0 ? serv->limits.write_timeout_ms : 0);
+}
+
+static HTTP_SseHub *http_sse_hub(HTTP_Server *serv, const char *path) {
+	for (size_t i = 0; i < serv->sse_hubs_count; i++)
+		if (http_route_match(serv->sse_hubs[i]->target, path)) return serv->sse_hubs[i];
+	return NULL;
+}
+
+static bool http_sse_subscribe(HTTP_Server *serv, HTTP_Conn *conn, HTTP_Request *req, HTTP_SseHub *hub, uint64_t now) {
+	if (strcmp(req->method, METHOD_GET) != 0) return false;
+
+	if (hub->subs_count == hub->subs_cap) {
+		size_t newcap = hub->subs_cap ? hub->subs_cap * 2 : 64;
+		HTTP_Conn **ns = (HTTP_Conn **) realloc(hub->subs, sizeof(*ns) * newcap);
+		if (!ns) return false;
+		hub->subs = ns;
+		hub->subs_cap = newcap;
+	}
+	conn->sse_queue = (HTTP_SharedBuf **) malloc(sizeof(HTTP_SharedBuf *) * HTTP_SSE_MAX_QUEUED);
+	if (!conn->sse_queue) return false;
+
+	// No Content-Length: the stream ends when either side closes it.
+	http_sb_append_str(&conn->out, "HTTP/1.1 200 OK\r\n");
+	http_sb_append_header(&conn->out, "Content-Type", "text/event-stream");
+	http_sb_append_header(&conn->out, "Cache-Control", "no-cache");
+	http_sb_append_str(&conn->out, "\r\n");
+	conn->out_off = 0;
+
+	conn->in_len = 0;
+	conn->head_len = conn->req_len = 0;
+	conn->state = HTTP_CONN_SSE;
+	conn->sse = hub;
+	conn->sse_index = hub->subs_count;
+	hub->subs[hub->subs_count++] = conn;
+
+	if (hub->on_open) hub->on_open(hub->ctx, hub, conn, req);
+	if (conn->state == HTTP_CONN_SSE) http_sse_write(serv, conn, now);
+	return true;
+}
+
+static void http_conn_next_request(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now);
+
+// Reverse proxy
+
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#define HTTP_HAVE_SPLICE 1
+#endif
+
+#define HTTP_PROXY_CHUNK 65536 // one pipe's worth
+#define HTTP_PROXY_HEAD_READ 4096
+#define HTTP_PROXY_LINE_READ 256 // chunk-size lines are read in small bites
+#define HTTP_PROXY_MAX_LINE 4096
+
+typedef enum {
+	HTTP_PROXY_CONNECTING = 0,
+	HTTP_PROXY_REQUEST,
+	HTTP_PROXY_RESPONSE_HEAD,
+	HTTP_PROXY_RESPONSE_BODY,
+} HTTP_ProxyPhase;
+
+typedef enum {
+	HTTP_PROXY_BODY_NONE = 0,
+	HTTP_PROXY_BODY_LENGTH,
+	HTTP_PROXY_BODY_CHUNKED,
+	HTTP_PROXY_BODY_CLOSE, // ends when the upstream closes
+} HTTP_ProxyFraming;
+
+typedef enum {
+	HTTP_CHUNK_SIZE = 0,
+	HTTP_CHUNK_DATA,
+	HTTP_CHUNK_DATA_END,
+	HTTP_CHUNK_TRAILER,
+} HTTP_ChunkState;
+
+typedef enum {
+	HTTP_RELAY_DONE = 0,
+	HTTP_RELAY_WAIT_IN,
+	HTTP_RELAY_WAIT_OUT,
+	HTTP_RELAY_EOF,
+	HTTP_RELAY_ERROR,
+} HTTP_RelayResult;
+
+struct HTTP_Proxy {
+	HTTP_ProxyRoute *route;
+	HTTP_ProxyPhase phase;
+	int fd; // upstream
+	bool reused;
+	bool polled; // fd is in this round's pollfds, at pfd
+	size_t pfd;
+	short up_events;
+	short client_events;
+	int pipe[2];
+	size_t pipe_len; // bytes sitting in the pipe
+#ifndef HTTP_HAVE_SPLICE
+	uint8_t bounce[HTTP_PROXY_CHUNK];
+	size_t bounce_off;
+#endif
+	HTTP_StringBuilder up_out; // rewritten head and the body bytes read with it
+	size_t up_out_off;
+	uint64_t req_left; // request body still in the client socket
+	bool head_only;
+	uint8_t *buf; // upstream bytes read but not passed on yet
+	size_t buf_off;
+	size_t buf_len;
+	size_t buf_cap;
+	HTTP_ProxyFraming framing;
+	HTTP_ChunkState chunk;
+	uint64_t left; // bytes of body (or of the current chunk) to pass on
+	bool body_done;
+	bool upstream_keep_alive;
+	bool resp_started;
+	bool aborted; // the upstream quit reading the request body
+	bool resendable; // the whole request is in up_out
+	uint64_t resp_bytes; // sent to the client, for the access log
+};
+
+// Hop-by-hop headers, plus any the Connection header names, stay on
+// their own side of the proxy.
+static bool http_proxy_hop(HTTP_Slice name, HTTP_Slice connection, bool keep_te) {
+	static const char *hop[] = {
+		"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+		"Proxy-Authorization", "TE", "Trailer", "Upgrade", "Expect",
+	};
+	if (name.len == 0) return true;
+	for (size_t i = 0; i < sizeof(hop) / sizeof(hop[0]); i++)
+		if (http_slice_ieq(name, hop[i])) return true;
+	if (!keep_te && http_slice_ieq(name, "Transfer-Encoding")) return true;
+
+	char tmp[64];
+	if (connection.len == 0 || name.len >= sizeof(tmp)) return false;
+	memcpy(tmp, name.ptr, name.len);
+	tmp[name.len] = '\0';
+	return http_token_list_has(connection, tmp);
+}
+
+static size_t http_head_path(const uint8_t *head, size_t head_len, char *path, size_t cap) {
+	const uint8_t *sp = (const uint8_t *) memchr(head, ' ', head_len);
+	if (!sp) return SIZE_MAX;
+	const uint8_t *t = sp + 1;
+	size_t len = 0;
+	while (t + len < head + head_len && t[len] != ' ' && t[len] != '?' && t[len] != '#' && t[len] != '\r') len++;
+	if (len >= cap) return SIZE_MAX;
+
+	len = http_path_decode(path, (const char *) t, len);
+	if (len == SIZE_MAX) return SIZE_MAX;
+	len = http_path_normalize(path, len);
+	path[len] = '\0';
+	return len;
+}
+
+static HTTP_ProxyRoute *http_proxy_route(HTTP_Server *serv, const char *path) {
+	for (size_t i = 0; i < serv->proxy_routes_count; i++)
+		if (http_route_match(serv->proxy_routes[i]->target, path)) return serv->proxy_routes[i];
+	return NULL;
+}
+
+static void http_proxy_destroy(HTTP_Proxy *p) {
+	if (!p) return;
+	if (p->fd >= 0) close(p->fd);
+	if (p->pipe[0] >= 0) close(p->pipe[0]);
+	if (p->pipe[1] >= 0) close(p->pipe[1]);
+	http_sb_destroy(&p->up_out);
+	free(p->buf);
+	free(p);
+}
+
+// Takes a pooled connection that is still open, or starts a new one.
+static int http_proxy_connect(HTTP_Proxy *p, bool pooled, uint64_t now) {
+	HTTP_ProxyRoute *route = p->route;
+	while (pooled && route->idle_count > 0) {
+		HTTP_ProxyIdle idle = route->idle[--route->idle_count];
+		char c;
+		ssize_t n = recv(idle.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (now - idle.since < HTTP_PROXY_POOL_IDLE_MS && n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			p->fd = idle.fd;
+			p->reused = true;
+			p->phase = HTTP_PROXY_REQUEST;
+			route->reuses++;
+			return 0;
+		}
+		close(idle.fd);
+	}
+
+	int fd = socket(route->addr.sa.sa_family, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (http_set_nonblocking(fd) < 0) { close(fd); return -1; }
+	route->connects++;
+	p->fd = fd;
+	p->reused = false;
+	if (connect(fd, &route->addr.sa, route->addr_len) == 0) {
+		p->phase = HTTP_PROXY_REQUEST;
+		return 0;
+	}
+	if (errno != EINPROGRESS) {
+		close(fd);
+		p->fd = -1;
+		return -1;
+	}
+	p->phase = HTTP_PROXY_CONNECTING;
+	return 0;
+}
+
+static void http_proxy_release(HTTP_Proxy *p, uint64_t now) {
+	HTTP_ProxyRoute *route = p->route;
+	if (p->upstream_keep_alive && p->buf_off == p->buf_len && route->idle_count < HTTP_PROXY_POOL_SIZE) {
+		route->idle[route->idle_count++] = (HTTP_ProxyIdle) { p->fd, now };
+		p->fd = -1;
+	}
+}
+
+// Moves up to *left bytes from one socket to the other through the pipe.
+static HTTP_RelayResult http_proxy_relay(HTTP_Proxy *p, int from, int to, uint64_t *left) {
+	for (;;) {
+		if (p->pipe_len > 0) {
+#ifdef HTTP_HAVE_SPLICE
+			ssize_t n = splice(p->pipe[0], NULL, to, NULL, p->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+			ssize_t n = send(to, p->bounce + p->bounce_off, p->pipe_len, MSG_NOSIGNAL);
+#endif
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return errno == EAGAIN || errno == EWOULDBLOCK ? HTTP_RELAY_WAIT_OUT : HTTP_RELAY_ERROR;
+			}
+			p->pipe_len -= (size_t) n;
+			if (to != p->fd) p->resp_bytes += (uint64_t) n;
+#ifndef HTTP_HAVE_SPLICE
+			p->bounce_off += (size_t) n;
+#endif
+			continue;
+		}
+		if (*left == 0) return HTTP_RELAY_DONE;
+
+		size_t want = *left < HTTP_PROXY_CHUNK ? (size_t) *left : HTTP_PROXY_CHUNK;
+#ifdef HTTP_HAVE_SPLICE
+		ssize_t n = splice(from, NULL, p->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+		ssize_t n = recv(from, p->bounce, want, 0);
+		p->bounce_off = 0;
+#endif
+		if (n == 0) return HTTP_RELAY_EOF;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? HTTP_RELAY_WAIT_IN : HTTP_RELAY_ERROR;
+		}
+		p->pipe_len = (size_t) n;
+		*left -= (uint64_t) n;
+	}
+}
+
+// Parses the upstream response head in p->buf and queues the rewritten
+// head for the client. Interim 1xx responses are dropped. Returns 1 when
+// done, 0 if more bytes are needed and -1 for a response we cannot relay.
+static int http_proxy_response_head(HTTP_Conn *conn) {
+	HTTP_Proxy *p = conn->proxy;
+	for (;;) {
+		const char *head = (const char *) p->buf + p->buf_off;
+		size_t head_len = http_find_head_end((const uint8_t *) head, p->buf_len - p->buf_off);
+		if (head_len == 0) return 0;
+		if (head_len < 14 || memcmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ') return -1;
+
+		int code = 0;
+		for (int i = 9; i < 12; i++) {
+			if (head[i] < '0' || head[i] > '9') return -1;
+			code = code * 10 + (head[i] - '0');
+		}
+		if (code == 101) return -1;
+		if (code < 200) {
+			p->buf_off += head_len;
+			continue;
+		}
+
+		HTTP_Slice connection = http_head_get(head, head_len, "Connection");
+		HTTP_Slice te = http_head_get(head, head_len, "Transfer-Encoding");
+		HTTP_Slice cl = http_head_get(head, head_len, "Content-Length");
+
+		if (p->head_only || code == 204 || code == 304) {
+			p->framing = HTTP_PROXY_BODY_NONE;
+		} else if (te.len && http_token_list_has(te, "chunked")) {
+			p->framing = HTTP_PROXY_BODY_CHUNKED;
+		} else if (cl.len) {
+			p->framing = HTTP_PROXY_BODY_LENGTH;
+			p->left = 0;
+			for (size_t i = 0; i < cl.len; i++) {
+				if (cl.ptr[i] < '0' || cl.ptr[i] > '9' || p->left > UINT64_MAX / 10 - 9) return -1;
+				p->left = p->left * 10 + (uint64_t)(cl.ptr[i] - '0');
+			}
+		} else {
+			p->framing = HTTP_PROXY_BODY_CLOSE;
+			p->left = UINT64_MAX;
+		}
+		p->body_done = p->framing == HTTP_PROXY_BODY_NONE || (p->framing == HTTP_PROXY_BODY_LENGTH && p->left == 0);
+		p->upstream_keep_alive = head[7] == '1' && !http_token_list_has(connection, "close") &&
+			p->framing != HTTP_PROXY_BODY_CLOSE && !p->aborted;
+		if (p->framing == HTTP_PROXY_BODY_CLOSE) conn->keep_alive = false;
+
+		const char *eol = (const char *) memchr(head, '\n', head_len);
+		http_sb_append_str(&conn->out, "HTTP/1.1");
+		http_sb_append_strn(&conn->out, head + 8, (size_t)(eol + 1 - head - 8));
+
+		const char *q = eol + 1;
+		HTTP_Slice name, value;
+		while (http_head_next(&q, head + head_len, &name, &value)) {
+			if (http_proxy_hop(name, connection, true)) continue;
+			http_sb_append_strn(&conn->out, name.ptr, name.len);
+			http_sb_append_strn(&conn->out, ": ", 2);
+			http_sb_append_strn(&conn->out, value.ptr, value.len);
+			http_sb_append_strn(&conn->out, "\r\n", 2);
+		}
+		if (!conn->keep_alive) http_sb_append_header(&conn->out, "Connection", "close");
+		http_sb_append_strn(&conn->out, "\r\n", 2);
+		http_conn_log_ready(conn, (uint16_t) code);
+
+		p->buf_off += head_len;
+		p->resp_started = true;
+		p->chunk = HTTP_CHUNK_SIZE;
+		return 1;
+	}
+}
+
+// Passes on body bytes that were read into p->buf along with framing.
+// Chunked framing is copied through as is. Returns -1 on bad framing.
+static int http_proxy_body_buffered(HTTP_Proxy *p, HTTP_StringBuilder *out) {
+	while (!p->body_done && p->buf_off < p->buf_len) {
+		const char *b = (const char *) p->buf + p->buf_off;
+		size_t avail = p->buf_len - p->buf_off;
+
+		if (p->framing != HTTP_PROXY_BODY_CHUNKED || p->chunk == HTTP_CHUNK_DATA) {
+			size_t k = avail < p->left ? avail : (size_t) p->left;
+			http_sb_append_strn(out, b, k);
+			p->buf_off += k;
+			p->left -= k;
+			if (p->left == 0) {
+				if (p->framing == HTTP_PROXY_BODY_LENGTH) p->body_done = true;
+				else p->chunk = HTTP_CHUNK_DATA_END;
+			}
+			continue;
+		}
+
+		const char *eol = (const char *) memchr(b, '\n', avail);
+		if (!eol) return avail > HTTP_PROXY_MAX_LINE ? -1 : 0;
+		size_t line = (size_t)(eol + 1 - b);
+		http_sb_append_strn(out, b, line);
+		p->buf_off += line;
+		bool empty = line == 2 && b[0] == '\r';
+
+		switch (p->chunk) {
+			case HTTP_CHUNK_SIZE: {
+				uint64_t size = 0;
+				size_t i = 0;
+				for (; i < line; i++) {
+					int d = http_hex_digit(b[i]);
+					if (d < 0) break;
+					if (size > (UINT64_MAX >> 4)) return -1;
+					size = (size << 4) | (uint64_t) d;
+				}
+				if (i == 0) return -1;
+				p->left = size;
+				p->chunk = size ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+				break;
+			}
+			case HTTP_CHUNK_DATA_END:
+				if (!empty) return -1;
+				p->chunk = HTTP_CHUNK_SIZE;
+				break;
+			case HTTP_CHUNK_TRAILER:
+				if (empty) p->body_done = true;
+				break;
+			default:
+				break;
+		}
+	}
+	return 0;
 }
 
-void http_server_handle(HTTP_Server *serv, const char *target, HTTP_HandleFunc hf, void *ctx) {
-	http_server_grow_if_needed(serv);
-	serv->targets[serv->hfs_count] = target;
-	serv->hfs[serv->hfs_count] = hf;
-	serv->hfs_ctx[serv->hfs_count] = ctx;
-	serv->hfs_count++;
+// The upstream stopped taking the request body, most likely because it
+// already answered (a 413, say). Relay that answer, then close both
+// sides: neither connection is at a request boundary anymore.
+static int http_proxy_abort_request(HTTP_Proxy *p, HTTP_Conn *conn) {
+	p->aborted = true;
+	p->resendable = false;
+	p->req_left = 0;
+	p->pipe_len = 0;
+	conn->keep_alive = false;
+	p->phase = HTTP_PROXY_RESPONSE_HEAD;
+#ifdef HTTP_HAVE_SPLICE
+	close(p->pipe[0]);
+	close(p->pipe[1]);
+	p->pipe[0] = p->pipe[1] = -1;
+	if (pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+#endif
+	return 0;
 }
 
-HTTP_Server http_server_create(uint16_t port) {
-	HTTP_Server serv = {0};
+// A pooled connection the upstream closed in the meantime: start over on
+// a fresh one if nothing of the request or the response went through
+// yet. Returns -1 if the request cannot be retried.
+static int http_proxy_retry(HTTP_Proxy *p, uint64_t now) {
+	if (!p->reused || !p->resendable || p->buf_len > 0) return -1;
+	close(p->fd);
+	p->fd = -1;
+	p->up_out_off = 0;
+	return http_proxy_connect(p, false, now);
+}
 
-	serv.hfs_cap = 32;
-	serv.targets = (const char **) malloc(sizeof(char*) * serv.hfs_cap);
-	serv.hfs = (HTTP_HandleFunc *) malloc(sizeof(HTTP_HandleFunc) * serv.hfs_cap);
-	serv.hfs_ctx = (void **) malloc(sizeof(void*) * serv.hfs_cap);
-	if (!serv.targets || !serv.hfs || !serv.hfs_ctx) {
-		perror("malloc");
-		exit(1);
+static void http_proxy_fail(HTTP_Conn *conn) {
+	if (conn->proxy->resp_started) http_conn_close(conn);
+	else http_conn_reject(conn, HTTP_RESP_BAD_GATEWAY, sizeof(HTTP_RESP_BAD_GATEWAY) - 1);
+}
+
+// Runs the exchange as far as both sockets allow and records what to
+// wait for next in up_events and client_events.
+static void http_proxy_step(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	HTTP_Proxy *p = conn->proxy;
+	p->up_events = p->client_events = 0;
+	http_conn_set_timeout(serv, conn, now, HTTP_PROXY_TIMEOUT_MS);
+
+	for (;;) {
+		switch (p->phase) {
+			case HTTP_PROXY_CONNECTING: {
+				struct pollfd pfd = { .fd = p->fd, .events = POLLOUT };
+				if (poll(&pfd, 1, 0) == 0) { p->up_events = POLLOUT; return; }
+				int err = 0;
+				socklen_t len = sizeof(err);
+				if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) { http_proxy_fail(conn); return; }
+				p->phase = HTTP_PROXY_REQUEST;
+				break;
+			}
+
+			case HTTP_PROXY_REQUEST: {
+				while (p->up_out_off < p->up_out.cnt) {
+					ssize_t n = send(p->fd, p->up_out.str + p->up_out_off, p->up_out.cnt - p->up_out_off, MSG_NOSIGNAL);
+					if (n < 0) {
+						if (errno == EINTR) continue;
+						if (errno == EAGAIN || errno == EWOULDBLOCK) { p->up_events = POLLOUT; return; }
+						if (p->up_out_off > 0 && http_proxy_abort_request(p, conn) == 0) break;
+						if (p->up_out_off == 0 && (errno == EPIPE || errno == ECONNRESET) && http_proxy_retry(p, now) == 0) break;
+						http_proxy_fail(conn);
+						return;
+					}
+					p->up_out_off += (size_t) n;
+				}
+				// Aborted, or retried on a fresh connection.
+				if (p->phase != HTTP_PROXY_REQUEST || p->up_out_off < p->up_out.cnt) break;
+
+				switch (http_proxy_relay(p, conn->fd, p->fd, &p->req_left)) {
+					case HTTP_RELAY_DONE: break;
+					case HTTP_RELAY_WAIT_IN: p->client_events = POLLIN; return;
+					case HTTP_RELAY_WAIT_OUT: p->up_events = POLLOUT; return;
+					case HTTP_RELAY_EOF: http_conn_close(conn); return;
+					default:
+						if (http_proxy_abort_request(p, conn) == 0) break;
+						http_proxy_fail(conn);
+						return;
+				}
+				p->phase = HTTP_PROXY_RESPONSE_HEAD;
+				break;
+			}
+
+			case HTTP_PROXY_RESPONSE_HEAD: {
+				size_t queued = conn->out.cnt;
+				int r = http_proxy_response_head(conn);
+				p->resp_bytes += conn->out.cnt - queued;
+				if (r < 0) { http_proxy_fail(conn); return; }
+				if (r > 0) { p->phase = HTTP_PROXY_RESPONSE_BODY; break; }
+				if (p->buf_len == p->buf_cap) { http_proxy_fail(conn); return; }
+
+				size_t want = p->buf_cap - p->buf_len;
+				if (want > HTTP_PROXY_HEAD_READ) want = HTTP_PROXY_HEAD_READ;
+				ssize_t n = recv(p->fd, p->buf + p->buf_len, want, 0);
+				if (n < 0 && errno == EINTR) break;
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { p->up_events = POLLIN; return; }
+				if (n <= 0) {
+					if (http_proxy_retry(p, now) == 0) break;
+					http_proxy_fail(conn);
+					return;
+				}
+				p->buf_len += (size_t) n;
+				break;
+			}
+
+			case HTTP_PROXY_RESPONSE_BODY: {
+				// Bytes queued in userspace go first, then the pipe, so the
+				// client sees everything in upstream order.
+				int r = http_conn_flush_out(conn);
+				if (r < 0) { http_conn_close(conn); return; }
+				if (r == 0) { p->client_events = POLLOUT; return; }
+
+				bool raw = p->framing != HTTP_PROXY_BODY_CHUNKED || p->chunk == HTTP_CHUNK_DATA;
+				if (!p->body_done && (p->pipe_len > 0 || (raw && p->left > 0 && p->buf_off == p->buf_len))) {
+					switch (http_proxy_relay(p, p->fd, conn->fd, &p->left)) {
+						case HTTP_RELAY_DONE:
+							if (p->framing == HTTP_PROXY_BODY_CHUNKED) p->chunk = HTTP_CHUNK_DATA_END;
+							else p->body_done = true;
+							break;
+						case HTTP_RELAY_WAIT_IN: p->up_events = POLLIN; return;
+						case HTTP_RELAY_WAIT_OUT: p->client_events = POLLOUT; return;
+						case HTTP_RELAY_EOF:
+							if (p->framing != HTTP_PROXY_BODY_CLOSE) { http_conn_close(conn); return; }
+							p->body_done = true;
+							break;
+						default: http_conn_close(conn); return;
+					}
+					break;
+				}
+
+				size_t queued = conn->out.cnt;
+				if (http_proxy_body_buffered(p, &conn->out) < 0) { http_conn_close(conn); return; }
+				p->resp_bytes += conn->out.cnt - queued;
+				if (conn->out.cnt > conn->out_off) break;
+
+				if (p->body_done) {
+					http_conn_log_end(serv, conn, p->resp_bytes);
+					http_proxy_release(p, now);
+					http_proxy_destroy(p);
+					conn->proxy = NULL;
+					http_conn_next_request(serv, conn, now);
+					return;
+				}
+
+				if (p->buf_off == p->buf_len) p->buf_off = p->buf_len = 0;
+				if (raw && p->left > 0) break;
+
+				// Framing: read a little at a time, or the data behind it
+				// would come through userspace too.
+				if (p->buf_off > 0) {
+					memmove(p->buf, p->buf + p->buf_off, p->buf_len - p->buf_off);
+					p->buf_len -= p->buf_off;
+					p->buf_off = 0;
+				}
+				if (p->buf_len == p->buf_cap) { http_conn_close(conn); return; }
+				size_t want = p->buf_cap - p->buf_len;
+				if (want > HTTP_PROXY_LINE_READ) want = HTTP_PROXY_LINE_READ;
+				ssize_t n = recv(p->fd, p->buf + p->buf_len, want, 0);
+				if (n < 0 && errno == EINTR) break;
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { p->up_events = POLLIN; return; }
+				if (n <= 0) {
+					if (n == 0 && p->framing == HTTP_PROXY_BODY_CLOSE) { p->body_done = true; break; }
+					http_conn_close(conn);
+					return;
+				}
+				p->buf_len += (size_t) n;
+				break;
+			}
+		}
+	}
+}
+
+// Appends the target the upstream gets: the path with its dot segments
+// resolved as routing saw them, "%2e" included, then the query. Every
+// other escape goes on as the client sent it, so the upstream decodes
+// the same path the route was picked for.
+static void http_proxy_append_target(HTTP_StringBuilder *sb, const char *t, size_t len) {
+	size_t path_len = 0;
+	while (path_len < len && t[path_len] != '?' && t[path_len] != '#') path_len++;
+
+	http_sb_ensure_capacity(sb, len + 1);
+	char *path = sb->str + sb->cnt;
+	size_t o = 0;
+	for (size_t i = 0; i < path_len; i++) {
+		if (t[i] == '%' && i + 2 < path_len && t[i + 1] == '2' && (t[i + 2] | 0x20) == 'e') {
+			path[o++] = '.';
+			i += 2;
+		} else {
+			path[o++] = t[i];
+		}
 	}
+	sb->cnt += http_path_normalize(path, o);
 
-	serv.socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (serv.socket < 0) { perror("socket"); exit(1); }
+	size_t query_end = path_len;
+	if (path_len < len && t[path_len] == '?')
+		while (query_end < len && t[query_end] != '#') query_end++;
+	http_sb_append_strn(sb, t + path_len, query_end - path_len);
+}
 
-	int yes = 1;
-	if (setsockopt(serv.socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
-		perror("setsockopt");
+// Rewrites the request head for the upstream and starts the exchange.
+// Whatever part of the body was read with the head goes out with it;
+// the rest is spliced straight from the client socket.
+static void http_proxy_start(HTTP_Server *serv, HTTP_Conn *conn, HTTP_ProxyRoute *route, size_t body_len, uint64_t now) {
+	HTTP_Proxy *p = (HTTP_Proxy *) calloc(1, sizeof *p);
+	if (!p) { http_conn_close(conn); return; }
+	p->route = route;
+	p->fd = p->pipe[0] = p->pipe[1] = -1;
+	p->buf_cap = serv->limits.max_header_bytes + HTTP_PROXY_HEAD_READ;
+	p->buf = (uint8_t *) malloc(p->buf_cap);
+	p->up_out = http_sb_create(conn->head_len + 64);
+	conn->proxy = p;
+	conn->state = HTTP_CONN_PROXY;
+	if (!p->buf || !p->up_out.str) { http_conn_close(conn); return; }
+#ifdef HTTP_HAVE_SPLICE
+	if (pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC) < 0) { http_conn_close(conn); return; }
+#endif
+
+	const char *head = (const char *) conn->in;
+	size_t head_len = conn->head_len;
+	const char *eol = (const char *) memchr(head, '\n', head_len);
+	const char *sp1 = (const char *) memchr(head, ' ', (size_t)(eol - head));
+	const char *sp2 = sp1 ? (const char *) memchr(sp1 + 1, ' ', (size_t)(eol - sp1 - 1)) : NULL;
+	if (!sp2) { http_conn_reject(conn, HTTP_RESP_BAD_REQUEST, sizeof(HTTP_RESP_BAD_REQUEST) - 1); return; }
+
+	// The body is framed by its one Content-Length, which is sent on
+	// as the proxy counts it; chunked uploads are not relayed.
+	HTTP_Slice connection = http_head_get(head, head_len, "Connection");
+	HTTP_Slice expect = http_head_get(head, head_len, "Expect");
+	HTTP_Slice content_length = http_head_get(head, head_len, "Content-Length");
+	if (http_head_get(head, head_len, "Transfer-Encoding").ptr) {
+		http_conn_reject(conn, HTTP_RESP_NOT_IMPLEMENTED, sizeof(HTTP_RESP_NOT_IMPLEMENTED) - 1);
+		return;
+	}
+	p->head_only = sp1 - head == 4 && memcmp(head, "HEAD", 4) == 0;
+	http_conn_log_begin(serv, conn, head, (size_t)(sp1 - head), sp1 + 1, (size_t)(sp2 - sp1 - 1));
+	conn->keep_alive = memcmp(sp2 + 1, PROTOCOL, strlen(PROTOCOL)) == 0 && !http_token_list_has(connection, "close");
+
+	http_sb_append_strn(&p->up_out, head, (size_t)(sp1 + 1 - head));
+	http_proxy_append_target(&p->up_out, sp1 + 1, (size_t)(sp2 - sp1 - 1));
+	http_sb_append_str(&p->up_out, " HTTP/1.1\r\n");
+	const char *q = eol + 1;
+	HTTP_Slice name, value;
+	while (http_head_next(&q, head + head_len, &name, &value)) {
+		if (http_proxy_hop(name, connection, false) || http_slice_ieq(name, "Content-Length")) continue;
+		http_sb_append_strn(&p->up_out, name.ptr, name.len);
+		http_sb_append_strn(&p->up_out, ": ", 2);
+		http_sb_append_strn(&p->up_out, value.ptr, value.len);
+		http_sb_append_strn(&p->up_out, "\r\n", 2);
+	}
+	if (content_length.ptr) {
+		http_sb_append_strn(&p->up_out, "Content-Length: ", 16);
+		http_sb_append_uint(&p->up_out, body_len);
+		http_sb_append_strn(&p->up_out, "\r\n", 2);
+	}
+	http_sb_append_header(&p->up_out, "Connection", "keep-alive");
+	http_sb_append_strn(&p->up_out, "\r\n", 2);
+
+	size_t avail = conn->in_len - head_len;
+	size_t take = avail < body_len ? avail : body_len;
+	http_sb_append_strn(&p->up_out, head + head_len, take);
+	p->req_left = body_len - take;
+	p->resendable = p->req_left == 0;
+
+	if (p->req_left > 0 && expect.len && http_slice_ieq(expect, "100-continue")) {
+		static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		send(conn->fd, cont, sizeof(cont) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
 	}
 
-	serv.addr.sin_family = AF_INET;
-	serv.addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv.addr.sin_port = htons(port);
+	// Only what the client pipelined after this request stays buffered.
+	size_t used = head_len + take;
+	memmove(conn->in, conn->in + used, conn->in_len - used);
+	conn->in_len -= used;
+	conn->in[conn->in_len] = '\0';
+	conn->head_len = conn->req_len = 0;
 
-	return serv;
+	if (http_proxy_connect(p, true, now) < 0) { http_proxy_fail(conn); return; }
+	http_proxy_step(serv, conn, now);
 }
 
-void http_server_run(HTTP_Server *serv) {
-	if (bind(serv->socket, (struct sockaddr*)&serv->addr, sizeof(serv->addr)) < 0) {
-		perror("bind"); exit(1);
+static void http_conn_process(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now);
+
+static void http_conn_write(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	int r = http_conn_flush(conn);
+	if (r < 0) { http_conn_close(conn); return; }
+	if (r == 0) return;
+
+	http_conn_log_end(serv, conn, conn->out.cnt + conn->resp.body_len);
+	HTTP_PROBE2(write__done, conn->fd, conn->out.cnt + conn->resp.body_len);
+	if (http_trace_on()) {
+		uint64_t end = http_now_us();
+		http_trace_span("write", conn->fd, conn->resp_ready_us, end);
+		http_trace_span("request", conn->fd, conn->req_start_us, end);
 	}
+	http_conn_clear_response(conn);
+	http_conn_next_request(serv, conn, now);
+}
 
-	if (listen(serv->socket, 16) < 0) {
-		perror("listen"); exit(1);
+// The first bytes of a request are in: charge the peer's bucket before
+// anything looks at them. Returns false if the request was turned away.
+static bool http_conn_begin_request(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	if (serv->rate_limiter && !http_rate_limiter_allow(serv->rate_limiter, &conn->peer, now)) {
+		http_conn_reject(conn, HTTP_RESP_TOO_MANY_REQUESTS, sizeof(HTTP_RESP_TOO_MANY_REQUESTS) - 1);
+		return false;
+	}
+	if (serv->access_log || http_trace_on()) conn->req_start_us = http_now_us();
+	conn->state = HTTP_CONN_READING;
+	http_conn_set_timeout(serv, conn, now, serv->limits.read_timeout_ms);
+	return true;
+}
+
+// A response is out: close, or move on to what the client already
+// pipelined behind the request.
+static void http_conn_next_request(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	if (!conn->keep_alive) { http_conn_close(conn); return; }
+
+	size_t rest = conn->in_len - conn->req_len;
+	memmove(conn->in, conn->in + conn->req_len, rest);
+	conn->in_len = rest;
+	conn->in[conn->in_len] = '\0';
+	conn->head_len = conn->req_len = 0;
+
+	if (rest > 0) {
+		if (!http_conn_begin_request(serv, conn, now)) return;
+		http_conn_process(serv, conn, now);
+	} else {
+		conn->state = HTTP_CONN_IDLE;
+		http_conn_set_timeout(serv, conn, now, serv->limits.idle_timeout_ms);
+	}
+}
+
+static void http_conn_send_response(HTTP_Server *serv, HTTP_Conn *conn, HTTP_Request *req, uint64_t now) {
+	http_conn_log_begin(serv, conn, req->method, strlen(req->method), req->target, strlen(req->target));
+	http_conn_log_ready(conn, conn->resp.status_code);
+	if (http_trace_on()) conn->resp_ready_us = http_now_us();
+	conn->keep_alive = http_conn_keep_alive(req, &conn->resp);
+	http_resp_header_to_sb(&conn->resp, &conn->out);
+	if (strcmp(req->method, METHOD_HEAD) == 0) {
+		free(conn->resp.body);
+		conn->resp.body = NULL;
+		conn->resp.body_len = 0;
+	}
+	conn->out_off = 0;
+	conn->state = HTTP_CONN_WRITING;
+	http_conn_set_timeout(serv, conn, now, serv->limits.write_timeout_ms);
+	http_conn_write(serv, conn, now);
+}
+
+// Response cache
+
+struct HTTP_CacheEntry {
+	HTTP_CacheEntry *next; // in the bucket
+	HTTP_CacheEntry *older;
+	HTTP_CacheEntry *newer;
+	uint64_t hash;
+	char *key;
+	size_t key_len;
+	uint64_t expires;
+	bool keep_alive; // the stored response allows keep-alive
+	HTTP_SharedBuf *resp;
+	size_t head_len; // resp up to the body, all that HEAD sends
+};
+
+static uint64_t http_fnv1a(const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *) data;
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 1099511628211ULL;
+	return h;
+}
+
+// method NUL target NUL, then one value NUL per vary header.
+static void http_cache_key(HTTP_Cache *cache, HTTP_Request *req, HTTP_StringBuilder *key) {
+	http_sb_append_strn(key, req->method, strlen(req->method) + 1);
+	http_sb_append_strn(key, req->target, strlen(req->target) + 1);
+	const char *v = cache->vary;
+	while (v && *v) {
+		while (*v == ' ' || *v == ',') v++;
+		size_t n = strcspn(v, ", ");
+		if (n == 0) break;
+		char name[64];
+		if (n < sizeof(name)) {
+			memcpy(name, v, n);
+			name[n] = '\0';
+			char *value = http_headers_get(&req->headers, name);
+			if (value) http_sb_append_str(key, value);
+		}
+		http_sb_append_strn(key, "", 1);
+		v += n;
+	}
+}
+
+static HTTP_CacheEntry **http_cache_find(HTTP_Cache *cache, uint64_t hash, const char *key, size_t key_len) {
+	HTTP_CacheEntry **e = &cache->buckets[hash % HTTP_CACHE_BUCKETS];
+	for (; *e; e = &(*e)->next)
+		if ((*e)->hash == hash && (*e)->key_len == key_len && memcmp((*e)->key, key, key_len) == 0) break;
+	return e;
+}
+
+static size_t http_cache_entry_size(const HTTP_CacheEntry *e) {
+	return e->key_len + e->resp->len;
+}
+
+static void http_cache_remove(HTTP_Cache *cache, HTTP_CacheEntry *e) {
+	HTTP_CacheEntry **b = &cache->buckets[e->hash % HTTP_CACHE_BUCKETS];
+	while (*b != e) b = &(*b)->next;
+	*b = e->next;
+	if (e->older) e->older->newer = e->newer; else cache->oldest = e->newer;
+	if (e->newer) e->newer->older = e->older; else cache->newest = e->older;
+	cache->count--;
+	cache->bytes -= http_cache_entry_size(e);
+	http_shared_buf_release(e->resp);
+	free(e->key);
+	free(e);
+}
+
+// Every entry lives for the same TTL, so the oldest are both the first
+// to expire and the ones to give up when room is needed.
+static void http_cache_evict(HTTP_Cache *cache, uint64_t now, size_t need) {
+	while (cache->oldest && (cache->oldest->expires <= now ||
+			cache->count >= HTTP_CACHE_MAX_ENTRIES || cache->bytes + need > HTTP_CACHE_MAX_BYTES))
+		http_cache_remove(cache, cache->oldest);
+}
+
+// no-cache is treated like no-store: entries are never revalidated.
+static bool http_resp_cacheable(HTTP_Response *resp) {
+	if (resp->status_code != STATUS_OK || resp->body_len > HTTP_CACHE_MAX_RESPONSE_BYTES) return false;
+	bool framed = false;
+	for (size_t i = 0; i < resp->headers.count; i++) {
+		HTTP_Header *h = &resp->headers.headers[i];
+		if (strcasecmp(h->key, "Content-Length") == 0) {
+			framed = true;
+		} else if (strcasecmp(h->key, "Set-Cookie") == 0) {
+			return false;
+		} else if (strcasecmp(h->key, "Cache-Control") == 0) {
+			HTTP_Slice cc = { h->value, strlen(h->value) };
+			if (http_token_list_has(cc, "no-store") || http_token_list_has(cc, "no-cache") ||
+					http_token_list_has(cc, "private")) return false;
+		}
+	}
+	return framed;
+}
+
+// Writes a serialized response straight from a shared buffer, only its
+// head_len bytes of head for HEAD.
+static void http_conn_send_shared(HTTP_Server *serv, HTTP_Conn *conn, HTTP_Request *req,
+		HTTP_SharedBuf *buf, size_t head_len, bool keep_alive, uint64_t now) {
+	http_conn_log_begin(serv, conn, req->method, strlen(req->method), req->target, strlen(req->target));
+	http_conn_log_ready(conn, STATUS_OK);
+	if (http_trace_on()) conn->resp_ready_us = http_now_us();
+	conn->cached = http_shared_buf_retain(buf);
+	conn->resp = (HTTP_Response) {0};
+	conn->resp.body = buf->data;
+	conn->resp.body_len = strcmp(req->method, METHOD_HEAD) == 0 ? head_len : buf->len;
+	conn->keep_alive = keep_alive && http_req_keep_alive(req);
+	conn->out_off = 0;
+	conn->state = HTTP_CONN_WRITING;
+	http_conn_set_timeout(serv, conn, now, serv->limits.write_timeout_ms);
+	http_conn_write(serv, conn, now);
+}
+
+// Answers req from the route's cache, running the handler on a miss and
+// storing what it returns when that can be reused.
+static void http_conn_respond_cached(HTTP_Server *serv, HTTP_Conn *conn, HTTP_Request *req, int route, uint64_t now) {
+	HTTP_Cache *cache = serv->caches[route];
+	HTTP_StringBuilder key = http_sb_create(128);
+	http_cache_key(cache, req, &key);
+	uint64_t hash = http_fnv1a(key.str, key.cnt);
+	HTTP_CacheEntry **slot = http_cache_find(cache, hash, key.str, key.cnt);
+
+	if (*slot && (*slot)->expires > now) {
+		cache->hits++;
+		http_sb_destroy(&key);
+		http_conn_send_shared(serv, conn, req, (*slot)->resp, (*slot)->head_len, (*slot)->keep_alive, now);
+		return;
+	}
+
+	cache->misses++;
+	conn->resp = http_resp_create();
+	HTTP_PROBE3(route__match, conn->fd, req->path, route);
+	http_server_call(serv, conn->fd, route, req, &conn->resp);
+	if (!http_resp_cacheable(&conn->resp)) {
+		http_sb_destroy(&key);
+		http_conn_send_response(serv, conn, req, now);
+		return;
+	}
+
+	HTTP_StringBuilder out = http_sb_create(256 + conn->resp.body_len);
+	http_resp_header_to_sb(&conn->resp, &out);
+	size_t head_len = out.cnt;
+	http_sb_append_strn(&out, (const char *) conn->resp.body, conn->resp.body_len);
+	HTTP_SharedBuf *buf = http_shared_buf_create(out.str, out.cnt);
+	http_sb_destroy(&out);
+	bool keep_alive = http_resp_keep_alive(&conn->resp);
+	if (!buf) {
+		http_sb_destroy(&key);
+		http_conn_send_response(serv, conn, req, now);
+		return;
+	}
+	http_conn_clear_response(conn);
+
+	// A stale entry for the key is replaced, after older ones make room.
+	if (*slot) http_cache_remove(cache, *slot);
+	size_t need = key.cnt + buf->len;
+	http_cache_evict(cache, now, need);
+	HTTP_CacheEntry *e;
+	if (need <= HTTP_CACHE_MAX_BYTES && (e = (HTTP_CacheEntry *) calloc(1, sizeof *e))) {
+		HTTP_CacheEntry **b = &cache->buckets[hash % HTTP_CACHE_BUCKETS];
+		e->next = *b;
+		*b = e;
+		e->older = cache->newest;
+		if (cache->newest) cache->newest->newer = e; else cache->oldest = e;
+		cache->newest = e;
+		e->hash = hash;
+		e->key = key.str;
+		e->key_len = key.cnt;
+		key.str = NULL;
+		e->resp = http_shared_buf_retain(buf);
+		e->expires = now + cache->ttl_ms;
+		e->keep_alive = keep_alive;
+		e->head_len = head_len;
+		cache->count++;
+		cache->bytes += need;
+	}
+
+	http_sb_destroy(&key);
+	http_conn_send_shared(serv, conn, req, buf, head_len, keep_alive, now);
+	http_shared_buf_release(buf);
+}
+
+static void http_conn_respond(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	if (serv->capture) http_capture_write(serv->capture, &conn->peer, conn->in, conn->req_len);
+
+	HTTP_Error err;
+	HTTP_PROBE2(parse__begin, conn->fd, conn->head_len);
+	uint64_t parse_start = http_trace_on() ? http_now_us() : 0;
+	HTTP_Request req = http_req_parse(conn->in, conn->req_len, &err);
+	if (http_trace_on()) http_trace_span("parse", conn->fd, parse_start, http_now_us());
+	HTTP_PROBE2(parse__end, conn->fd, err);
+	if (err) {
+		http_req_destroy(&req);
+		http_conn_reject(conn, HTTP_RESP_BAD_REQUEST, sizeof(HTTP_RESP_BAD_REQUEST) - 1);
+		return;
+	}
+
+	char *upgrade = http_headers_get(&req.headers, "Upgrade");
+	if (upgrade && strcmp(upgrade, "h2c") == 0 && http_headers_get(&req.headers, "HTTP2-Settings")) {
+		http_h2_upgrade(serv, conn, &req, now);
+		return;
+	}
+
+	const char *path = req.path ? req.path : req.target;
+	HTTP_SseHub *hub = http_sse_hub(serv, path);
+	if (hub) {
+		bool ok = http_sse_subscribe(serv, conn, &req, hub, now);
+		http_req_destroy(&req);
+		if (!ok) http_conn_reject(conn, HTTP_RESP_BAD_REQUEST, sizeof(HTTP_RESP_BAD_REQUEST) - 1);
+		return;
+	}
+
+	const HTTP_WsRoute *route = http_ws_route(serv, path);
+	if (route) {
+		bool ok = upgrade && strcasecmp(upgrade, "websocket") == 0 && http_ws_upgrade(serv, conn, &req, route, now);
+		http_req_destroy(&req);
+		if (!ok) http_conn_reject(conn, HTTP_RESP_BAD_REQUEST, sizeof(HTTP_RESP_BAD_REQUEST) - 1);
+		return;
 	}
 
+	int cached = http_server_route(serv, path);
+	if (cached >= 0 && serv->caches[cached] && (strcmp(req.method, "GET") == 0 || strcmp(req.method, "HEAD") == 0)) {
+		http_conn_respond_cached(serv, conn, &req, cached, now);
+		http_req_destroy(&req);
+		return;
+	}
+
+	conn->resp = http_resp_create();
+	http_server_dispatch(serv, conn->fd, &req, &conn->resp);
+	http_conn_send_response(serv, conn, &req, now);
+	http_req_destroy(&req);
+}
+
+static const HTTP_StreamRoute *http_stream_route(HTTP_Server *serv, const char *path) {
+	for (size_t i = 0; i < serv->stream_routes_count; i++)
+		if (http_route_match(serv->stream_routes[i].target, path)) return &serv->stream_routes[i];
+	return NULL;
+}
+
+// Returns 0 when the request is now streamed, -1 if it was rejected.
+static int http_conn_stream_begin(HTTP_Conn *conn, const HTTP_StreamRoute *route, size_t body_len) {
+	size_t cap = conn->head_len + HTTP_SERVER_STREAM_CHUNK + 1;
+	if (conn->in_cap < cap) {
+		uint8_t *in = (uint8_t *) realloc(conn->in, cap);
+		if (!in) { http_conn_close(conn); return -1; }
+		conn->in = in;
+		conn->in_cap = cap;
+	}
+
+	HTTP_Error err;
+	char *body;
+	HTTP_Request req = http_req_parse_head(conn->in, conn->head_len, &err, &body);
+
+	void *state = NULL;
+	if (err || route->handler.begin(route->ctx, &req, &state) != 0) {
+		http_req_destroy(&req);
+		http_conn_reject(conn, HTTP_RESP_BAD_REQUEST, sizeof(HTTP_RESP_BAD_REQUEST) - 1);
+		return -1;
+	}
+
+	// curl and others wait for this before sending a large body.
+	char *expect = http_headers_get(&req.headers, "Expect");
+	if (body_len > 0 && expect && strcasecmp(expect, "100-continue") == 0) {
+		static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		send(conn->fd, cont, sizeof(cont) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+
+	conn->stream = route;
+	conn->stream_state = state;
+	conn->stream_req = req;
+	conn->stream_left = body_len;
+	return 0;
+}
+
+// Hands over whatever body bytes arrived and drops them from the buffer;
+// only the head stays until the response is written.
+static void http_conn_stream_body(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	const HTTP_StreamRoute *route = conn->stream;
+	size_t avail = conn->in_len - conn->head_len;
+	size_t n = avail < conn->stream_left ? avail : conn->stream_left;
+	if (n > 0) {
+		uint8_t *body = conn->in + conn->head_len;
+		if (route->handler.data(conn->stream_state, body, n) != 0) {
+			http_conn_reject(conn, HTTP_RESP_BAD_REQUEST, sizeof(HTTP_RESP_BAD_REQUEST) - 1);
+			return;
+		}
+		memmove(body, body + n, avail - n);
+		conn->in_len -= n;
+		conn->in[conn->in_len] = '\0';
+		conn->stream_left -= n;
+		// Long uploads are fine as long as they keep moving.
+		http_conn_set_timeout(serv, conn, now, serv->limits.read_timeout_ms);
+	}
+	if (conn->stream_left > 0) return;
+
+	HTTP_Request req = conn->stream_req;
+	conn->stream_req = (HTTP_Request) {0};
+	conn->stream = NULL;
+	conn->req_len = conn->head_len;
+
+	conn->resp = http_resp_create();
+	route->handler.end(conn->stream_state, &req, &conn->resp);
+	http_conn_send_response(serv, conn, &req, now);
+	http_req_destroy(&req);
+}
+
+static void http_conn_process(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	if (conn->state == HTTP_CONN_H2) {
+		http_h2_process(serv, conn, now);
+		return;
+	}
+	if (conn->state == HTTP_CONN_WS) {
+		http_ws_process(serv, conn, now);
+		return;
+	}
+	if (conn->state == HTTP_CONN_SSE) {
+		// Subscribers have nothing more to say; reading only notices the close.
+		conn->in_len = 0;
+		return;
+	}
+
+	if (conn->head_len == 0) {
+		// HTTP/2 with prior knowledge: wait until the preface is decided.
+		size_t n = conn->in_len < HTTP_H2_PREFACE_LEN ? conn->in_len : HTTP_H2_PREFACE_LEN;
+		if (n > 0 && memcmp(conn->in, HTTP_H2_PREFACE, n) == 0) {
+			if (n < HTTP_H2_PREFACE_LEN) return;
+			http_h2_start(serv, conn);
+			if (conn->h2) http_h2_process(serv, conn, now);
+			return;
+		}
+
+		size_t head_len = http_find_head_end(conn->in, conn->in_len);
+		if (head_len == 0) {
+			if (conn->in_len >= serv->limits.max_header_bytes)
+				http_conn_reject(conn, HTTP_RESP_HEADER_FIELDS_TOO_LARGE, sizeof(HTTP_RESP_HEADER_FIELDS_TOO_LARGE) - 1);
+			return;
+		}
+		if (head_len > serv->limits.max_header_bytes) {
+			http_conn_reject(conn, HTTP_RESP_HEADER_FIELDS_TOO_LARGE, sizeof(HTTP_RESP_HEADER_FIELDS_TOO_LARGE) - 1);
+			return;
+		}
+
+		size_t body_len;
+		int framing = http_head_content_length(conn->in, head_len, &body_len);
+		if (framing == -2) {
+			http_conn_reject(conn, HTTP_RESP_NOT_IMPLEMENTED, sizeof(HTTP_RESP_NOT_IMPLEMENTED) - 1);
+			return;
+		}
+		if (framing < 0) {
+			http_conn_reject(conn, HTTP_RESP_BAD_REQUEST, sizeof(HTTP_RESP_BAD_REQUEST) - 1);
+			return;
+		}
+
+		// Streamed and proxied bodies never sit in the buffer, so only
+		// the routes that do buffer are held to max_body_bytes. They are
+		// matched on the raw request line so other requests are not
+		// parsed twice.
+		char path[1024];
+		bool raw_routes = serv->stream_routes_count || serv->proxy_routes_count;
+		bool has_path = raw_routes && http_head_path(conn->in, head_len, path, sizeof(path)) != SIZE_MAX;
+		const HTTP_StreamRoute *route = has_path ? http_stream_route(serv, path) : NULL;
+		HTTP_ProxyRoute *proxy = has_path && !route ? http_proxy_route(serv, path) : NULL;
+		if (!route && !proxy && body_len > serv->limits.max_body_bytes) {
+			http_conn_reject(conn, HTTP_RESP_PAYLOAD_TOO_LARGE, sizeof(HTTP_RESP_PAYLOAD_TOO_LARGE) - 1);
+			return;
+		}
+
+		conn->head_len = head_len;
+		conn->req_len = head_len + body_len;
+		if (proxy) {
+			http_proxy_start(serv, conn, proxy, body_len, now);
+			return;
+		}
+		if (route && http_conn_stream_begin(conn, route, body_len) < 0) return;
+	}
+
+	if (conn->stream) {
+		http_conn_stream_body(serv, conn, now);
+		return;
+	}
+
+	if (conn->in_len < conn->req_len) return;
+	http_conn_respond(serv, conn, now);
+}
+
+static void http_conn_read(HTTP_Server *serv, HTTP_Conn *conn, uint64_t now) {
+	for (;;) {
+		size_t limit = conn->head_len ? conn->req_len : serv->limits.max_header_bytes;
+		if (conn->stream) limit = conn->head_len + HTTP_SERVER_STREAM_CHUNK;
+		if (conn->state == HTTP_CONN_H2) limit = HTTP_H2_PREFACE_LEN + 2 * (HTTP_H2_FRAME_HEADER_SIZE + HTTP_H2_MAX_FRAME_SIZE);
+		if (conn->state == HTTP_CONN_WS) limit = 14 + serv->limits.max_body_bytes;
+		if (conn->in_len + 1 >= conn->in_cap) {
+			if (conn->in_len >= limit) break;
+			size_t cap = conn->in_cap * 2;
+			if (cap > limit + 1) cap = limit + 1;
+			uint8_t *in = (uint8_t *) realloc(conn->in, cap);
+			if (!in) { http_conn_close(conn); return; }
+			conn->in = in;
+			conn->in_cap = cap;
+		}
+
+		ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len - 1, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			http_conn_close(conn);
+			return;
+		}
+		if (n == 0) { http_conn_close(conn); return; }
+
+		if (conn->state == HTTP_CONN_IDLE && !http_conn_begin_request(serv, conn, now)) return;
+		conn->in_len += (size_t)n;
+		conn->in[conn->in_len] = '\0';
+
+		http_conn_process(serv, conn, now);
+		if (conn->state != HTTP_CONN_READING && conn->state != HTTP_CONN_H2 &&
+			conn->state != HTTP_CONN_WS && conn->state != HTTP_CONN_SSE) return;
+	}
+}
+
+static void http_conn_expire(void *ctx, HTTP_Timer *timer) {
+	UNUSED(ctx);
+	HTTP_Conn *conn = (HTTP_Conn *) ((char *) timer - offsetof(HTTP_Conn, timer));
+	if (conn->state == HTTP_CONN_CLOSED) return;
+	switch (conn->state) {
+		case HTTP_CONN_READING:
+			http_conn_reject(conn, HTTP_RESP_REQUEST_TIMEOUT, sizeof(HTTP_RESP_REQUEST_TIMEOUT) - 1);
+			break;
+		case HTTP_CONN_PROXY:
+			if (conn->proxy->resp_started) http_conn_close(conn);
+			else http_conn_reject(conn, HTTP_RESP_GATEWAY_TIMEOUT, sizeof(HTTP_RESP_GATEWAY_TIMEOUT) - 1);
+			break;
+		default:
+			http_conn_close(conn);
+			break;
+	}
+}
+
+static void http_server_accept(HTTP_Server *serv, HTTP_Listener *l, uint64_t now) {
 	for (;;) {
-		int c = accept(serv->socket, NULL, NULL);
+		HTTP_Addr peer;
+		socklen_t peer_len = sizeof(peer);
+		int c = accept(l->socket, &peer.sa, &peer_len);
 		if (c < 0) {
 			if (errno == EINTR) continue;
-			perror("accept"); break;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+			return;
 		}
 
-		uint8_t req_buf[1024 * 16];
-		ssize_t rn = recv(c, req_buf, sizeof(req_buf) - 1, 0);
-		if (rn <= 0) {
+		// Shedding with a canned 503 keeps latency bounded for the
+		// connections we already have instead of queuing new ones.
+		if (serv->conns_count >= serv->limits.max_connections) {
+			send(c, HTTP_RESP_SERVICE_UNAVAILABLE, sizeof(HTTP_RESP_SERVICE_UNAVAILABLE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
 			close(c);
+			serv->shed_count++;
 			continue;
 		}
 
-		HTTP_Error err;
-		HTTP_Response resp = http_resp_create();
-		HTTP_Request req = http_req_parse(req_buf, &err);
+		if (serv->rate_limiter && !http_rate_limiter_check(serv->rate_limiter, &peer, now, false)) {
+			send(c, HTTP_RESP_TOO_MANY_REQUESTS, sizeof(HTTP_RESP_TOO_MANY_REQUESTS) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+			close(c);
+			continue;
+		}
 
-		if (err) {
-			http_resp_set_status_line(&resp, STATUS_BAD_REQUEST, "Bad Request");
-			http_resp_add_header(&resp, "Connection", "close");
-			char *resp_str = http_resp_header_to_str(&resp);
-			write(c, resp_str, strlen(resp_str));
-		} else {
-			bool handled = false;
-			for (size_t i = 0; i < serv->hfs_count; i++) {
-				const char *t = serv->targets[i];
-				size_t tlen = strlen(t);
-				if (strncmp(t, req.target, tlen) == 0) {
-					if (tlen == 1 && strlen(req.target) != 1) continue;
+		if (serv->conns_count == serv->conns_cap) {
+			size_t newcap = serv->conns_cap ? serv->conns_cap * 2 : 64;
+			HTTP_Conn **nc = (HTTP_Conn **) realloc(serv->conns, sizeof(*nc) * newcap);
+			if (!nc) { close(c); return; }
+			serv->conns = nc;
+			serv->conns_cap = newcap;
+		}
+
+		HTTP_Conn *conn = (HTTP_Conn *) calloc(1, sizeof *conn);
+		if (conn) {
+			conn->in = (uint8_t *) malloc(4096);
+			conn->out = http_sb_create(256);
+		}
+		if (!conn || !conn->in || !conn->out.str || http_set_nonblocking(c) < 0) {
+			if (conn) {
+				free(conn->in);
+				http_sb_destroy(&conn->out);
+			}
+			free(conn);
+			close(c);
+			continue;
+		}
 
-					serv->hfs[i](serv->hfs_ctx[i], &req, &resp);
+		conn->fd = c;
+		conn->peer = peer;
+		conn->peer_len = peer_len;
+		HTTP_PROBE2(accept, c, peer.sa.sa_family);
+		http_trace_instant("accept", c);
+		conn->in_cap = 4096;
+		conn->in[0] = '\0';
+		conn->state = HTTP_CONN_IDLE;
+		http_conn_set_timeout(serv, conn, now, serv->limits.idle_timeout_ms);
+		serv->conns[serv->conns_count++] = conn;
+	}
+}
 
-					char *resp_str = http_resp_header_to_str(&resp);
-					write(c, resp_str, strlen(resp_str));
+static int http_server_poll_timeout(HTTP_Server *serv, uint64_t now) {
+	int64_t next = http_timer_wheel_next(&serv->timers);
+	if (serv->tick) {
+		int64_t tick = serv->tick_next > now ? (int64_t)(serv->tick_next - now) : 0;
+		if (next < 0 || tick < next) next = tick;
+	}
+	return next > INT32_MAX ? INT32_MAX : (int)next;
+}
 
-					write(c, resp.body, resp.body_len);
-					handled = true;
-					break;
+static void http_listener_open(HTTP_Listener *l, int backlog) {
+	int family = l->addr.sa.sa_family;
+	l->socket = socket(family, SOCK_STREAM, 0);
+	if (l->socket < 0) { perror("socket"); exit(1); }
+
+	int yes = 1, no = 0;
+	if (family == AF_UNIX) {
+		struct stat st;
+		const char *path = l->addr.un.sun_path;
+		// A socket file left by an earlier run is replaced; one a live
+		// server still accepts on is not, and bind reports it in use.
+		if (path[0] != '\0' && stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (probe >= 0 && connect(probe, &l->addr.sa, l->addr_len) < 0 && errno == ECONNREFUSED) unlink(path);
+			if (probe >= 0) close(probe);
+		}
+	} else if (setsockopt(l->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+		perror("setsockopt");
+	}
+
+	if (family == AF_INET6 && memcmp(&l->addr.in6.sin6_addr, &in6addr_any, sizeof(in6addr_any)) == 0) {
+		if (setsockopt(l->socket, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) < 0) perror("setsockopt");
+	}
+
+	if (bind(l->socket, &l->addr.sa, l->addr_len) < 0) {
+		perror("bind"); exit(1);
+	}
+
+	if (listen(l->socket, backlog) < 0) {
+		perror("listen"); exit(1);
+	}
+
+	if (http_set_nonblocking(l->socket) < 0) {
+		perror("fcntl"); exit(1);
+	}
+}
+
+void http_server_run(HTTP_Server *serv) {
+	if (serv->listeners_count == 0) {
+		fprintf(stderr, "http_server_run: no listeners\n"); exit(1);
+	}
+
+	for (size_t i = 0; i < serv->listeners_count; i++)
+		http_listener_open(&serv->listeners[i], serv->limits.backlog);
+
+	http_timer_wheel_init(&serv->timers, http_now_ms());
+
+	size_t nl = serv->listeners_count;
+	for (;;) {
+		size_t nproxy = 0;
+		for (size_t i = 0; i < serv->conns_count; i++)
+			if (serv->conns[i]->state == HTTP_CONN_PROXY && serv->conns[i]->proxy->up_events) nproxy++;
+		size_t npfds = serv->conns_count + nl + nproxy;
+		if (npfds > serv->pfds_cap) {
+			size_t newcap = serv->pfds_cap ? serv->pfds_cap : 64;
+			while (newcap < npfds) newcap *= 2;
+			struct pollfd *np = (struct pollfd *) realloc(serv->pfds, sizeof(*np) * newcap);
+			if (!np) { perror("realloc pfds"); exit(1); }
+			serv->pfds = np;
+			serv->pfds_cap = newcap;
+		}
+
+		for (size_t i = 0; i < nl; i++)
+			serv->pfds[i] = (struct pollfd) { .fd = serv->listeners[i].socket, .events = POLLIN };
+		for (size_t i = 0; i < serv->conns_count; i++) {
+			HTTP_Conn *conn = serv->conns[i];
+			short events = conn->state == HTTP_CONN_WRITING ? POLLOUT : POLLIN;
+			if ((conn->state == HTTP_CONN_H2 || conn->state == HTTP_CONN_WS) && conn->out.cnt > conn->out_off) events |= POLLOUT;
+			if (conn->state == HTTP_CONN_H2 && conn->h2->in_paused) events = POLLOUT;
+			if (conn->state == HTTP_CONN_WS && conn->ws_closing) events |= POLLOUT;
+			if (conn->state == HTTP_CONN_SSE && (conn->sse_count > 0 || conn->out.cnt > conn->out_off)) events |= POLLOUT;
+			if (conn->state == HTTP_CONN_PROXY) {
+				// The upstream socket only takes part while it is waited on,
+				// so a hung-up upstream cannot spin the loop meanwhile.
+				HTTP_Proxy *p = conn->proxy;
+				events = p->client_events;
+				p->polled = p->up_events != 0;
+				if (p->polled) {
+					p->pfd = npfds - nproxy--;
+					serv->pfds[p->pfd] = (struct pollfd) { .fd = p->fd, .events = p->up_events };
 				}
 			}
-			if (!handled) {
-				http_resp_set_status_line(&resp, STATUS_NOT_FOUND, "Not Found");
-				http_resp_add_header(&resp, "Connection", "close");
+			serv->pfds[nl + i] = (struct pollfd) { .fd = conn->fd, .events = events };
+		}
 
-				char *not_found_msg = strdup("404 Not Found");
-				http_resp_set_body(&resp, (uint8_t *) not_found_msg, strlen(not_found_msg));
+		int n = poll(serv->pfds, npfds, http_server_poll_timeout(serv, http_now_ms()));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("poll"); break;
+		}
 
-				char *resp_str = http_resp_header_to_str(&resp);
-				write(c, resp_str, strlen(resp_str));
-				write(c, resp.body, resp.body_len);
+		uint64_t now = http_now_ms();
+		size_t count = serv->conns_count;
+		for (size_t i = 0; i < count; i++) {
+			HTTP_Conn *conn = serv->conns[i];
+			short re = serv->pfds[nl + i].revents;
+			if (re & (POLLERR | POLLNVAL)) {
+				http_conn_close(conn);
+			} else if (conn->state == HTTP_CONN_WRITING) {
+				if (re & (POLLOUT | POLLHUP)) http_conn_write(serv, conn, now);
+			} else if (conn->state == HTTP_CONN_H2) {
+				if (re & POLLOUT) http_h2_write(serv, conn, now);
+				if (conn->state == HTTP_CONN_H2 && conn->h2->in_paused && conn->out.cnt - conn->out_off < HTTP_H2_OUT_HIGH_WATER)
+					http_h2_process(serv, conn, now);
+				if (conn->state == HTTP_CONN_H2 && (re & (POLLIN | POLLHUP))) http_conn_read(serv, conn, now);
+			} else if (conn->state == HTTP_CONN_WS) {
+				if (re & POLLOUT) http_ws_write(serv, conn, now);
+				if (conn->state == HTTP_CONN_WS && (re & (POLLIN | POLLHUP))) http_conn_read(serv, conn, now);
+			} else if (conn->state == HTTP_CONN_SSE) {
+				if (re & POLLOUT) http_sse_write(serv, conn, now);
+				if (conn->state == HTTP_CONN_SSE && (re & (POLLIN | POLLHUP))) http_conn_read(serv, conn, now);
+			} else if (conn->state == HTTP_CONN_PROXY) {
+				short ure = conn->proxy->polled ? serv->pfds[conn->proxy->pfd].revents : 0;
+				if (re & POLLHUP) http_conn_close(conn);
+				else if (re || ure) http_proxy_step(serv, conn, now);
+			} else if (re & (POLLIN | POLLHUP)) {
+				http_conn_read(serv, conn, now);
 			}
 		}
 
-		http_resp_destroy(&resp);
-		http_req_destroy(&req);
-		close(c);
+		http_timer_wheel_advance(&serv->timers, now, http_conn_expire, serv);
+
+		if (serv->tick && now >= serv->tick_next) {
+			serv->tick_next = now + serv->tick_interval_ms;
+			serv->tick(serv->tick_ctx);
+		}
+
+		for (size_t i = 0; i < nl; i++)
+			if (serv->pfds[i].revents & POLLIN) http_server_accept(serv, &serv->listeners[i], now);
+
+		if (serv->capture) http_capture_flush(serv->capture);
+
+		for (size_t i = 0; i < serv->conns_count;) {
+			if (serv->conns[i]->state == HTTP_CONN_CLOSED) {
+				http_timer_cancel(&serv->timers, &serv->conns[i]->timer);
+				http_conn_destroy(serv->conns[i]);
+				serv->conns[i] = serv->conns[--serv->conns_count];
+			} else {
+				i++;
+			}
+		}
 	}
 }
 
@@ -939,35 +6324,73 @@ void http_sb_ensure_capacity(HTTP_StringBuilder *sb, size_t extra) {
 }
 
 void http_sb_append_str(HTTP_StringBuilder *sb, const char *s) {
-	size_t len = strlen(s);
+	http_sb_append_strn(sb, s, strlen(s));
+}
+
+void http_sb_append_strn(HTTP_StringBuilder *sb, const char *s, size_t len) {
 	http_sb_ensure_capacity(sb, len);
 	memcpy(sb->str + sb->cnt, s, len);
 	sb->cnt += len;
 	sb->str[sb->cnt] = '\0';
 }
 
+// Formats straight into the spare capacity and only measures separately
+// when that turns out to be too small.
 void http_sb_append_strf(HTTP_StringBuilder *sb, const char *fmt, ...) {
 	va_list args, args_copy;
 	va_start(args, fmt);
 
 	va_copy(args_copy, args);
 
-	int len = vsnprintf(NULL, 0, fmt, args);
+	int len = vsnprintf(sb->str + sb->cnt, sb->cap - sb->cnt, fmt, args);
 	va_end(args);
 
 	if (len < 0) {
+		sb->str[sb->cnt] = '\0';
 		va_end(args_copy);
 		return;
 	}
 
-	http_sb_ensure_capacity(sb, (size_t)len);
-
-	vsnprintf(sb->str + sb->cnt, sb->cap - sb->cnt, fmt, args_copy);
+	if ((size_t)len >= sb->cap - sb->cnt) {
+		http_sb_ensure_capacity(sb, (size_t)len);
+		vsnprintf(sb->str + sb->cnt, sb->cap - sb->cnt, fmt, args_copy);
+	}
 	sb->cnt += (size_t)len;
 
 	va_end(args_copy);
 }
 
+void http_sb_append_uint(HTTP_StringBuilder *sb, uint64_t v) {
+	http_sb_ensure_capacity(sb, 20);
+	sb->cnt += http_fmt_uint(sb->str + sb->cnt, v);
+	sb->str[sb->cnt] = '\0';
+}
+
+void http_sb_append_status(HTTP_StringBuilder *sb, uint16_t code) {
+	if (code < 100 || code > 999) {
+		http_sb_append_uint(sb, code);
+		return;
+	}
+	http_sb_ensure_capacity(sb, 3);
+	sb->str[sb->cnt++] = (char)('0' + code / 100);
+	sb->str[sb->cnt++] = (char)('0' + code / 10 % 10);
+	sb->str[sb->cnt++] = (char)('0' + code % 10);
+	sb->str[sb->cnt] = '\0';
+}
+
+// Appends "key: value\r\n" with a single capacity check.
+void http_sb_append_header(HTTP_StringBuilder *sb, const char *key, const char *value) {
+	size_t klen = strlen(key), vlen = strlen(value);
+	http_sb_ensure_capacity(sb, klen + vlen + 4);
+	char *p = sb->str + sb->cnt;
+	memcpy(p, key, klen); p += klen;
+	*p++ = ':'; *p++ = ' ';
+	memcpy(p, value, vlen); p += vlen;
+	*p++ = '\r'; *p++ = '\n';
+	*p = '\0';
+	sb->cnt = (size_t)(p - sb->str);
+}
+
 void http_sb_append_char(HTTP_StringBuilder *sb, char ch) {
 	http_sb_ensure_capacity(sb, 1);
 	sb->str[sb->cnt++] = ch;
@@ -0,0 +1,243 @@
+// Checks the per-route response cache: hits, TTL expiry, what is not
+// stored, HEAD answered from the cache, and eviction at
+// HTTP_CACHE_MAX_BYTES.
+//
+//   cache_test
+//       Runs a server on an abstract Unix socket in a second thread and
+//       counts how often its handlers run. Exits non-zero if any check
+//       fails.
+
+#include <signal.h>
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+#define LISTEN_ADDR "unix:@http-cache-test"
+#define SHORT_TTL_MS 50
+// Bodies this big fit HTTP_CACHE_MAX_RESPONSE_BYTES, and
+// HTTP_CACHE_MAX_BYTES holds FULL_COUNT of them with their heads and keys.
+#define BIG_BODY 1000000
+#define FULL_COUNT (HTTP_CACHE_MAX_BYTES / (BIG_BODY + 1024))
+
+static HTTP_Server serv;
+static HTTP_Cache *cache;
+static uint64_t calls;
+
+// Answers with the call count, padded to ?size bytes. ?cc sets
+// Cache-Control and ?cookie adds a Set-Cookie.
+static void handler(void *ctx, HTTP_Request *req, HTTP_Response *resp) {
+	UNUSED(ctx);
+	uint64_t n = __atomic_add_fetch(&calls, 1, __ATOMIC_SEQ_CST);
+	const char *size = http_req_query(req, "size");
+	const char *cc = http_req_query(req, "cc");
+	size_t len = size ? (size_t) strtoul(size, NULL, 10) : 32;
+
+	char *body = (char *) malloc(len + 1);
+	size_t used = (size_t) snprintf(body, len + 1, "call %llu", (unsigned long long) n);
+	if (used < len) memset(body + used, 'x', len - used);
+
+	http_resp_set_status_line(resp, STATUS_OK, "OK");
+	if (cc) http_resp_add_header(resp, "Cache-Control", cc);
+	if (http_req_query(req, "cookie")) http_resp_add_header(resp, "Set-Cookie", "a=1");
+	http_resp_set_body(resp, (uint8_t *) body, len);
+}
+
+static void *serve(void *arg) {
+	UNUSED(arg);
+	http_server_run(&serv);
+	return NULL;
+}
+
+static int server_connect(void) {
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	const char *name = strchr(LISTEN_ADDR, '@') + 1;
+	memcpy(a.sun_path + 1, name, strlen(name));
+	socklen_t alen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name));
+
+	// The server thread may not be listening yet.
+	for (int tries = 0; tries < 100; tries++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *) &a, alen) == 0) {
+			struct timeval tv = { .tv_sec = 5 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			return fd;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	return -1;
+}
+
+// Sends one request on fd and reads its response. Returns the status,
+// 0 if no complete response came. The body is left in *body, which the
+// caller frees; HEAD responses must have none.
+static unsigned fetch(int fd, const char *method, const char *target, const char *headers, HTTP_StringBuilder *body) {
+	char req[512];
+	int n = snprintf(req, sizeof(req), "%s %s HTTP/1.1\r\nHost: test\r\n%s\r\n", method, target, headers ? headers : "");
+	send(fd, req, (size_t) n, MSG_NOSIGNAL);
+
+	HTTP_StringBuilder in = http_sb_create(4096);
+	size_t head_len, body_len = 0;
+	unsigned status = 0;
+	while ((head_len = http_find_head_end((const uint8_t *) in.str, in.cnt)) == 0) {
+		char buf[4096];
+		ssize_t r = recv(fd, buf, sizeof(buf), 0);
+		if (r <= 0) goto done;
+		http_sb_append_strn(&in, buf, (size_t) r);
+	}
+	if (strcmp(method, METHOD_HEAD) != 0 && http_head_content_length((const uint8_t *) in.str, head_len, &body_len) < 0) goto done;
+	while (in.cnt < head_len + body_len) {
+		char buf[65536];
+		ssize_t r = recv(fd, buf, sizeof(buf), 0);
+		if (r <= 0) goto done;
+		http_sb_append_strn(&in, buf, (size_t) r);
+	}
+	// Anything more would be a body sent where none belongs.
+	CHECK(in.cnt == head_len + body_len, "%s %s: %zu bytes past the response", method, target, in.cnt - head_len - body_len);
+	sscanf(in.str, "HTTP/1.1 %u", &status);
+	http_sb_reset(body);
+	http_sb_append_strn(body, in.str + head_len, body_len);
+done:
+	http_sb_destroy(&in);
+	return status;
+}
+
+// Requests target on a connection of its own and reports whether the
+// handler ran for it.
+static bool ran(const char *method, const char *target, const char *headers) {
+	uint64_t before = __atomic_load_n(&calls, __ATOMIC_SEQ_CST);
+	int fd = server_connect();
+	HTTP_StringBuilder body = http_sb_create(64);
+	unsigned status = fd >= 0 ? fetch(fd, method, target, headers, &body) : 0;
+	CHECK(status == 200, "%s %s: status %u", method, target, status);
+	http_sb_destroy(&body);
+	if (fd >= 0) close(fd);
+	return __atomic_load_n(&calls, __ATOMIC_SEQ_CST) != before;
+}
+
+typedef struct {
+	const char *method;
+	const char *target;
+	const char *headers;
+	bool runs; // the handler runs rather than the cache answering
+} Step;
+
+static const Step steps[] = {
+	{ "GET", "/c", NULL, true },
+	{ "GET", "/c", NULL, false },
+	{ "GET", "/c?", NULL, true }, // keyed by the target as sent
+	{ "HEAD", "/c", NULL, true }, // and by method
+	{ "HEAD", "/c", NULL, false },
+	{ "GET", "/c/sub", NULL, true },
+	{ "GET", "/c/sub", NULL, false },
+	{ "GET", "/c?cc=no-store", NULL, true },
+	{ "GET", "/c?cc=no-store", NULL, true },
+	{ "GET", "/c?cc=No-Cache", NULL, true },
+	{ "GET", "/c?cc=No-Cache", NULL, true },
+	{ "GET", "/c?cc=max-age%3D60,%20PRIVATE%3D%22x%22", NULL, true },
+	{ "GET", "/c?cc=max-age%3D60,%20PRIVATE%3D%22x%22", NULL, true },
+	{ "GET", "/c?cc=public,%20max-age%3D60", NULL, true },
+	{ "GET", "/c?cc=public,%20max-age%3D60", NULL, false },
+	{ "GET", "/c?cookie", NULL, true },
+	{ "GET", "/c?cookie", NULL, true },
+	{ "POST", "/c", "Content-Length: 0\r\n", true },
+	{ "POST", "/c", "Content-Length: 0\r\n", true },
+	{ "GET", "/vary", "Accept-Language: en\r\n", true },
+	{ "GET", "/vary", "Accept-Language: en\r\n", false },
+	{ "GET", "/vary", "Accept-Language: de\r\n", true },
+	{ "GET", "/vary", NULL, true },
+	{ "GET", "/vary", "Accept-Language: de\r\n", false },
+};
+
+static void test_steps(void) {
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		const Step *s = &steps[i];
+		bool r = ran(s->method, s->target, s->headers);
+		CHECK(r == s->runs, "step %zu, %s %s: the handler %s", i, s->method, s->target, r ? "ran" : "did not run");
+	}
+}
+
+static void test_ttl(void) {
+	CHECK(ran("GET", "/short", NULL), "first request was a hit");
+	CHECK(!ran("GET", "/short", NULL), "fresh entry was not used");
+	usleep((SHORT_TTL_MS + 20) * 1000);
+	CHECK(ran("GET", "/short", NULL), "entry was used past its TTL");
+	CHECK(!ran("GET", "/short", NULL), "refreshed entry was not used");
+}
+
+// A HEAD hit sends the stored head alone, so the next request on the
+// connection is read from the right place.
+static void test_head(void) {
+	int fd = server_connect();
+	HTTP_StringBuilder body = http_sb_create(64);
+	CHECK(fetch(fd, "GET", "/c?head", NULL, &body) == 200 && body.cnt == 32, "GET for HEAD test failed");
+	CHECK(fetch(fd, "HEAD", "/c?head", NULL, &body) == 200, "HEAD miss failed");
+	CHECK(fetch(fd, "HEAD", "/c?head", NULL, &body) == 200, "HEAD hit failed");
+	CHECK(fetch(fd, "GET", "/c?head", NULL, &body) == 200 && body.cnt == 32, "GET after HEAD hit failed");
+	http_sb_destroy(&body);
+	close(fd);
+}
+
+static void test_eviction(void) {
+	char target[64];
+	for (size_t i = 0; i <= FULL_COUNT; i++) {
+		snprintf(target, sizeof(target), "/big?size=%d&k=%zu", BIG_BODY, i);
+		CHECK(ran("GET", target, NULL), "%s was a hit", target);
+	}
+	// Reading the counters while the server idles between requests.
+	CHECK(cache->bytes <= HTTP_CACHE_MAX_BYTES, "cache holds %zu bytes", cache->bytes);
+	CHECK(cache->count == FULL_COUNT, "cache holds %zu entries, not %d", cache->count, (int) FULL_COUNT);
+
+	// The last store pushed out the first; storing that again pushes out
+	// the second, and everything newer stays.
+	snprintf(target, sizeof(target), "/big?size=%d&k=0", BIG_BODY);
+	CHECK(ran("GET", target, NULL), "oldest entry survived a full cache");
+	snprintf(target, sizeof(target), "/big?size=%d&k=2", BIG_BODY);
+	CHECK(!ran("GET", target, NULL), "third oldest entry was evicted too");
+	snprintf(target, sizeof(target), "/big?size=%d&k=1", BIG_BODY);
+	CHECK(ran("GET", target, NULL), "second oldest entry survived");
+	snprintf(target, sizeof(target), "/big?size=%d&k=%d", BIG_BODY, (int) FULL_COUNT);
+	CHECK(!ran("GET", target, NULL), "newest entry was evicted");
+	CHECK(cache->bytes <= HTTP_CACHE_MAX_BYTES, "cache holds %zu bytes", cache->bytes);
+
+	// A response over HTTP_CACHE_MAX_RESPONSE_BYTES is never stored.
+	snprintf(target, sizeof(target), "/big?size=%d", HTTP_CACHE_MAX_RESPONSE_BYTES + 1);
+	CHECK(ran("GET", target, NULL), "first oversized request was a hit");
+	CHECK(ran("GET", target, NULL), "oversized response was cached");
+}
+
+int main(void) {
+	signal(SIGPIPE, SIG_IGN);
+
+	serv = http_server_create_at(LISTEN_ADDR);
+	http_server_handle_cached(&serv, "/c", handler, NULL, 60000, NULL);
+	http_server_handle_cached(&serv, "/short", handler, NULL, SHORT_TTL_MS, NULL);
+	http_server_handle_cached(&serv, "/vary", handler, NULL, 60000, "Accept-Language");
+	cache = http_server_handle_cached(&serv, "/big", handler, NULL, 60000, NULL);
+	pthread_t t;
+	pthread_create(&t, NULL, serve, NULL);
+	pthread_detach(t);
+
+	test_steps();
+	test_ttl();
+	test_head();
+	test_eviction();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all cache checks passed\n");
+	return 0;
+}
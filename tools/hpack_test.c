@@ -0,0 +1,173 @@
+// Checks the HPACK decoder: the RFC 7541 examples, dynamic table
+// eviction and malformed header blocks.
+//
+//   hpack_test
+//       Exits non-zero if any check fails.
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+// Decodes a block given in hex (blanks ignored) and renders the headers
+// as "name: value\n" lines into list. Returns what the decoder returned.
+static int decode(HTTP_HpackTable *t, const char *hex, size_t max_list, HTTP_StringBuilder *list) {
+	uint8_t buf[256];
+	size_t len = 0;
+	for (const char *p = hex; *p; p++) {
+		if (*p == ' ') continue;
+		buf[len++] = (uint8_t)(http_hex_digit(p[0]) << 4 | http_hex_digit(p[1]));
+		p++;
+	}
+
+	HTTP_Headers hh = http_headers_create(8);
+	int rc = http_hpack_decode(t, buf, len, &hh, max_list);
+	http_sb_reset(list);
+	for (size_t i = 0; i < hh.count; i++) {
+		http_sb_append_str(list, hh.headers[i].key);
+		http_sb_append_str(list, ": ");
+		http_sb_append_str(list, hh.headers[i].value);
+		http_sb_append_char(list, '\n');
+	}
+	http_sb_append_char(list, '\0');
+	http_headers_destroy(&hh);
+	return rc;
+}
+
+typedef struct {
+	const char *hex;
+	const char *want; // NULL: the block must be refused
+	size_t table_size; // of the dynamic table afterwards
+	size_t table_count;
+} Block;
+
+// Each run shares one decoder table across its blocks, as the blocks of
+// one connection do.
+static void run(const char *name, const Block *blocks, size_t n) {
+	HTTP_HpackTable t = { .max_size = HTTP_HPACK_TABLE_SIZE };
+	HTTP_StringBuilder list = http_sb_create(256);
+	for (size_t i = 0; i < n; i++) {
+		const Block *b = &blocks[i];
+		int rc = decode(&t, b->hex, 16384, &list);
+		if (!b->want) {
+			CHECK(rc < 0, "%s block %zu was accepted", name, i);
+			continue;
+		}
+		CHECK(rc == 0, "%s block %zu was refused", name, i);
+		CHECK(strcmp(list.str, b->want) == 0, "%s block %zu decoded to\n%s", name, i, list.str);
+		CHECK(t.size == b->table_size && t.count == b->table_count,
+			"%s block %zu left the table at %zu bytes in %zu entries, not %zu in %zu",
+			name, i, t.size, t.count, b->table_size, b->table_count);
+	}
+	http_sb_destroy(&list);
+	http_hpack_table_destroy(&t);
+}
+
+// RFC 7541 C.3: requests without Huffman coding.
+static const Block plain[] = {
+	{ "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57, 1 },
+	{ "8286 84be 5808 6e6f 2d63 6163 6865",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110, 2 },
+	{ "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+		":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164, 3 },
+};
+
+// RFC 7541 C.4: the same requests with Huffman coding.
+static const Block huffman[] = {
+	{ "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57, 1 },
+	{ "8286 84be 5886 a8eb 1064 9cbf",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110, 2 },
+	{ "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+		":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164, 3 },
+};
+
+// Entries of 40 bytes ("aaaa: 1111" and so on) in a table shrunk to 100:
+// the third insert evicts the oldest, and a size update to 0 empties it.
+static const Block eviction[] = {
+	{ "3f45 4004 6161 6161 0431 3131 31", "aaaa: 1111\n", 40, 1 },
+	{ "4004 6262 6262 0432 3232 32", "bbbb: 2222\n", 80, 2 },
+	{ "4004 6363 6363 0433 3333 33 be bf", "cccc: 3333\ncccc: 3333\nbbbb: 2222\n", 80, 2 },
+	{ "c0", NULL, 0, 0 }, // "aaaa" was evicted
+	{ "20", "", 0, 0 },
+	{ "be", NULL, 0, 0 },
+	{ "3fe2 1f", NULL, 0, 0 }, // 4097 is above HTTP_HPACK_TABLE_SIZE
+};
+
+static const Block malformed[] = {
+	{ "80", NULL, 0, 0 }, // index 0
+	{ "be", NULL, 0, 0 }, // dynamic index with an empty table
+	{ "ff", NULL, 0, 0 }, // integer cut off after its prefix
+	{ "ff80", NULL, 0, 0 }, // integer cut off in its continuation
+	{ "ffff ffff ffff 7f", NULL, 0, 0 }, // integer past 28 bits
+	{ "400a 6161", NULL, 0, 0 }, // name longer than the block
+	{ "4001 6104 6262", NULL, 0, 0 }, // value longer than the block
+	{ "4001", NULL, 0, 0 }, // no value at all
+	{ "7f00 0161", NULL, 0, 0 }, // name index 63 with an empty table
+	{ "0081 1801 61", NULL, 0, 0 }, // Huffman padding of zeros
+	{ "0081 ff01 61", NULL, 0, 0 }, // 8 bits of padding
+	{ "0084 ffff ffff 0161", NULL, 0, 0 }, // EOS inside a string
+	{ "0081 1f01 61", "a: a\n", 0, 0 }, // correct padding
+	{ "0f2f 0161", NULL, 0, 0 }, // name index 62 without indexing, empty table
+};
+
+static void test_max_list(void) {
+	HTTP_HpackTable t = { .max_size = HTTP_HPACK_TABLE_SIZE };
+	HTTP_StringBuilder list = http_sb_create(64);
+	// :method: GET is 7 + 3 + 32 = 42 bytes towards the list size.
+	CHECK(decode(&t, "8282", 84, &list) == 0, "list of 84 bytes refused at 84");
+	CHECK(decode(&t, "8282 82", 84, &list) < 0, "list of 126 bytes accepted at 84");
+	http_sb_destroy(&list);
+	http_hpack_table_destroy(&t);
+}
+
+// Whatever the encoder writes, the decoder reads back unchanged.
+static void test_round_trip(void) {
+	static const char *pairs[][2] = {
+		{ ":status", "200" }, { ":status", "204" }, { "content-type", "text/plain" },
+		{ "x-long", "0123456789012345678901234567890123456789012345678901234567890123456789"
+			"0123456789012345678901234567890123456789012345678901234567890123456789" },
+		{ "x-empty", "" },
+	};
+	HTTP_StringBuilder sb = http_sb_create(256);
+	for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) http_hpack_encode(&sb, pairs[i][0], pairs[i][1]);
+
+	HTTP_HpackTable t = { .max_size = HTTP_HPACK_TABLE_SIZE };
+	HTTP_Headers hh = http_headers_create(8);
+	int rc = http_hpack_decode(&t, (const uint8_t *) sb.str, sb.cnt, &hh, 16384);
+	CHECK(rc == 0 && hh.count == sizeof(pairs) / sizeof(pairs[0]), "encoded block did not decode");
+	for (size_t i = 0; rc == 0 && i < hh.count; i++)
+		CHECK(strcmp(hh.headers[i].key, pairs[i][0]) == 0 && strcmp(hh.headers[i].value, pairs[i][1]) == 0,
+			"header %zu came back as %s: %s", i, hh.headers[i].key, hh.headers[i].value);
+	CHECK(t.count == 0, "stateless encoder added to the decoder's table");
+
+	http_headers_destroy(&hh);
+	http_hpack_table_destroy(&t);
+	http_sb_destroy(&sb);
+}
+
+int main(void) {
+	run("plain", plain, sizeof(plain) / sizeof(plain[0]));
+	run("huffman", huffman, sizeof(huffman) / sizeof(huffman[0]));
+	run("eviction", eviction, sizeof(eviction) / sizeof(eviction[0]));
+	for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) run("malformed", &malformed[i], 1);
+	test_max_list();
+	test_round_trip();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all HPACK checks passed\n");
+	return 0;
+}
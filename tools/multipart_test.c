@@ -0,0 +1,198 @@
+// Checks the streaming multipart/form-data parser.
+//
+//   multipart_test
+//       Feeds every body whole, split in two at each offset and one byte
+//       at a time, and expects the same parts each way. Exits non-zero
+//       if any check fails.
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+#define CT "multipart/form-data; boundary=XyZ"
+
+typedef enum {
+	OK,        // parsed to the closing delimiter
+	TRUNCATED, // no feed failed, but the closing delimiter never came
+	INVALID,   // a feed failed
+} Outcome;
+
+typedef struct {
+	const char *name;
+	const char *content_type;
+	const char *body;
+	Outcome outcome;
+	// "[" and "]" around each part, "name=value;" per header, then the
+	// data. Only checked for bodies that parse.
+	const char *want;
+	size_t body_len, want_len; // 0: strlen
+} Case;
+
+#define BINARY_BODY "--XyZ\r\n\r\n\x00\xff\r\x00\n\r\n--XyZ--"
+#define BINARY_DATA "[\x00\xff\r\x00\n]"
+
+static const Case cases[] = {
+	{ "two parts", CT,
+		"--XyZ\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\nhello\r\n"
+		"--XyZ\r\nContent-Disposition: form-data; name=\"b\"; filename=\"b.txt\"\r\nContent-Type: text/plain\r\n\r\n"
+		"line1\r\nline2\r\n--XyZ--\r\n", OK,
+		"[Content-Disposition=form-data; name=\"a\";hello]"
+		"[Content-Disposition=form-data; name=\"b\"; filename=\"b.txt\";Content-Type=text/plain;line1\r\nline2]" },
+	{ "preamble and epilogue", CT,
+		"ignored\r\n--XyZ\r\nA: 1\r\n\r\nx\r\n--XyZ--\r\nalso --XyZ ignored", OK, "[A=1;x]" },
+	{ "delimiter look-alikes", CT,
+		"--XyZ\r\nA: 1\r\n\r\n\r\n--XyY\r\n--Xy--XyZ\r-\r\n--X\n--XyZ\r\n\r\n--XyZ--", OK,
+		"[A=1;\r\n--XyY\r\n--Xy--XyZ\r-\r\n--X\n--XyZ\r\n]" },
+	{ "repeated prefix", CT,
+		"--XyZ\r\n\r\n\r\n\r\n\r\n--\r\n--X\r\n--XyZ--", OK, "[\r\n\r\n\r\n--\r\n--X]" },
+	{ "empty part", CT, "--XyZ\r\nA: 1\r\n\r\n\r\n--XyZ--", OK, "[A=1;]" },
+	{ "no headers", CT, "--XyZ\r\n\r\ndata\r\n--XyZ--", OK, "[data]" },
+	{ "transport padding", CT, "--XyZ \t\r\nA: 1\r\n\r\nx\r\n--XyZ  --", OK, "[A=1;x]" },
+	{ "quoted boundary", "multipart/form-data; boundary=\"a:b=c\"; charset=utf-8",
+		"--a:b=c\r\nA:\t1\r\n\r\nx\r\n--a:b=c--", OK, "[A=1;x]" },
+	{ "binary data", CT, BINARY_BODY, OK, BINARY_DATA, sizeof(BINARY_BODY) - 1, sizeof(BINARY_DATA) - 1 },
+	{ "no closing delimiter", CT, "--XyZ\r\nA: 1\r\n\r\nx\r\n--XyZ\r\n", TRUNCATED, NULL },
+	{ "cut off in data", CT, "--XyZ\r\nA: 1\r\n\r\nxx\r\n--Xy", TRUNCATED, NULL },
+	{ "no delimiter at all", CT, "just text", TRUNCATED, NULL },
+	{ "junk after delimiter", CT, "--XyZ\r\nA: 1\r\n\r\nx\r\n--XyZjunk\r\n", INVALID, NULL },
+	{ "header without colon", CT, "--XyZ\r\nbroken\r\n\r\nx\r\n--XyZ--", INVALID, NULL },
+};
+
+typedef struct {
+	HTTP_StringBuilder sb;
+	int fail_part; // on_part_begin of this part (from 1) refuses, 0: never
+	int parts;
+} Recorder;
+
+static int on_part_begin(void *ctx) {
+	Recorder *r = (Recorder *) ctx;
+	if (++r->parts == r->fail_part) return -1;
+	http_sb_append_char(&r->sb, '[');
+	return 0;
+}
+
+static int on_header(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len) {
+	Recorder *r = (Recorder *) ctx;
+	http_sb_append_strn(&r->sb, name, name_len);
+	http_sb_append_char(&r->sb, '=');
+	http_sb_append_strn(&r->sb, value, value_len);
+	http_sb_append_char(&r->sb, ';');
+	return 0;
+}
+
+static int on_data(void *ctx, const uint8_t *data, size_t len) {
+	CHECK(len > 0, "on_data called with nothing");
+	http_sb_append_strn(&((Recorder *) ctx)->sb, (const char *) data, len);
+	return 0;
+}
+
+static int on_part_end(void *ctx) {
+	http_sb_append_char(&((Recorder *) ctx)->sb, ']');
+	return 0;
+}
+
+static const HTTP_MultipartCallbacks callbacks = { on_part_begin, on_header, on_data, on_part_end };
+
+// Feeds body in pieces of at most step bytes after a first piece of
+// first bytes.
+static Outcome parse(const char *content_type, const char *body, size_t len, size_t first, size_t step, Recorder *r) {
+	HTTP_Multipart mp;
+	if (http_multipart_init(&mp, content_type, &callbacks, r) < 0) return INVALID;
+
+	Outcome out = OK;
+	size_t off = 0;
+	while (off < len) {
+		size_t n = off == 0 && first ? first : step;
+		if (n > len - off) n = len - off;
+		if (http_multipart_feed(&mp, (const uint8_t *) body + off, n) < 0) {
+			out = INVALID;
+			break;
+		}
+		off += n;
+	}
+	if (out == OK && http_multipart_finish(&mp) < 0) out = TRUNCATED;
+	http_multipart_destroy(&mp);
+	return out;
+}
+
+static void check(const Case *c, size_t len, const char *how, size_t first, size_t step) {
+	Recorder r = { http_sb_create(64), 0, 0 };
+	Outcome out = parse(c->content_type, c->body, len, first, step, &r);
+	CHECK(out == c->outcome, "%s (%s, first %zu): outcome %d, not %d", c->name, how, first, out, c->outcome);
+	if (out == OK && c->want) {
+		size_t want_len = c->want_len ? c->want_len : strlen(c->want);
+		CHECK(r.sb.cnt == want_len && memcmp(r.sb.str, c->want, want_len) == 0,
+			"%s (%s, first %zu): parts were %.*s", c->name, how, first, (int) r.sb.cnt, r.sb.str);
+	}
+	http_sb_destroy(&r.sb);
+}
+
+static void test_cases(void) {
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		const Case *c = &cases[i];
+		size_t len = c->body_len ? c->body_len : strlen(c->body);
+		check(c, len, "whole", 0, len);
+		check(c, len, "bytewise", 0, 1);
+		for (size_t first = 1; first < len; first++) check(c, len, "split", first, len);
+	}
+}
+
+static void test_init(void) {
+	HTTP_Multipart mp;
+	char ct[128];
+	CHECK(http_multipart_init(&mp, NULL, &callbacks, NULL) < 0, "no content type accepted");
+	CHECK(http_multipart_init(&mp, "multipart/form-data", &callbacks, NULL) < 0, "no boundary accepted");
+	CHECK(http_multipart_init(&mp, "multipart/form-data; boundary=", &callbacks, NULL) < 0, "empty boundary accepted");
+
+	snprintf(ct, sizeof(ct), "multipart/form-data; boundary=%0*d", HTTP_MULTIPART_MAX_BOUNDARY, 0);
+	CHECK(http_multipart_init(&mp, ct, &callbacks, NULL) == 0, "boundary of %d bytes refused", HTTP_MULTIPART_MAX_BOUNDARY);
+	http_multipart_destroy(&mp);
+	snprintf(ct, sizeof(ct), "multipart/form-data; boundary=%0*d", HTTP_MULTIPART_MAX_BOUNDARY + 1, 0);
+	CHECK(http_multipart_init(&mp, ct, &callbacks, NULL) < 0, "boundary of %d bytes accepted", HTTP_MULTIPART_MAX_BOUNDARY + 1);
+}
+
+// A part's header block may not grow past HTTP_MULTIPART_MAX_HEADER_BYTES.
+static void test_header_limit(void) {
+	HTTP_StringBuilder body = http_sb_create(HTTP_MULTIPART_MAX_HEADER_BYTES + 64);
+	http_sb_append_str(&body, "--XyZ\r\nA: ");
+	while (body.cnt < HTTP_MULTIPART_MAX_HEADER_BYTES + 16) http_sb_append_char(&body, 'x');
+	http_sb_append_str(&body, "\r\n\r\nx\r\n--XyZ--");
+
+	Recorder r = { http_sb_create(64), 0, 0 };
+	CHECK(parse(CT, body.str, body.cnt, 0, 4096, &r) == INVALID, "oversized part header accepted");
+	http_sb_destroy(&r.sb);
+	http_sb_destroy(&body);
+}
+
+// A callback's refusal stops the parse.
+static void test_callback_error(void) {
+	const char *body = "--XyZ\r\n\r\na\r\n--XyZ\r\n\r\nb\r\n--XyZ--";
+	Recorder r = { http_sb_create(64), 2, 0 };
+	CHECK(parse(CT, body, strlen(body), 0, 1, &r) == INVALID, "refused part was parsed");
+	CHECK(r.sb.cnt == 3 && memcmp(r.sb.str, "[a]", 3) == 0, "parts before the refusal were %.*s", (int) r.sb.cnt, r.sb.str);
+	http_sb_destroy(&r.sb);
+}
+
+int main(void) {
+	test_cases();
+	test_init();
+	test_header_limit();
+	test_callback_error();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all multipart checks passed\n");
+	return 0;
+}
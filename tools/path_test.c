@@ -0,0 +1,145 @@
+// Checks how request targets become routing paths and query parameters:
+// percent-decoding, dot segments and the escapes that must not decode.
+//
+//   path_test
+//       Exits non-zero if any check fails.
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+typedef struct {
+	const char *target;
+	const char *path; // NULL: the request must be refused
+	const char *query;
+} Target;
+
+static const Target targets[] = {
+	{ "/", "/", "" },
+	{ "/a/b", "/a/b", "" },
+	{ "/a/%2e%2e/b", "/b", "" },
+	{ "/a/%2E%2E/%2e/b/", "/b/", "" },
+	{ "/a/.%2e/b", "/b", "" },
+	{ "/a/b/../../../c", "/c", "" },
+	{ "/..", "/", "" },
+	{ "/a/..", "/", "" },
+	{ "/a/./b/.", "/a/b/", "" },
+	{ "/a//b///c", "/a/b/c", "" },
+	{ "/a/...", "/a/...", "" },
+	{ "/a/.b/..c", "/a/.b/..c", "" },
+	// %2F never becomes a separator, so it cannot form a dot segment.
+	{ "/a%2Fb", "/a%2Fb", "" },
+	{ "/a%2fb/..%2f..", "/a%2Fb/..%2F..", "" },
+	{ "/a/%2e%2e%2f%2e%2e/etc", "/a/..%2F../etc", "" },
+	// Decoding happens once: %25 yields a literal '%'.
+	{ "/%252e%252e/x", "/%2e%2e/x", "" },
+	{ "/a%20b%41", "/a bA", "" },
+	{ "/a+b", "/a+b", "" },
+	{ "/a%zz%4", "/a%zz%4", "" },
+	{ "/a%", "/a%", "" },
+	{ "/a%00b", NULL, NULL },
+	{ "/%00", NULL, NULL },
+	{ "/a/%00/..", NULL, NULL },
+	{ "/a/b?x=/../y#frag", "/a/b", "x=/../y" },
+	{ "/a/%2e%2e?q=%00", "/", "q=%00" },
+	{ "/a#frag?not-a-query", "/a", "" },
+	// Long enough for the vector scans in decode and normalize.
+	{ "/abcdefghijklmnopqrstuvwxyz/0123456789", "/abcdefghijklmnopqrstuvwxyz/0123456789", "" },
+	{ "/abcdefghijklmnopqrstuvwxyz/../0123456789", "/0123456789", "" },
+	{ "/abcdefghijklmnopqrstuvwxyz/0123456789/./", "/abcdefghijklmnopqrstuvwxyz/0123456789/", "" },
+	{ "/abcdefghijklmnop%41rstuvwxyz%2e%2E/x", "/abcdefghijklmnopArstuvwxyz../x", "" },
+};
+
+static bool slice_is(HTTP_Slice s, const char *str) {
+	return s.len == strlen(str) && (s.len == 0 || memcmp(s.ptr, str, s.len) == 0);
+}
+
+static void test_targets(void) {
+	for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+		const Target *t = &targets[i];
+		char buf[256];
+		int n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: test\r\n\r\n", t->target);
+
+		HTTP_Error err;
+		HTTP_Request req = http_req_parse((uint8_t *) buf, (size_t) n, &err);
+		if (!t->path) {
+			CHECK(err != HTTP_ERROR_NULL, "%s was accepted as %s", t->target, req.path ? req.path : "(null)");
+		} else if (err != HTTP_ERROR_NULL) {
+			CHECK(false, "%s was refused", t->target);
+		} else {
+			CHECK(strcmp(req.path, t->path) == 0, "%s routes as %s, not %s", t->target, req.path, t->path);
+			CHECK(slice_is(req.url.query, t->query),
+				"%s has the query %.*s, not %s", t->target, (int) req.url.query.len, req.url.query.ptr, t->query);
+			CHECK(strcmp(req.target, t->target) == 0, "%s was kept as %s", t->target, req.target);
+		}
+		http_req_destroy(&req);
+	}
+}
+
+typedef struct {
+	const char *in;
+	const char *out;
+	bool form;
+} Decode;
+
+static const Decode decodes[] = {
+	{ "plain", "plain", false },
+	{ "%41%62%2F", "Ab/", false },
+	{ "a+b%2B", "a+b+", false },
+	{ "a+b%2B", "a b+", true },
+	{ "%", "%", false },
+	{ "%4", "%4", false },
+	{ "%g1%1g", "%g1%1g", false },
+	{ "100%", "100%", true },
+	{ "0123456789abcdef%41 0123456789abcdef+", "0123456789abcdefA 0123456789abcdef ", true },
+};
+
+static void test_percent_decode(void) {
+	for (size_t i = 0; i < sizeof(decodes) / sizeof(decodes[0]); i++) {
+		const Decode *d = &decodes[i];
+		char buf[64];
+		size_t len = strlen(d->in);
+		memcpy(buf, d->in, len);
+		// Decoding in place is allowed.
+		size_t n = http_percent_decode(buf, buf, len, d->form);
+		CHECK(n == strlen(d->out) && memcmp(buf, d->out, n) == 0, "%s decoded to %.*s, not %s", d->in, (int) n, buf, d->out);
+	}
+}
+
+static void test_query(void) {
+	char buf[] = "GET /q?a=1&b=x%20y+z&c&=skipped&a=2&e=%3D%26 HTTP/1.1\r\n\r\n";
+	HTTP_Error err;
+	HTTP_Request req = http_req_parse((uint8_t *) buf, sizeof(buf) - 1, &err);
+	CHECK(err == HTTP_ERROR_NULL, "query request refused");
+	if (err == HTTP_ERROR_NULL) {
+		static const char *want[][2] = { { "a", "1" }, { "b", "x y z" }, { "c", "" }, { "e", "=&" }, { "d", NULL } };
+		for (size_t i = 0; i < sizeof(want) / sizeof(want[0]); i++) {
+			const char *v = http_req_query(&req, want[i][0]);
+			CHECK(want[i][1] ? v && strcmp(v, want[i][1]) == 0 : !v, "query %s is %s", want[i][0], v ? v : "(null)");
+		}
+	}
+	http_req_destroy(&req);
+}
+
+int main(void) {
+	test_targets();
+	test_percent_decode();
+	test_query();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all path checks passed\n");
+	return 0;
+}
@@ -0,0 +1,241 @@
+// Checks reverse-proxy routes: the target sent upstream, body relaying,
+// retrying on a pooled connection the upstream dropped, and 502s.
+//
+//   proxy_test
+//       Runs a proxy server on an abstract Unix socket and a scripted
+//       upstream on a loopback port, each in its own thread. Exits
+//       non-zero if any check fails.
+
+#include <signal.h>
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+#define LISTEN_ADDR "unix:@http-proxy-test"
+#define BIG_BODY (200 * 1024)
+
+typedef struct {
+	const char *name;
+	const char *method;
+	const char *target;
+	size_t body_len; // bytes of 'x'
+	uint16_t status;
+	const char *upstream_line; // the request line the upstream saw, NULL: none
+} Case;
+
+// The upstream answers every request with the request line it got and
+// the body. A request whose target holds "drop" is dropped, connection
+// and all, unless it is the first one on its connection, so it only
+// goes through when the proxy retries it on a fresh one.
+static const Case cases[] = {
+	{ "plain", "GET", "/p", 0, 200, "GET /p HTTP/1.1" },
+	{ "below the route", "GET", "/p/a/b", 0, 200, "GET /p/a/b HTTP/1.1" },
+	{ "encoded dot segment", "GET", "/p/a/%2e%2e/b?q=1%20x#frag", 0, 200, "GET /p/b?q=1%20x HTTP/1.1" },
+	{ "plain dot segment", "GET", "/p/./a//b/../c/", 0, 200, "GET /p/a/c/ HTTP/1.1" },
+	{ "encoded slash", "GET", "/p/a%2Fb/%2E%2E%2fx", 0, 200, "GET /p/a%2Fb/..%2fx HTTP/1.1" },
+	{ "double encoding", "GET", "/p/%252e%252e/x", 0, 200, "GET /p/%252e%252e/x HTTP/1.1" },
+	{ "climbing out of the route", "GET", "/p/%2e%2e/q", 0, 404, NULL },
+	{ "sibling of the route", "GET", "/px", 0, 404, NULL },
+	{ "small body", "POST", "/p/echo", 5, 200, "POST /p/echo HTTP/1.1" },
+	{ "spliced body", "POST", "/p/echo", BIG_BODY, 200, "POST /p/echo HTTP/1.1" },
+	{ "dropped pooled connection", "GET", "/p/drop", 0, 200, "GET /p/drop HTTP/1.1" },
+	{ "dropped again", "GET", "/p/drop?again", 0, 200, "GET /p/drop?again HTTP/1.1" },
+	{ "dropped with a body", "POST", "/p/drop", 5, 200, "POST /p/drop HTTP/1.1" },
+	{ "dead upstream", "GET", "/dead", 0, 502, NULL },
+};
+
+static HTTP_Server serv;
+
+static void *serve(void *arg) {
+	UNUSED(arg);
+	http_server_run(&serv);
+	return NULL;
+}
+
+// Reads a head and the body its Content-Length frames into in, after
+// whatever in already holds. Returns the head length, 0 on EOF.
+static size_t read_message(int fd, HTTP_StringBuilder *in, size_t *body_len) {
+	size_t head_len;
+	while ((head_len = http_find_head_end((const uint8_t *) in->str, in->cnt)) == 0) {
+		char buf[4096];
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n <= 0) return 0;
+		http_sb_append_strn(in, buf, (size_t) n);
+	}
+	if (http_head_content_length((const uint8_t *) in->str, head_len, body_len) < 0) return 0;
+	while (in->cnt < head_len + *body_len) {
+		char buf[65536];
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n <= 0) return 0;
+		http_sb_append_strn(in, buf, (size_t) n);
+	}
+	return head_len;
+}
+
+static void *upstream_conn(void *arg) {
+	int fd = (int)(intptr_t) arg;
+	HTTP_StringBuilder in = http_sb_create(4096);
+	HTTP_StringBuilder out = http_sb_create(4096);
+	for (size_t n = 1;; n++) {
+		size_t body_len;
+		size_t head_len = read_message(fd, &in, &body_len);
+		if (head_len == 0) break;
+		size_t line_len = (size_t)((char *) memchr(in.str, '\r', head_len) - in.str);
+		if (n > 1 && memmem(in.str, line_len, "drop", 4)) break;
+
+		http_sb_reset(&out);
+		http_sb_append_str(&out, "HTTP/1.1 200 OK\r\nContent-Length: ");
+		http_sb_append_uint(&out, line_len + 1 + body_len);
+		http_sb_append_str(&out, "\r\n\r\n");
+		http_sb_append_strn(&out, in.str, line_len);
+		http_sb_append_char(&out, '\n');
+		http_sb_append_strn(&out, in.str + head_len, body_len);
+		for (size_t off = 0; off < out.cnt;) {
+			ssize_t w = send(fd, out.str + off, out.cnt - off, MSG_NOSIGNAL);
+			if (w <= 0) goto done;
+			off += (size_t) w;
+		}
+
+		size_t used = head_len + body_len;
+		memmove(in.str, in.str + used, in.cnt - used);
+		in.cnt -= used;
+	}
+done:
+	close(fd);
+	http_sb_destroy(&in);
+	http_sb_destroy(&out);
+	return NULL;
+}
+
+static void *upstream(void *arg) {
+	int lfd = (int)(intptr_t) arg;
+	for (;;) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0) continue;
+		pthread_t t;
+		pthread_create(&t, NULL, upstream_conn, (void *)(intptr_t) fd);
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+// Listens on a loopback port of the kernel's choosing.
+static int listen_any(uint16_t *port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in a = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t len = sizeof(a);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &a, len) < 0 || listen(fd, 64) < 0 || getsockname(fd, (struct sockaddr *) &a, &len) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	*port = ntohs(a.sin_port);
+	return fd;
+}
+
+static int proxy_connect(void) {
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	const char *name = strchr(LISTEN_ADDR, '@') + 1;
+	memcpy(a.sun_path + 1, name, strlen(name));
+	socklen_t alen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name));
+
+	// The server thread may not be listening yet.
+	for (int tries = 0; tries < 100; tries++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *) &a, alen) == 0) {
+			struct timeval tv = { .tv_sec = 5 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			return fd;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	return -1;
+}
+
+static void run(const Case *c) {
+	int fd = proxy_connect();
+	CHECK(fd >= 0, "%s: no connection", c->name);
+	if (fd < 0) return;
+
+	HTTP_StringBuilder req = http_sb_create(c->body_len + 256);
+	http_sb_append_str(&req, c->method);
+	http_sb_append_char(&req, ' ');
+	http_sb_append_str(&req, c->target);
+	http_sb_append_str(&req, " HTTP/1.1\r\nHost: test\r\n");
+	if (c->body_len) {
+		http_sb_append_str(&req, "Content-Length: ");
+		http_sb_append_uint(&req, c->body_len);
+		http_sb_append_str(&req, "\r\n");
+	}
+	http_sb_append_str(&req, "\r\n");
+	for (size_t i = 0; i < c->body_len; i++) http_sb_append_char(&req, 'x');
+	for (size_t off = 0; off < req.cnt;) {
+		ssize_t w = send(fd, req.str + off, req.cnt - off, MSG_NOSIGNAL);
+		if (w <= 0) break;
+		off += (size_t) w;
+	}
+	http_sb_destroy(&req);
+
+	HTTP_StringBuilder in = http_sb_create(4096);
+	size_t body_len;
+	size_t head_len = read_message(fd, &in, &body_len);
+	CHECK(head_len > 0, "%s: no complete response", c->name);
+	if (head_len > 0) {
+		unsigned status = 0;
+		sscanf(in.str, "HTTP/1.1 %u", &status);
+		CHECK(status == c->status, "%s: status %u, not %u", c->name, status, c->status);
+
+		if (c->upstream_line) {
+			const char *body = in.str + head_len;
+			const char *nl = (const char *) memchr(body, '\n', body_len);
+			size_t line_len = nl ? (size_t)(nl - body) : body_len;
+			CHECK(line_len == strlen(c->upstream_line) && memcmp(body, c->upstream_line, line_len) == 0,
+				"%s: upstream saw %.*s", c->name, (int) line_len, body);
+			size_t echoed = nl ? body_len - line_len - 1 : 0;
+			bool same = echoed == c->body_len;
+			for (size_t i = 0; same && i < echoed; i++) same = nl[1 + i] == 'x';
+			CHECK(same, "%s: %zu body bytes came back for %zu", c->name, echoed, c->body_len);
+		}
+	}
+	http_sb_destroy(&in);
+	close(fd);
+}
+
+int main(void) {
+	signal(SIGPIPE, SIG_IGN);
+
+	uint16_t up_port, dead_port;
+	int up_fd = listen_any(&up_port);
+	close(listen_any(&dead_port));
+	pthread_t t;
+	pthread_create(&t, NULL, upstream, (void *)(intptr_t) up_fd);
+	pthread_detach(t);
+
+	serv = http_server_create_at(LISTEN_ADDR);
+	if (http_server_proxy(&serv, "/p", "127.0.0.1", up_port) < 0 || http_server_proxy(&serv, "/dead", "127.0.0.1", dead_port) < 0) {
+		fprintf(stderr, "cannot register the proxy routes\n");
+		return 1;
+	}
+	pthread_create(&t, NULL, serve, NULL);
+	pthread_detach(t);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) run(&cases[i]);
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all proxy checks passed\n");
+	return 0;
+}
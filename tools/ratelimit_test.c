@@ -0,0 +1,211 @@
+// Checks the per-peer token buckets: bursts, refill at the configured
+// rate, the full bucket after idle_ms, slot reclaiming, and exact counts
+// when threads race for the same buckets.
+//
+//   ratelimit_test
+//       Drives the limiter with explicit timestamps, so it needs no
+//       network and does not sleep. Exits non-zero if any check fails.
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+static HTTP_Addr addr(const char *ip) {
+	HTTP_Addr a = {0};
+	if (strchr(ip, ':')) {
+		a.in6.sin6_family = AF_INET6;
+		inet_pton(AF_INET6, ip, &a.in6.sin6_addr);
+	} else {
+		a.in.sin_family = AF_INET;
+		inet_pton(AF_INET, ip, &a.in.sin_addr);
+	}
+	return a;
+}
+
+static HTTP_Addr addr_n(uint32_t n) {
+	HTTP_Addr a = {0};
+	a.in.sin_family = AF_INET;
+	a.in.sin_addr.s_addr = htonl(0x0a000000 | n);
+	return a;
+}
+
+typedef struct {
+	uint32_t at; // ms after the start
+	const char *peer;
+	unsigned times; // requests in a row
+	unsigned allowed; // how many of them get through
+} Step;
+
+// 10 tokens a second, bursts of 3, so idle_ms is 300 + 1000.
+static const Step timeline[] = {
+	{ 0, "192.0.2.1", 4, 3 },
+	{ 50, "192.0.2.1", 1, 0 }, // half a token
+	{ 100, "192.0.2.1", 2, 1 },
+	{ 100, "192.0.2.2", 4, 3 }, // every peer has its own bucket
+	{ 399, "192.0.2.1", 3, 2 },
+	// A reading a millisecond behind the last stamp, as another thread's
+	// clock can be, refills nothing.
+	{ 398, "192.0.2.1", 1, 0 },
+	{ 500, "192.0.2.1", 1, 1 },
+	// However long a peer idles, the bucket holds no more than burst.
+	{ 2000, "192.0.2.1", 4, 3 },
+	{ 100000, "192.0.2.1", 4, 3 },
+	// IPv6 peers share a bucket per /64; mapped IPv4 is plain IPv4.
+	{ 0, "2001:db8:1:2::1", 2, 2 },
+	{ 0, "2001:db8:1:2::ffff", 2, 1 },
+	{ 0, "2001:db8:1:3::1", 4, 3 },
+	{ 100000, "::ffff:192.0.2.1", 1, 0 },
+	{ 100000, "192.0.2.1", 1, 0 },
+};
+
+static void test_timeline(void) {
+	HTTP_RateLimiter *rl = http_rate_limiter_create(10, 3, 64);
+	uint64_t start = http_now_ms();
+	for (size_t i = 0; i < sizeof(timeline) / sizeof(timeline[0]); i++) {
+		const Step *s = &timeline[i];
+		HTTP_Addr peer = addr(s->peer);
+		unsigned allowed = 0;
+		for (unsigned j = 0; j < s->times; j++) allowed += http_rate_limiter_allow(rl, &peer, start + s->at);
+		CHECK(allowed == s->allowed, "step %zu: %u of %u requests from %s at %u ms got through, not %u",
+			i, allowed, s->times, s->peer, s->at, s->allowed);
+	}
+
+	HTTP_Addr unix_peer = { .un.sun_family = AF_UNIX };
+	for (int i = 0; i < 10; i++) CHECK(http_rate_limiter_allow(rl, &unix_peer, start), "Unix peer was limited");
+	http_rate_limiter_destroy(rl);
+}
+
+// A bucket left idle for idle_ms is full again whether or not its slot
+// was handed to another peer in the meantime.
+static void test_idle_refill(void) {
+	HTTP_RateLimiter *rl = http_rate_limiter_create(1, 5, 64);
+	uint64_t start = http_now_ms();
+	uint64_t idle = rl->idle_ms;
+	HTTP_Addr peer = addr("198.51.100.7");
+
+	for (int i = 0; i < 5; i++) http_rate_limiter_allow(rl, &peer, start);
+	CHECK(!http_rate_limiter_allow(rl, &peer, start), "burst of 5 allowed a sixth");
+	CHECK(http_rate_limiter_allow(rl, &peer, start + 1000), "no token after a second at 1/s");
+	CHECK(!http_rate_limiter_allow(rl, &peer, start + 1000), "second token after a second at 1/s");
+
+	uint64_t later = start + 1000 + idle + 1;
+	unsigned allowed = 0;
+	for (int i = 0; i < 10; i++) allowed += http_rate_limiter_allow(rl, &peer, later);
+	CHECK(allowed == 5, "%u requests allowed after idling %llu ms, not 5", allowed, (unsigned long long) idle);
+	http_rate_limiter_destroy(rl);
+}
+
+// Threads read the clock independently, so a peer may probe past a
+// bucket stamped a millisecond after its own reading. That bucket is
+// fresh, not idle, and must not be handed over.
+static void test_clock_skew(void) {
+	HTTP_RateLimiter *rl = http_rate_limiter_create(10, 3, 64);
+	uint64_t start = http_now_ms();
+	HTTP_Addr a = addr_n(1), b;
+
+	// Find a peer whose probe starts at a's slot.
+	uint64_t ha = http_rate_key(&a) * 0x9e3779b97f4a7c15ULL;
+	for (uint32_t i = 2;; i++) {
+		b = addr_n(i);
+		uint64_t hb = http_rate_key(&b) * 0x9e3779b97f4a7c15ULL;
+		if (hb >> (64 - HTTP_RATE_LIMIT_SHARD_BITS) == ha >> (64 - HTTP_RATE_LIMIT_SHARD_BITS) &&
+				(hb & rl->shard_mask) == (ha & rl->shard_mask)) break;
+	}
+
+	for (int i = 0; i < 3; i++) http_rate_limiter_allow(rl, &a, start + 5);
+	CHECK(http_rate_limiter_allow(rl, &b, start + 4), "second peer was limited");
+	CHECK(!http_rate_limiter_allow(rl, &a, start + 5), "drained bucket was reclaimed by a peer a millisecond behind");
+	http_rate_limiter_destroy(rl);
+}
+
+// More peers than slots: some go untracked while every bucket is live,
+// and once those have idled their slots serve new peers.
+static void test_reclaim(void) {
+	HTTP_RateLimiter *rl = http_rate_limiter_create(1, 2, 64);
+	size_t slots = (rl->shard_mask + 1) * HTTP_RATE_LIMIT_SHARDS;
+	uint64_t now = http_now_ms();
+
+	for (uint32_t i = 0; i < 4 * slots; i++) {
+		HTTP_Addr peer = addr_n(i);
+		http_rate_limiter_allow(rl, &peer, now);
+	}
+	uint64_t untracked = rl->untracked;
+	CHECK(untracked > 0, "%zu slots tracked %zu peers", slots, 4 * slots);
+
+	now += rl->idle_ms + 1;
+	size_t fresh = slots / 2, limited = 0;
+	for (uint32_t i = 0; i < fresh; i++) {
+		HTTP_Addr peer = addr_n(0x100000 + i);
+		http_rate_limiter_allow(rl, &peer, now);
+		http_rate_limiter_allow(rl, &peer, now);
+		limited += !http_rate_limiter_allow(rl, &peer, now);
+	}
+	CHECK(rl->untracked == untracked, "%llu new peers went untracked after the old ones idled",
+		(unsigned long long)(rl->untracked - untracked));
+	CHECK(limited == fresh, "%zu of %zu new peers were limited after their burst", limited, fresh);
+	http_rate_limiter_destroy(rl);
+}
+
+#define RACE_THREADS 8
+#define RACE_PEERS 200
+#define RACE_BURST 10
+#define RACE_TRIES 4 // per peer and thread, more than RACE_BURST in all
+
+static HTTP_RateLimiter *race_rl;
+static uint64_t race_now;
+static uint32_t race_allowed[RACE_PEERS];
+
+static void *race(void *arg) {
+	size_t id = (size_t)(uintptr_t) arg;
+	for (size_t i = 0; i < RACE_PEERS; i++) {
+		// Each thread walks the peers from its own starting point, so
+		// several claim slots for new peers at the same time.
+		size_t p = (i + id * 7) % RACE_PEERS;
+		HTTP_Addr peer = addr_n((uint32_t) p);
+		for (int t = 0; t < RACE_TRIES; t++)
+			if (http_rate_limiter_allow(race_rl, &peer, race_now)) __atomic_add_fetch(&race_allowed[p], 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+// Within one millisecond nothing refills, so however the threads
+// interleave each peer gets exactly its burst.
+static void test_race(void) {
+	race_rl = http_rate_limiter_create(1, RACE_BURST, 4 * RACE_PEERS);
+	race_now = http_now_ms();
+	pthread_t threads[RACE_THREADS];
+	for (size_t i = 0; i < RACE_THREADS; i++) pthread_create(&threads[i], NULL, race, (void *)(uintptr_t) i);
+	for (size_t i = 0; i < RACE_THREADS; i++) pthread_join(threads[i], NULL);
+
+	CHECK(race_rl->untracked == 0, "%llu requests went untracked", (unsigned long long) race_rl->untracked);
+	for (size_t i = 0; i < RACE_PEERS; i++)
+		CHECK(race_allowed[i] == RACE_BURST, "peer %zu got %u requests through, not %d", i, race_allowed[i], RACE_BURST);
+	CHECK(http_rate_limiter_limited(race_rl) == (uint64_t) RACE_PEERS * (RACE_THREADS * RACE_TRIES - RACE_BURST),
+		"%llu requests were limited", (unsigned long long) http_rate_limiter_limited(race_rl));
+	http_rate_limiter_destroy(race_rl);
+}
+
+int main(void) {
+	test_timeline();
+	test_idle_refill();
+	test_clock_skew();
+	test_reclaim();
+	test_race();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all rate limiter checks passed\n");
+	return 0;
+}
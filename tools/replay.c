@@ -0,0 +1,449 @@
+// Replays traffic captured with HTTP_Server's capture mode (serv.capture).
+//
+//   replay parse <capture.jsonl> [-n rounds]
+//       Runs every captured request through http_req_parse, rounds times
+//       (default 100).
+//   replay live <capture.jsonl> <host:port> [-c conns] [-s speed]
+//       Sends the requests to a running server over conns keep-alive
+//       connections (default 1). With -s 1 the captured timing is kept,
+//       -s 10 plays it ten times as fast; -s 0 (the default) sends each
+//       request as soon as its connection is free. When paced, latency
+//       counts from the scheduled send time, so a server that falls
+//       behind shows it. A file that several server runs appended to
+//       is played as one run after another.
+//
+// Both report throughput and latency percentiles.
+
+#include <netinet/tcp.h>
+#include <signal.h>
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+typedef struct {
+	uint64_t at_us; // when to send, counted from the first request
+	uint8_t *raw;
+	size_t len;
+	bool head; // HEAD request: the response has no body
+} Capture;
+
+typedef struct {
+	Capture *reqs;
+	size_t count;
+	size_t cap;
+} Captures;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Decodes the JSON string starting after its opening quote into out,
+// mapping \u00XX back to single bytes. Returns the length or -1.
+static long json_unescape(const char *s, uint8_t *out) {
+	size_t n = 0;
+	for (; *s && *s != '"'; s++) {
+		if (*s != '\\') { out[n++] = (uint8_t) *s; continue; }
+		switch (*++s) {
+			case 'r': out[n++] = '\r'; break;
+			case 'n': out[n++] = '\n'; break;
+			case 't': out[n++] = '\t'; break;
+			case 'b': out[n++] = '\b'; break;
+			case 'f': out[n++] = '\f'; break;
+			case 'u': {
+				int v = 0;
+				for (int i = 1; i <= 4; i++) {
+					int d = hex_value(s[i]);
+					if (d < 0) return -1;
+					v = v << 4 | d;
+				}
+				if (v > 0xff) return -1;
+				out[n++] = (uint8_t) v;
+				s += 4;
+				break;
+			}
+			case '\0': return -1;
+			default: out[n++] = (uint8_t) *s; break;
+		}
+	}
+	return *s == '"' ? (long) n : -1;
+}
+
+static void load(const char *path, Captures *caps) {
+	FILE *f = fopen(path, "r");
+	if (!f) { perror(path); exit(1); }
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	size_t lineno = 0;
+	// t_us restarts at 0 each time a server opens the file, so each run
+	// is laid after the one before it.
+	uint64_t run_base = 0, run_t0 = 0, last = 0;
+	while ((line_len = getline(&line, &line_cap, f)) > 0) {
+		lineno++;
+		const char *t = strstr(line, "\"t_us\":");
+		const char *raw = strstr(line, "\"raw\":\"");
+		if (!t || !raw) {
+			fprintf(stderr, "%s:%zu: not a capture line\n", path, lineno);
+			continue;
+		}
+
+		Capture c = {0};
+		uint64_t t_us = strtoull(t + 7, NULL, 10);
+		if (caps->count == 0 || t_us < last) {
+			run_base = caps->count ? caps->reqs[caps->count - 1].at_us : 0;
+			run_t0 = t_us;
+		}
+		last = t_us;
+		c.at_us = run_base + (t_us - run_t0);
+		c.raw = (uint8_t *) malloc((size_t) line_len + 1);
+		if (!c.raw) { perror("malloc"); exit(1); }
+		long n = json_unescape(raw + 7, c.raw);
+		if (n < 0) {
+			fprintf(stderr, "%s:%zu: bad raw string\n", path, lineno);
+			free(c.raw);
+			continue;
+		}
+		c.len = (size_t) n;
+		c.raw[c.len] = '\0';
+		c.head = c.len > 5 && memcmp(c.raw, "HEAD ", 5) == 0;
+
+		if (caps->count == caps->cap) {
+			caps->cap = caps->cap ? caps->cap * 2 : 256;
+			caps->reqs = (Capture *) realloc(caps->reqs, sizeof(Capture) * caps->cap);
+			if (!caps->reqs) { perror("realloc"); exit(1); }
+		}
+		caps->reqs[caps->count++] = c;
+	}
+	free(line);
+	fclose(f);
+
+	if (caps->count == 0) { fprintf(stderr, "%s: no requests\n", path); exit(1); }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, uint64_t *lat_ns, size_t n, size_t errors, uint64_t elapsed_ns, uint64_t bytes) {
+	qsort(lat_ns, n, sizeof(*lat_ns), cmp_u64);
+	double secs = (double) elapsed_ns / 1e9;
+	printf("%s: %zu requests, %zu errors in %.3f s\n", what, n, errors, secs);
+	printf("  throughput  %.0f req/s, %.2f MB/s\n", (double) n / secs, (double) bytes / secs / 1e6);
+	if (n == 0) return;
+
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	printf("  latency us ");
+	for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+		size_t k = (size_t)((double)(n - 1) * pcts[i] / 100.0);
+		printf(" p%g=%.2f", pcts[i], (double) lat_ns[k] / 1e3);
+	}
+	printf(" max=%.2f\n", (double) lat_ns[n - 1] / 1e3);
+}
+
+static void replay_parse(Captures *caps, size_t rounds) {
+	size_t max_len = 0;
+	for (size_t i = 0; i < caps->count; i++)
+		if (caps->reqs[i].len > max_len) max_len = caps->reqs[i].len;
+	uint8_t *scratch = (uint8_t *) malloc(max_len + 1);
+	uint64_t *lat = (uint64_t *) malloc(sizeof(uint64_t) * caps->count * rounds);
+	if (!scratch || !lat) { perror("malloc"); exit(1); }
+
+	size_t n = 0, errors = 0;
+	uint64_t bytes = 0, busy = 0;
+	for (size_t r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < caps->count; i++) {
+			Capture *c = &caps->reqs[i];
+			// The parser works in place, so each run gets a fresh copy.
+			memcpy(scratch, c->raw, c->len + 1);
+
+			HTTP_Error err;
+			uint64_t t0 = now_ns();
+			HTTP_Request req = http_req_parse(scratch, c->len, &err);
+			uint64_t t1 = now_ns();
+			http_req_destroy(&req);
+
+			if (err) errors++;
+			lat[n++] = t1 - t0;
+			busy += t1 - t0;
+			bytes += c->len;
+		}
+	}
+	report("parse", lat, n, errors, busy, bytes);
+	free(lat);
+	free(scratch);
+}
+
+typedef struct {
+	Captures *caps;
+	HTTP_Addr addr;
+	double speed;
+	uint64_t start_ns;
+	size_t next; // shared, atomic
+	uint64_t *lat; // indexed by request
+	bool *ok;
+	uint64_t bytes; // shared, atomic
+} Live;
+
+static int live_connect(Live *live) {
+	int fd = socket(live->addr.sa.sa_family, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, &live->addr.sa, http_addr_len(&live->addr)) < 0) { close(fd); return -1; }
+	if (live->addr.sa.sa_family != AF_UNIX) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+typedef struct {
+	uint8_t data[65536];
+	size_t len;
+} RecvBuf;
+
+// Makes at least want bytes available in b. False on EOF or error.
+static bool fill(int fd, RecvBuf *b, size_t want) {
+	while (b->len < want) {
+		if (b->len == sizeof(b->data)) return false;
+		ssize_t n = recv(fd, b->data + b->len, sizeof(b->data) - b->len, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		b->len += (size_t) n;
+	}
+	return true;
+}
+
+static void consume(RecvBuf *b, size_t n) {
+	memmove(b->data, b->data + n, b->len - n);
+	b->len -= n;
+}
+
+// Skips body bytes, which may be more than the buffer holds.
+static bool skip(int fd, RecvBuf *b, uint64_t n) {
+	while (n > 0) {
+		if (b->len == 0 && !fill(fd, b, 1)) return false;
+		size_t k = b->len < n ? b->len : (size_t) n;
+		consume(b, k);
+		n -= k;
+	}
+	return true;
+}
+
+static bool read_line(int fd, RecvBuf *b, char *line, size_t cap) {
+	for (;;) {
+		uint8_t *eol = (uint8_t *) memchr(b->data, '\n', b->len);
+		if (eol) {
+			size_t n = (size_t)(eol - b->data) + 1;
+			if (n >= cap) return false;
+			memcpy(line, b->data, n);
+			line[n] = '\0';
+			consume(b, n);
+			return true;
+		}
+		if (!fill(fd, b, b->len + 1)) return false;
+	}
+}
+
+// Reads one response. Returns its size, or -1 if the connection broke.
+// *closed tells whether the server is done with the connection.
+static long read_response(int fd, RecvBuf *b, bool head, bool *closed) {
+	size_t head_len;
+	int status;
+	for (;;) {
+		while ((head_len = http_find_head_end(b->data, b->len)) == 0)
+			if (!fill(fd, b, b->len + 1)) return -1;
+		if (head_len < 12 || memcmp(b->data, "HTTP/1.", 7) != 0) return -1;
+		status = atoi((const char *) b->data + 9);
+		if (status >= 200 || status == 101) break;
+		consume(b, head_len); // interim 1xx
+	}
+
+	char *h = (char *) malloc(head_len + 1);
+	if (!h) return -1;
+	memcpy(h, b->data, head_len);
+	h[head_len] = '\0';
+	consume(b, head_len);
+
+	bool chunked = false, has_length = false;
+	uint64_t length = 0;
+	*closed = h[7] == '0';
+	for (char *line = strstr(h, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+		char *name = line + 2;
+		if (strncasecmp(name, "Content-Length:", 15) == 0) {
+			has_length = true;
+			length = strtoull(name + 15, NULL, 10);
+		} else if (strncasecmp(name, "Transfer-Encoding:", 18) == 0) {
+			chunked = strstr(name, "chunked") != NULL;
+		} else if (strncasecmp(name, "Connection:", 11) == 0) {
+			char *v = name + 11;
+			while (*v == ' ') v++;
+			if (strncasecmp(v, "close", 5) == 0) *closed = true;
+			if (strncasecmp(v, "keep-alive", 10) == 0) *closed = false;
+		}
+	}
+	free(h);
+
+	long size = (long) head_len;
+	if (head || status == 204 || status == 304) return size;
+	if (chunked) {
+		char line[256];
+		for (;;) {
+			if (!read_line(fd, b, line, sizeof(line))) return -1;
+			uint64_t n = strtoull(line, NULL, 16);
+			size += (long) strlen(line);
+			if (n == 0) break;
+			if (!skip(fd, b, n + 2)) return -1;
+			size += (long) n + 2;
+		}
+		do { // trailers
+			if (!read_line(fd, b, line, sizeof(line))) return -1;
+			size += (long) strlen(line);
+		} while (strcmp(line, "\r\n") != 0);
+		return size;
+	}
+	if (has_length) return skip(fd, b, length) ? size + (long) length : -1;
+
+	// Delimited by close.
+	*closed = true;
+	for (;;) {
+		size += (long) b->len;
+		b->len = 0;
+		if (!fill(fd, b, 1)) return size;
+	}
+}
+
+static void *live_worker(void *arg) {
+	Live *live = (Live *) arg;
+	RecvBuf *b = (RecvBuf *) malloc(sizeof(RecvBuf));
+	if (!b) return NULL;
+	int fd = -1;
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&live->next, 1, __ATOMIC_RELAXED);
+		if (i >= live->caps->count) break;
+		Capture *c = &live->caps->reqs[i];
+
+		uint64_t t0 = now_ns();
+		if (live->speed > 0) {
+			// Clamped so an absurd offset cannot overflow the conversion.
+			double offset_ns = (double) c->at_us * 1000.0 / live->speed;
+			if (offset_ns > 1e15) offset_ns = 1e15;
+			uint64_t due = live->start_ns + (uint64_t) offset_ns;
+			if (due > t0) {
+				struct timespec ts = { (time_t)((due - t0) / 1000000000), (long)((due - t0) % 1000000000) };
+				nanosleep(&ts, NULL);
+			}
+			t0 = due;
+		}
+
+		bool closed = true;
+		long size = -1;
+		for (int attempt = 0; attempt < 2 && size < 0; attempt++) {
+			// A kept-alive connection the server dropped in the meantime
+			// fails at once; retry that once on a new connection.
+			if (fd < 0 && (fd = live_connect(live)) < 0) break;
+			b->len = 0;
+			size_t off = 0;
+			while (off < c->len) {
+				ssize_t n = send(fd, c->raw + off, c->len - off, MSG_NOSIGNAL);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) break;
+				off += (size_t) n;
+			}
+			if (off == c->len) size = read_response(fd, b, c->head, &closed);
+			if (size < 0 || closed) { close(fd); fd = -1; }
+		}
+
+		live->lat[i] = now_ns() - t0;
+		live->ok[i] = size >= 0;
+		if (size > 0) __atomic_fetch_add(&live->bytes, (uint64_t) size, __ATOMIC_RELAXED);
+	}
+
+	if (fd >= 0) close(fd);
+	free(b);
+	return NULL;
+}
+
+static void replay_live(Captures *caps, const char *target, size_t conns, double speed) {
+	char host[256];
+	const char *colon = strrchr(target, ':');
+	if (!colon || (size_t)(colon - target) >= sizeof(host)) { fprintf(stderr, "expected host:port, got %s\n", target); exit(1); }
+	memcpy(host, target, (size_t)(colon - target));
+	host[colon - target] = '\0';
+	char *h = host;
+	if (h[0] == '[') { h++; h[strlen(h) - 1] = '\0'; }
+
+	Live live = {0};
+	size_t count;
+	if (http_resolve(h, (uint16_t) atoi(colon + 1), &live.addr, 1, &count) < 0 || count == 0) {
+		fprintf(stderr, "cannot resolve %s\n", target);
+		exit(1);
+	}
+	live.caps = caps;
+	live.speed = speed;
+	live.lat = (uint64_t *) calloc(caps->count, sizeof(uint64_t));
+	live.ok = (bool *) calloc(caps->count, sizeof(bool));
+	pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * conns);
+	if (!live.lat || !live.ok || !threads) { perror("malloc"); exit(1); }
+
+	live.start_ns = now_ns();
+	for (size_t i = 0; i < conns; i++) pthread_create(&threads[i], NULL, live_worker, &live);
+	for (size_t i = 0; i < conns; i++) pthread_join(threads[i], NULL);
+	uint64_t elapsed = now_ns() - live.start_ns;
+
+	size_t n = 0, errors = 0;
+	for (size_t i = 0; i < caps->count; i++) {
+		if (live.ok[i]) live.lat[n++] = live.lat[i];
+		else errors++;
+	}
+	report("live", live.lat, n, errors, elapsed, live.bytes);
+	free(threads);
+	free(live.ok);
+	free(live.lat);
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: replay parse <capture.jsonl> [-n rounds]\n"
+		"       replay live <capture.jsonl> <host:port> [-c conns] [-s speed]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	signal(SIGPIPE, SIG_IGN);
+	if (argc < 3) usage();
+
+	bool live = strcmp(argv[1], "live") == 0;
+	if (!live && strcmp(argv[1], "parse") != 0) usage();
+	if (live && argc < 4) usage();
+
+	size_t rounds = 100, conns = 1;
+	double speed = 0;
+	for (int i = live ? 4 : 3; i < argc; i++) {
+		if (i + 1 >= argc) usage();
+		if (strcmp(argv[i], "-n") == 0) rounds = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-c") == 0) conns = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-s") == 0) speed = atof(argv[++i]);
+		else usage();
+	}
+	if (rounds == 0 || conns == 0) usage();
+
+	Captures caps = {0};
+	load(argv[2], &caps);
+	if (live) replay_live(&caps, argv[3], conns, speed);
+	else replay_parse(&caps, rounds);
+
+	for (size_t i = 0; i < caps.count; i++) free(caps.reqs[i].raw);
+	free(caps.reqs);
+	return 0;
+}
@@ -0,0 +1,205 @@
+// Checks the resolver cache and the happy-eyeballs connect.
+//
+//   resolve_test
+//       Needs no network: everything runs against loopback and
+//       addresses seeded straight into the cache. Exits non-zero if any
+//       check fails.
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+static HTTP_Addr addr4(const char *ip) {
+	HTTP_Addr a = {0};
+	a.in.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &a.in.sin_addr);
+	return a;
+}
+
+static HTTP_Addr addr6(const char *ip) {
+	HTTP_Addr a = {0};
+	a.in6.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, ip, &a.in6.sin6_addr);
+	return a;
+}
+
+static bool addr_is(const HTTP_Addr *a, const char *ip) {
+	HTTP_Addr b = strchr(ip, ':') ? addr6(ip) : addr4(ip);
+	if (a->sa.sa_family != b.sa.sa_family) return false;
+	if (a->sa.sa_family == AF_INET6) return memcmp(&a->in6.sin6_addr, &b.in6.sin6_addr, 16) == 0;
+	return a->in.sin_addr.s_addr == b.in.sin_addr.s_addr;
+}
+
+static uint16_t addr_port(const HTTP_Addr *a) {
+	return ntohs(a->sa.sa_family == AF_INET6 ? a->in6.sin6_port : a->in.sin_port);
+}
+
+static HTTP_ResolveEntry *cache_entry(const char *host) {
+	return &http_resolve_cache[http_resolve_slot(host)];
+}
+
+// Answers for host as if a lookup had just returned them, in this order.
+static void seed(const char *host, const HTTP_Addr *addrs, size_t n) {
+	HTTP_ResolveEntry *e = cache_entry(host);
+	pthread_mutex_lock(&http_resolve_lock);
+	snprintf(e->host, sizeof(e->host), "%s", host);
+	memcpy(e->addrs, addrs, sizeof(HTTP_Addr) * n);
+	e->count = n;
+	e->expires = http_now_ms() + HTTP_RESOLVE_TTL_MS;
+	pthread_mutex_unlock(&http_resolve_lock);
+}
+
+static void test_sort(void) {
+	HTTP_Addr in[5] = {
+		addr6("2001:db8::1"), addr6("2001:db8::2"), addr6("2001:db8::3"),
+		addr4("192.0.2.1"), addr4("192.0.2.2"),
+	};
+	const char *want[5] = { "2001:db8::1", "192.0.2.1", "2001:db8::2", "192.0.2.2", "2001:db8::3" };
+	HTTP_Addr out[5];
+	size_t n = http_resolve_sort(out, in, 5);
+	CHECK(n == 5, "sort kept %zu of 5 addresses", n);
+	for (size_t i = 0; i < n; i++)
+		CHECK(addr_is(&out[i], want[i]), "sorted address %zu is not %s", i, want[i]);
+}
+
+static void test_ttl(void) {
+	http_resolve_cache_clear();
+	const char *host = "127.0.0.1";
+	HTTP_Addr out[HTTP_RESOLVE_MAX_ADDRS];
+	size_t n;
+
+	uint64_t before = http_now_ms();
+	int rc = http_resolve(host, 8080, out, HTTP_RESOLVE_MAX_ADDRS, &n);
+	uint64_t after = http_now_ms();
+	CHECK(rc == 0 && n == 1 && addr_is(&out[0], host) && addr_port(&out[0]) == 8080, "lookup of %s failed", host);
+
+	HTTP_ResolveEntry *e = cache_entry(host);
+	CHECK(strcmp(e->host, host) == 0 && e->count == 1, "answer was not cached");
+	CHECK(e->expires >= before + HTTP_RESOLVE_TTL_MS && e->expires <= after + HTTP_RESOLVE_TTL_MS,
+		"cached for %lld ms, not %d", (long long)(e->expires - before), HTTP_RESOLVE_TTL_MS);
+
+	// While the entry is fresh its answer is served as is, whatever the
+	// name would resolve to now.
+	e->addrs[0] = addr4("192.0.2.7");
+	rc = http_resolve(host, 9090, out, HTTP_RESOLVE_MAX_ADDRS, &n);
+	CHECK(rc == 0 && n == 1 && addr_is(&out[0], "192.0.2.7"), "fresh entry was not used");
+	CHECK(addr_port(&out[0]) == 9090, "cached answer has port %u, not 9090", addr_port(&out[0]));
+
+	// Once it expires the name is looked up again.
+	e->expires = http_now_ms();
+	rc = http_resolve(host, 8080, out, HTTP_RESOLVE_MAX_ADDRS, &n);
+	CHECK(rc == 0 && n == 1 && addr_is(&out[0], host), "expired entry was still used");
+	CHECK(e->expires > http_now_ms() && addr_is(&e->addrs[0], host), "expired entry was not refreshed");
+
+	// Unknown names are cached for the shorter negative TTL. Without a
+	// resolver the lookup fails transiently and nothing is cached.
+	const char *unknown = "no-such-host.invalid";
+	before = http_now_ms();
+	rc = http_resolve(unknown, 80, out, HTTP_RESOLVE_MAX_ADDRS, &n);
+	CHECK(rc < 0 && n == 0, "%s resolved", unknown);
+	e = cache_entry(unknown);
+	if (strcmp(e->host, unknown) == 0) {
+		CHECK(e->count == 0, "negative entry holds addresses");
+		CHECK(e->expires >= before + HTTP_RESOLVE_NEGATIVE_TTL_MS && e->expires <= http_now_ms() + HTTP_RESOLVE_NEGATIVE_TTL_MS,
+			"negative answer cached for %lld ms, not %d", (long long)(e->expires - before), HTTP_RESOLVE_NEGATIVE_TTL_MS);
+	} else {
+		printf("skip negative TTL: %s did not resolve to a definite no\n", unknown);
+	}
+}
+
+// Listens on ip:*port, picking the port when it is 0.
+static int listen_on(const char *ip, uint16_t *port, int backlog) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	HTTP_Addr a = addr4(ip);
+	a.in.sin_port = htons(*port);
+	socklen_t len = sizeof(a.in);
+	if (fd < 0 || bind(fd, &a.sa, len) < 0 || listen(fd, backlog) < 0 || getsockname(fd, &a.sa, &len) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	*port = addr_port(&a);
+	return fd;
+}
+
+// Seeds host with first then 127.0.0.1 and expects http_connect to end
+// up on the listener, well before the connect timeout. Returns how long
+// it took in ms.
+static uint64_t check_fallback(const char *host, const char *first, uint16_t port) {
+	HTTP_Addr addrs[2] = { addr4(first), addr4("127.0.0.1") };
+	seed(host, addrs, 2);
+
+	uint64_t start = http_now_ms();
+	int fd = http_connect(host, port);
+	uint64_t took = http_now_ms() - start;
+	CHECK(fd >= 0, "no fallback from %s", first);
+	if (fd < 0) return took;
+
+	HTTP_Addr peer;
+	socklen_t len = sizeof(peer);
+	getpeername(fd, &peer.sa, &len);
+	CHECK(addr_is(&peer, "127.0.0.1") && addr_port(&peer) == port, "connected somewhere other than the listener");
+	CHECK(took < 2 * HTTP_CONNECT_ATTEMPT_DELAY_MS, "fallback from %s took %llu ms", first, (unsigned long long) took);
+	close(fd);
+	return took;
+}
+
+static void test_fallback(void) {
+	http_resolve_cache_clear();
+	uint16_t port = 0;
+	int lfd = listen_on("127.0.0.1", &port, 16);
+
+	// The listener is bound to 127.0.0.1 only, so 127.0.0.2 refuses and
+	// the next address is tried at once.
+	uint64_t took = check_fallback("refused.test", "127.0.0.2", port);
+	CHECK(took < HTTP_CONNECT_ATTEMPT_DELAY_MS, "refused address held up the fallback for %llu ms", (unsigned long long) took);
+
+	// A listener whose accept queue is full drops SYNs, so an attempt on
+	// it hangs like one on an unreachable host. The next address must be
+	// tried after HTTP_CONNECT_ATTEMPT_DELAY_MS, not after the timeout.
+	int sfd = listen_on("127.0.0.3", &port, 0);
+	int fill[4];
+	for (size_t i = 0; i < 4; i++) {
+		HTTP_Addr a = addr4("127.0.0.3");
+		a.in.sin_port = htons(port);
+		fill[i] = socket(AF_INET, SOCK_STREAM, 0);
+		http_set_nonblocking(fill[i]);
+		connect(fill[i], &a.sa, sizeof(a.in));
+	}
+	usleep(50000);
+	took = check_fallback("stalled.test", "127.0.0.3", port);
+	CHECK(took + 20 >= HTTP_CONNECT_ATTEMPT_DELAY_MS, "stalled address was given up after only %llu ms", (unsigned long long) took);
+	for (size_t i = 0; i < 4; i++) close(fill[i]);
+	close(sfd);
+
+	// With nothing reachable the connect fails rather than hanging.
+	HTTP_Addr none[1] = { addr4("127.0.0.2") };
+	seed("none.test", none, 1);
+	int fd = http_connect("none.test", port);
+	CHECK(fd < 0, "connected with no reachable address");
+	if (fd >= 0) close(fd);
+
+	close(lfd);
+}
+
+int main(void) {
+	test_sort();
+	test_ttl();
+	test_fallback();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all resolver checks passed\n");
+	return 0;
+}
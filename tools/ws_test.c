@@ -0,0 +1,284 @@
+// Checks WebSocket frame parsing and validation against a live server.
+//
+//   ws_test
+//       Runs an echo server on an abstract Unix socket in a second
+//       thread and sends it well-formed and malformed frames, whole and
+//       a byte at a time. Exits non-zero if any check fails.
+
+#include <signal.h>
+
+#define HTTP_IMPLEMENTATION
+#include "../http.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+#define LISTEN_ADDR "unix:@http-ws-test"
+#define MAX_MESSAGE 1024
+
+#define FIN 0x80
+#define RSV1 0x40
+
+typedef struct {
+	uint8_t b0; // FIN, RSV and opcode
+	bool unmasked; // client frames must be masked
+	const char *payload; // NULL: len bytes of 'x'
+	size_t len; // 0 with a payload: strlen
+	uint64_t claim; // when set, the declared length; no payload is sent
+} Frame;
+
+typedef struct {
+	const char *name;
+	Frame send[4];
+	size_t send_count;
+	bool bytewise; // one byte per write, so frames arrive split
+	Frame want[3]; // what the server sends back, in order
+	size_t want_count;
+	bool closes; // the server hangs up after the last wanted frame
+} Case;
+
+#define CLOSE_NORMAL "\x03\xe8"
+#define CLOSE_PROTOCOL "\x03\xea"
+#define CLOSE_TOO_BIG "\x03\xf1"
+
+static const Case cases[] = {
+	{ "text", { { FIN | HTTP_WS_OP_TEXT, false, "hello" } }, 1, false,
+		{ { FIN | HTTP_WS_OP_TEXT, false, "hello" } }, 1, false },
+	{ "text split", { { FIN | HTTP_WS_OP_TEXT, false, "hello" } }, 1, true,
+		{ { FIN | HTTP_WS_OP_TEXT, false, "hello" } }, 1, false },
+	{ "16-bit length", { { FIN | HTTP_WS_OP_BINARY, false, NULL, 300 } }, 1, false,
+		{ { FIN | HTTP_WS_OP_BINARY, false, NULL, 300 } }, 1, false },
+	{ "16-bit length split", { { FIN | HTTP_WS_OP_BINARY, false, NULL, 300 } }, 1, true,
+		{ { FIN | HTTP_WS_OP_BINARY, false, NULL, 300 } }, 1, false },
+	{ "fragments around a ping", {
+			{ HTTP_WS_OP_TEXT, false, "hel" },
+			{ FIN | HTTP_WS_OP_PING, false, "p" },
+			{ FIN | HTTP_WS_OP_CONT, false, "lo" } }, 3, false,
+		{ { FIN | HTTP_WS_OP_PONG, false, "p" }, { FIN | HTTP_WS_OP_TEXT, false, "hello" } }, 2, false },
+	{ "fragments split", {
+			{ HTTP_WS_OP_BINARY, false, NULL, 200 },
+			{ FIN | HTTP_WS_OP_CONT, false, NULL, 100 } }, 2, true,
+		{ { FIN | HTTP_WS_OP_BINARY, false, NULL, 300 } }, 1, false },
+	{ "close", { { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_NORMAL } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_NORMAL } }, 1, true },
+	{ "unmasked", { { FIN | HTTP_WS_OP_TEXT, true, "hello" } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_PROTOCOL } }, 1, true },
+	{ "reserved bit", { { FIN | RSV1 | HTTP_WS_OP_TEXT, false, "hello" } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_PROTOCOL } }, 1, true },
+	{ "unknown opcode", { { FIN | 0x3, false, "hello" } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_PROTOCOL } }, 1, true },
+	{ "fragmented ping", { { HTTP_WS_OP_PING, false, "p" } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_PROTOCOL } }, 1, true },
+	{ "long ping", { { FIN | HTTP_WS_OP_PING, false, NULL, 126 } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_PROTOCOL } }, 1, true },
+	{ "continuation first", { { FIN | HTTP_WS_OP_CONT, false, "lo" } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_PROTOCOL } }, 1, true },
+	{ "text inside a message", {
+			{ HTTP_WS_OP_TEXT, false, "hel" },
+			{ FIN | HTTP_WS_OP_TEXT, false, "lo" } }, 2, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_PROTOCOL } }, 1, true },
+	{ "frame over the limit", { { FIN | HTTP_WS_OP_BINARY, false, NULL, MAX_MESSAGE + 1 } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_TOO_BIG } }, 1, true },
+	{ "fragments over the limit", {
+			{ HTTP_WS_OP_BINARY, false, NULL, MAX_MESSAGE },
+			{ FIN | HTTP_WS_OP_CONT, false, NULL, 1 } }, 2, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_TOO_BIG } }, 1, true },
+	{ "64-bit length", { { FIN | HTTP_WS_OP_BINARY, false, NULL, 0, 0x7fffffffffffffffull } }, 1, false,
+		{ { FIN | HTTP_WS_OP_CLOSE, false, CLOSE_TOO_BIG } }, 1, true },
+};
+
+static HTTP_Server serv;
+
+static void echo(void *ctx, HTTP_WebSocket *ws, uint8_t opcode, const uint8_t *data, size_t len) {
+	UNUSED(ctx);
+	http_ws_send(ws, opcode, data, len);
+}
+
+static void *serve(void *arg) {
+	UNUSED(arg);
+	http_server_run(&serv);
+	return NULL;
+}
+
+static size_t frame_len(const Frame *f) {
+	return f->payload && !f->len ? strlen(f->payload) : f->len;
+}
+
+static void frame_payload(const Frame *f, uint8_t *out) {
+	size_t len = frame_len(f);
+	if (f->payload) memcpy(out, f->payload, len);
+	else memset(out, 'x', len);
+}
+
+// Appends f as a client would send it.
+static void frame_build(HTTP_StringBuilder *sb, const Frame *f) {
+	static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	size_t len = frame_len(f);
+	uint64_t declared = f->claim ? f->claim : len;
+	uint8_t mask = f->unmasked ? 0 : 0x80;
+
+	http_sb_append_char(sb, (char) f->b0);
+	if (declared < 126) {
+		http_sb_append_char(sb, (char)(mask | declared));
+	} else if (declared <= 0xffff) {
+		http_sb_append_char(sb, (char)(mask | 126));
+		http_sb_append_char(sb, (char)(declared >> 8));
+		http_sb_append_char(sb, (char) declared);
+	} else {
+		http_sb_append_char(sb, (char)(mask | 127));
+		for (int i = 0; i < 8; i++) http_sb_append_char(sb, (char)(declared >> (56 - 8 * i)));
+	}
+	if (!f->unmasked) http_sb_append_strn(sb, (const char *) key, 4);
+	if (f->claim) return;
+
+	uint8_t *payload = (uint8_t *) malloc(len + 1);
+	frame_payload(f, payload);
+	if (!f->unmasked) http_ws_mask(payload, len, key);
+	http_sb_append_strn(sb, (const char *) payload, len);
+	free(payload);
+}
+
+static bool read_full(int fd, uint8_t *buf, size_t len) {
+	size_t got = 0;
+	while (got < len) {
+		ssize_t n = recv(fd, buf + got, len - got, 0);
+		if (n <= 0) return false;
+		got += (size_t) n;
+	}
+	return true;
+}
+
+// Reads one server frame; its payload is returned in *payload and must
+// be freed.
+static bool frame_read(int fd, uint8_t *b0, uint8_t **payload, size_t *len) {
+	uint8_t h[8];
+	if (!read_full(fd, h, 2)) return false;
+	*b0 = h[0];
+	uint64_t plen = h[1] & 0x7f;
+	if (h[1] & 0x80) return false; // server frames are never masked
+	if (plen == 126) {
+		if (!read_full(fd, h, 2)) return false;
+		plen = (uint64_t) h[0] << 8 | h[1];
+	} else if (plen == 127) {
+		if (!read_full(fd, h, 8)) return false;
+		plen = 0;
+		for (int i = 0; i < 8; i++) plen = plen << 8 | h[i];
+	}
+	if (plen > 1 << 20) return false;
+	*len = (size_t) plen;
+	*payload = (uint8_t *) malloc(*len + 1);
+	return read_full(fd, *payload, *len);
+}
+
+// Connects and completes the opening handshake. Returns -1 on failure.
+static int ws_connect(void) {
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	const char *name = strchr(LISTEN_ADDR, '@') + 1;
+	memcpy(a.sun_path + 1, name, strlen(name));
+	socklen_t alen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name));
+
+	int fd = -1;
+	// The server thread may not be listening yet.
+	for (int tries = 0; tries < 100; tries++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *) &a, alen) == 0) break;
+		close(fd);
+		fd = -1;
+		usleep(10000);
+	}
+	if (fd < 0) return -1;
+
+	struct timeval tv = { .tv_sec = 2 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	// The key and accept value from RFC 6455 section 1.3.
+	const char *req = "GET /ws HTTP/1.1\r\nHost: test\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	send(fd, req, strlen(req), MSG_NOSIGNAL);
+
+	char head[512];
+	size_t len = 0;
+	while (len < sizeof(head) - 1) {
+		ssize_t n = recv(fd, head + len, 1, 0);
+		if (n <= 0) break;
+		len++;
+		if (len >= 4 && memcmp(head + len - 4, "\r\n\r\n", 4) == 0) break;
+	}
+	head[len] = '\0';
+	if (strncmp(head, "HTTP/1.1 101 ", 13) != 0 || !strstr(head, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n")) {
+		fprintf(stderr, "handshake failed:\n%s\n", head);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void run(const Case *c) {
+	int fd = ws_connect();
+	CHECK(fd >= 0, "%s: no connection", c->name);
+	if (fd < 0) return;
+
+	HTTP_StringBuilder out = http_sb_create(256);
+	for (size_t i = 0; i < c->send_count; i++) frame_build(&out, &c->send[i]);
+	if (c->bytewise) {
+		for (size_t i = 0; i < out.cnt; i++) {
+			send(fd, out.str + i, 1, MSG_NOSIGNAL);
+			if (i < 16) usleep(2000);
+		}
+	} else {
+		send(fd, out.str, out.cnt, MSG_NOSIGNAL);
+	}
+	http_sb_destroy(&out);
+
+	for (size_t i = 0; i < c->want_count; i++) {
+		const Frame *w = &c->want[i];
+		uint8_t b0;
+		uint8_t *payload = NULL;
+		size_t len;
+		if (!frame_read(fd, &b0, &payload, &len)) {
+			CHECK(false, "%s: frame %zu never came", c->name, i);
+			free(payload);
+			break;
+		}
+		uint8_t *want = (uint8_t *) malloc(frame_len(w) + 1);
+		frame_payload(w, want);
+		CHECK(b0 == w->b0, "%s: frame %zu is 0x%02x, not 0x%02x", c->name, i, b0, w->b0);
+		CHECK(len == frame_len(w) && memcmp(payload, want, len) == 0, "%s: frame %zu has the wrong payload", c->name, i);
+		free(want);
+		free(payload);
+	}
+
+	if (c->closes) {
+		uint8_t b;
+		CHECK(recv(fd, &b, 1, 0) == 0, "%s: connection left open", c->name);
+	}
+	close(fd);
+}
+
+int main(void) {
+	signal(SIGPIPE, SIG_IGN);
+
+	serv = http_server_create_at(LISTEN_ADDR);
+	serv.limits.max_body_bytes = MAX_MESSAGE;
+	http_server_websocket(&serv, "/ws", NULL, echo, NULL, NULL);
+	pthread_t t;
+	pthread_create(&t, NULL, serve, NULL);
+	pthread_detach(t);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) run(&cases[i]);
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all WebSocket checks passed\n");
+	return 0;
+}